@@ -16,8 +16,12 @@ typedef unsigned int cdbi_t; /* compatibility */
 
 /* common routines */
 unsigned cdb_hash(const void *buf, unsigned len);
+unsigned cdb_shard(unsigned hval, unsigned nshards);
 unsigned cdb_unpack(const unsigned char buf[4]);
 void cdb_pack(unsigned num, unsigned char buf[4]);
+/* 64bit values, e.g. numbers stored as values; doubles as their bits */
+unsigned long long cdb_unpack64(const unsigned char buf[8]);
+void cdb_pack64(unsigned long long num, unsigned char buf[8]);
 
 struct cdb {
   int cdb_fd;			/* file descriptor */
@@ -27,9 +31,29 @@ struct cdb {
   const unsigned char *cdb_mem; /* mmap'ed file memory */
   unsigned cdb_vpos, cdb_vlen;	/* found data */
   unsigned cdb_kpos, cdb_klen;	/* found key */
+  unsigned cdb_flags;		/* CDB_F_xxx format flags */
+  unsigned cdb_mphpos;		/* perfect hash index position */
+  unsigned cdb_metapos;		/* metadata position, 0 = none */
+  struct cdb_bcache *cdb_bc;	/* block cache, pread mode (cdb_mem NULL) */
 };
 
-#define CDB_STATIC_INIT {0,0,0,0,0,0,0,0}
+#define CDB_STATIC_INIT {0,0,0,0,0,0,0,0,0,0,0,0}
+
+/* The record found by the reentrant (_r) routines, which only read the
+ * struct cdb: threads can share one mapped database, each with results
+ * of its own.  cdb_datapos() and friends work on it too.  A pread mode
+ * struct cdb has a block cache, so calls on it must be serialized. */
+struct cdb_result {
+  unsigned cdb_vpos, cdb_vlen;	/* found data */
+  unsigned cdb_kpos, cdb_klen;	/* found key */
+};
+
+/* format flags, set by cdb_init() from the extension area, and where
+ * the memory comes from */
+#define CDB_F_MPH	0x01	/* minimal perfect hash index, no hash tables */
+#define CDB_F_DEDUP	0x02	/* records may share the value of another */
+#define CDB_F_MEM	0x04	/* cdb_mem is the caller's, see cdb_init_mem() */
+#define CDB_F_LOADED	0x08	/* cdb_mem was read in by cdb_init_load() */
 
 #define cdb_datapos(c) ((c)->cdb_vpos)
 #define cdb_datalen(c) ((c)->cdb_vlen)
@@ -40,6 +64,23 @@ struct cdb {
 int cdb_init(struct cdb *cdbp, int fd);
 void cdb_free(struct cdb *cdbp);
 
+/* Open without mapping the file: the TOC is read once, the rest with
+ * pread() through a CLOCK cache of cachesize bytes of 4KB blocks.  The
+ * lookup, sequential and read routines work as usual, except that a
+ * pointer from cdb_get() is only valid until the next call on cdbp. */
+int cdb_init_pread(struct cdb *cdbp, int fd, unsigned cachesize);
+int cdb_bcache_stat(const struct cdb *cdbp,
+                    unsigned long long *hits, unsigned long long *misses);
+
+/* Databases held in memory rather than mapped from a file; cdb_fd is
+ * -1.  cdb_init_mem() uses the len bytes at mem, which the caller keeps
+ * unchanged until cdb_free().  cdb_init_load() reads the whole file at
+ * fd into anonymous memory it frees with cdb_free(); fd can be closed
+ * right away.  CDB_LOAD_HUGE asks for transparent huge pages. */
+#define CDB_LOAD_HUGE	0x01
+int cdb_init_mem(struct cdb *cdbp, const void *mem, unsigned len);
+int cdb_init_load(struct cdb *cdbp, int fd, unsigned flags);
+
 int cdb_read(const struct cdb *cdbp,
              void *buf, unsigned len, unsigned pos);
 #define cdb_readdata(cdbp, buf) \
@@ -54,24 +95,97 @@ const void *cdb_get(const struct cdb *cdbp, unsigned len, unsigned pos);
         cdb_get((cdbp), cdb_keylen(cdbp), cdb_keypos(cdbp))
 
 int cdb_find(struct cdb *cdbp, const void *key, unsigned klen);
+/* the same with hval = cdb_hash(key, klen) already known, e.g. from
+ * picking the shard with cdb_shard(); CDB_F_MPH databases ignore it */
+int cdb_findh(struct cdb *cdbp, const void *key, unsigned klen,
+              unsigned hval);
+int cdb_find_r(const struct cdb *cdbp, const void *key, unsigned klen,
+               struct cdb_result *resp);
+int cdb_findh_r(const struct cdb *cdbp, const void *key, unsigned klen,
+                unsigned hval, struct cdb_result *resp);
 
 struct cdb_find {
-  struct cdb *cdb_cdbp;
+  const struct cdb *cdb_cdbp;
   unsigned cdb_hval;
   const unsigned char *cdb_htp, *cdb_htab, *cdb_htend;
   unsigned cdb_httodo;
   const void *cdb_key;
   unsigned cdb_klen;
+  unsigned cdb_hpos, cdb_hstart, cdb_hend; /* pread mode file offsets */
 };
 
 int cdb_findinit(struct cdb_find *cdbfp, struct cdb *cdbp,
                  const void *key, unsigned klen);
+int cdb_findinith(struct cdb_find *cdbfp, struct cdb *cdbp,
+                  const void *key, unsigned klen, unsigned hval);
 int cdb_findnext(struct cdb_find *cdbfp);
+/* cdb_findnext() stores what it finds in the struct cdb; these do not */
+int cdb_findinit_r(struct cdb_find *cdbfp, const struct cdb *cdbp,
+                   const void *key, unsigned klen);
+int cdb_findinith_r(struct cdb_find *cdbfp, const struct cdb *cdbp,
+                    const void *key, unsigned klen, unsigned hval);
+int cdb_findnext_r(struct cdb_find *cdbfp, struct cdb_result *resp);
+
+/* Ask the kernel to start reading the pages a later lookup of key will
+ * touch, without waiting for them: the index page, and the record pages
+ * too if the index page is resident already.  Returns 1 if record pages
+ * were named, 0 if only the index could be. */
+int cdb_prefetch(const struct cdb *cdbp, const void *key, unsigned klen);
+/* cdb_find() that fails with EAGAIN instead of touching a page of the
+ * index, key or value which is not resident (mapped databases only) */
+int cdb_find_nowait(struct cdb *cdbp, const void *key, unsigned klen);
 
 #define cdb_seqinit(cptr, cdbp) ((*(cptr))=2048)
 int cdb_seqnext(unsigned *cptr, struct cdb *cdbp);
+int cdb_seqnext_r(unsigned *cptr, const struct cdb *cdbp,
+                  struct cdb_result *resp);
+
+/* index and data statistics, see cdb_analyze() */
+
+#define CDB_STAT_PROBES	16	/* probe distances 0..14, then 15 or more */
+#define CDB_STAT_SIZES	33	/* sizes 0, then [2^(i-1), 2^i) */
+
+struct cdb_stat {
+  unsigned records;		/* records in the data section */
+  unsigned indexed;		/* records reachable through the index */
+  unsigned keys;		/* distinct keys among indexed records */
+  unsigned dupkeys;		/* keys with more than one record */
+  unsigned dead, deadbytes;	/* unreachable (zeroed by replace0) records */
+  unsigned shared;		/* records sharing the value of an earlier one */
+  unsigned long long keybytes;	/* total key size of indexed records */
+  unsigned long long valbytes;	/* and value size */
+  unsigned slots;		/* hash table slots */
+  unsigned maxprobe;		/* longest distance from a home slot */
+  double meanprobe;		/* average distance from a home slot */
+  unsigned maxmiss;		/* longest run of used slots an absent key
+				 * probes past before an empty one */
+  double meanmiss;		/* average of that over all home slots */
+  unsigned tslots[256], tused[256];	/* per hash table slots and entries */
+  unsigned probes[CDB_STAT_PROBES];	/* probe distance histogram */
+  unsigned ksizes[CDB_STAT_SIZES], vsizes[CDB_STAT_SIZES]; /* size hists */
+};
+
+int cdb_analyze(const struct cdb *cdbp, struct cdb_stat *stp);
+
+unsigned cdb_stat_sizeclass(unsigned size);
 
-/* old simple interface */
+/* What cdb_make_finish() records about the database it writes.
+ * cdb_info() returns 1, 0 (and a zeroed *ip) if the file has no such
+ * record, or -1. */
+struct cdb_info {
+  unsigned records;		/* indexed records */
+  unsigned keys;		/* distinct keys among them */
+  unsigned long long keybytes;	/* their total key size */
+  unsigned long long valbytes;	/* and value size; shared values count
+				 * for every record */
+  unsigned mflags;		/* CDB_MAKE_xxx it was built with */
+  unsigned hslots;		/* table slots per 256 records */
+};
+
+int cdb_info(const struct cdb *cdbp, struct cdb_info *ip);
+
+/* old simple interface, for standard (not CDB_F_MPH or CDB_F_DEDUP)
+ * databases */
 /* open file using standard routine, then: */
 int cdb_seek(int fd, const void *key, unsigned klen, unsigned *dlenp);
 int cdb_bread(int fd, void *buf, int len);
@@ -86,8 +200,45 @@ struct cdb_make {
   unsigned char cdb_buf[4096];	/* write buffer */
   unsigned char *cdb_bpos;	/* current buf position */
   struct cdb_rl *cdb_rec[256];	/* list of arrays of record infos */
+  unsigned cdb_mflags;		/* CDB_MAKE_xxx build options */
+  unsigned cdb_hslots;		/* table slots per 256 records, at least
+				 * 256; 0 = 512 (tables half full) */
+  struct cdb_stat *cdb_statp;	/* if set, table stats from cdb_make_finish */
+  /* bounded memory builds, see cdb_make_spill() */
+  int cdb_spillfd;		/* file receiving spilled record infos */
+  unsigned cdb_spillmax;	/* record infos kept in memory, 0 = no limit */
+  unsigned cdb_spilled;		/* record infos in the spill file */
+  unsigned cdb_nruns;		/* number of spilled runs */
+  struct cdb_run *cdb_runs;	/* where each run is in the spill file */
+  unsigned cdb_spillmem;	/* bytes record infos may take, runs included */
+  unsigned long long cdb_spillpeak; /* the most they took at once */
+  /* incremental writeback, see cdb_make_writeback() */
+  unsigned cdb_wbchunk;		/* bytes between writebacks, 0 = off */
+  unsigned cdb_wbflags;		/* CDB_WB_xxx */
+  unsigned cdb_wbrate;		/* bytes per second, 0 = no limit */
+  unsigned cdb_wbpos;		/* writeback started up to here */
+  unsigned cdb_wbprev;		/* start of the chunk being written back */
+  unsigned long long cdb_wbt0;	/* when writeback was set up, ns */
+  /* values written so far, with CDB_MAKE_DEDUP */
+  struct cdb_dval *cdb_dvals;	/* open addressing table by value hash */
+  unsigned cdb_dsize, cdb_dcnt;	/* its size (a power of 2) and use */
+  /* totals for the metadata block, see cdb_info() */
+  unsigned long long cdb_kbytes, cdb_vbytes; /* of the records added */
+  /* built in memory, see cdb_make_start_mem() */
+  unsigned char *cdb_mbuf;	/* the database so far, NULL = in cdb_fd */
+  unsigned cdb_msize;		/* size of cdb_mbuf */
+  unsigned cdb_mlen;		/* bytes of it written */
+  unsigned cdb_mpos;		/* where the next write goes */
+  int cdb_mgrow;		/* cdb_mbuf is ours to realloc() */
 };
 
+/* build options, set in cdb_mflags after cdb_make_start() */
+#define CDB_MAKE_MPH	0x01	/* minimal perfect hash index, unique keys */
+#define CDB_MAKE_DEDUP	0x02	/* store each distinct value once; records
+				 * are never removed or zeroed */
+#define CDB_MAKE_ROBINHOOD 0x04 /* place records by Robin Hood displacement:
+				 * same lookups, shorter longest probes */
+
 enum cdb_put_mode {
   CDB_PUT_ADD = 0,	/* add unconditionnaly, like cdb_make_add() */
 #define CDB_PUT_ADD	CDB_PUT_ADD
@@ -105,6 +256,13 @@ enum cdb_put_mode {
 };
 
 int cdb_make_start(struct cdb_make *cdbmp, int fd);
+/* build into memory rather than a file: into the size bytes at buf,
+ * failing with ENOSPC once they are full, or with buf NULL into a
+ * malloc()ed area grown as needed, size being a first guess.  After
+ * cdb_make_finish() the database is the cdb_mlen bytes at cdb_mbuf,
+ * which the caller free()s in the latter case.  cdb_fd is -1, and
+ * cdb_make_spill() and cdb_make_writeback() are not available. */
+int cdb_make_start_mem(struct cdb_make *cdbmp, void *buf, unsigned size);
 int cdb_make_add(struct cdb_make *cdbmp,
                  const void *key, unsigned klen,
                  const void *val, unsigned vlen);
@@ -118,10 +276,63 @@ int cdb_make_put(struct cdb_make *cdbmp,
                  const void *val, unsigned vlen,
                  enum cdb_put_mode mode);
 int cdb_make_finish(struct cdb_make *cdbmp);
+int cdb_make_spill(struct cdb_make *cdbmp, int fd, unsigned maxmem);
+
+/* Write the file back while building instead of all at the final
+ * fsync(): every chunk bytes, start writing them and wait for the
+ * previous chunk.  CDB_WB_DONTNEED drops chunks on the disk from the
+ * page cache; a nonzero maxrate (bytes per second) makes the builder
+ * sleep when it gets ahead of it.  Set up before adding anything. */
+#define CDB_WB_DONTNEED	0x01
+int cdb_make_writeback(struct cdb_make *cdbmp, unsigned chunk,
+                       unsigned flags, unsigned maxrate);
+
+/* Parallel builds: shards are built independently, e.g. one cdb_make
+ * per thread, each with its own file.  Their records are then appended
+ * to the final maker, in shard order, either from a shard maker that
+ * was never finished (cdb_make_append, which consumes it) or from a
+ * finished shard database (cdb_make_merge). */
+int cdb_make_append(struct cdb_make *cdbmp, struct cdb_make *shard);
+int cdb_make_merge(struct cdb_make *cdbmp, const struct cdb *cdbp);
+
+/* Copy the indexed records of cdbp for locality: first the records at
+ * the nhot positions in hot[] (in that order; e.g. those of the most
+ * used keys), then all others grouped by hash table and home slot, so
+ * the records one part of the index leads to share pages.  Records of
+ * one key keep their order if hot[] names all or none of them, as
+ * cdb_findnext() does; unreachable records are dropped. */
+int cdb_make_optimize(struct cdb_make *cdbmp, const struct cdb *cdbp,
+                      const unsigned *hot, unsigned nhot);
 
 /* Exposed for lua-tinycdb */
 void cdb_make_free(struct cdb_make *cdbmp);
 
+/* Lookup traces, for replaying real traffic against other files or
+ * options.  A trace file is CDB_TRACE_MAGIC and a version (4 bytes),
+ * then records of op(1) hits(1) hval(4) nsec(4) klen(4) key, numbers
+ * little-endian.  Records are put into a lock-free ring buffer and a
+ * thread of the trace writes them out; when the ring is full they are
+ * dropped rather than making the lookup wait. */
+
+#define CDB_TRACE_MAGIC	"cdbt"
+#define CDB_TRACE_VERSION 1
+#define CDB_TRACE_HDR	14	/* record bytes before the key */
+
+enum cdb_trace_op {
+  CDB_TRACE_GET = 1,		/* first value of a key */
+  CDB_TRACE_FIND_ALL,		/* all values of a key */
+  CDB_TRACE_SEQ			/* one step of a sequential scan */
+};
+
+struct cdb_trace;
+
+struct cdb_trace *cdb_trace_start(int fd, unsigned ringsize);
+int cdb_trace_put(struct cdb_trace *trp, enum cdb_trace_op op,
+                  unsigned hval, unsigned hits, unsigned nsec,
+                  const void *key, unsigned klen);
+int cdb_trace_stop(struct cdb_trace *trp,
+                   unsigned long long *written, unsigned long long *dropped);
+
 #ifdef __cplusplus
 } /* extern "C" */
 #endif
@@ -0,0 +1,269 @@
+/* cdb_analyze routine: index and data shape statistics
+ *
+ * This file is a part of lua-tinycdb.
+ */
+
+#include <stdlib.h>
+#include "cdb_int.h"
+
+unsigned
+cdb_stat_sizeclass(unsigned size)
+{
+  unsigned i = 0;
+  while (size) {
+    ++i;
+    size >>= 1;
+  }
+  return i;
+}
+
+/* account one indexed record found dist slots after its home slot;
+ * meanprobe holds the sum until _cdb_stat_done() */
+void internal_function
+_cdb_stat_probe(struct cdb_stat *stp, unsigned dist)
+{
+  ++stp->probes[dist < CDB_STAT_PROBES - 1 ? dist : CDB_STAT_PROBES - 1];
+  if (stp->maxprobe < dist)
+    stp->maxprobe = dist;
+  stp->meanprobe += dist;
+}
+
+/* account a run of len used slots followed by an empty one: an absent
+ * key whose home is in it probes past the rest of the run */
+static void
+stat_run(struct cdb_stat *stp, unsigned len)
+{
+  if (stp->maxmiss < len)
+    stp->maxmiss = len;
+  stp->meanmiss += (double)len * (len + 1) / 2;
+}
+
+/* account the next slot of a hash table, in order */
+void internal_function
+_cdb_stat_slot(struct cdb_stat *stp, struct cdb_srun *srp, int used)
+{
+  if (used)
+    ++srp->len;
+  else {
+    /* the run before the first empty slot is the end of the last one */
+    if (srp->empty)
+      stat_run(stp, srp->len);
+    else
+      srp->first = srp->len;
+    srp->empty = 1;
+    srp->len = 0;
+  }
+}
+
+/* done with the slots of a table; srp is ready for the next one */
+void internal_function
+_cdb_stat_table(struct cdb_stat *stp, struct cdb_srun *srp)
+{
+  if (srp->empty)
+    stat_run(stp, srp->len + srp->first);
+  else if (srp->len) {
+    /* full: an absent key is looked for in every slot */
+    if (stp->maxmiss < srp->len)
+      stp->maxmiss = srp->len;
+    stp->meanmiss += (double)srp->len * srp->len;
+  }
+  srp->len = srp->first = 0;
+  srp->empty = 0;
+}
+
+void internal_function
+_cdb_stat_done(struct cdb_stat *stp)
+{
+  if (stp->indexed)
+    stp->meanprobe /= stp->indexed;
+  if (stp->slots)
+    stp->meanmiss /= stp->slots;
+}
+
+static int
+cmp_hval(const void *a, const void *b)
+{
+  const struct cdb_rec *ra = (const struct cdb_rec *)a;
+  const struct cdb_rec *rb = (const struct cdb_rec *)b;
+  if (ra->hval != rb->hval)
+    return ra->hval < rb->hval ? -1 : 1;
+  return ra->rpos < rb->rpos ? -1 : ra->rpos > rb->rpos;
+}
+
+static int
+cmp_rpos(const void *a, const void *b)
+{
+  const struct cdb_rec *ra = (const struct cdb_rec *)a;
+  const struct cdb_rec *rb = (const struct cdb_rec *)b;
+  return ra->rpos < rb->rpos ? -1 : ra->rpos > rb->rpos;
+}
+
+static int
+samekey(const struct cdb *cdbp, unsigned a, unsigned b)
+{
+  unsigned klen = cdb_unpack(cdbp->cdb_mem + a);
+  return klen == cdb_unpack(cdbp->cdb_mem + b) &&
+         memcmp(cdbp->cdb_mem + a + 8, cdbp->cdb_mem + b + 8, klen) == 0;
+}
+
+/* count distinct and duplicated keys in recs[], sorted by hval:
+ * only records with equal hash values need their keys compared */
+static int
+count_keys(const struct cdb *cdbp, struct cdb_rec *recs, unsigned n,
+           struct cdb_stat *stp)
+{
+  unsigned *reps = NULL, *cnt = NULL, nreps, size = 0;
+  unsigned i, j, k;
+
+  for (i = 0; i < n; i = j) {
+    for (j = i + 1; j < n && recs[j].hval == recs[i].hval; ++j)
+      ;
+    /* group recs[i..j) shares a hash value; collect its distinct keys */
+    nreps = 0;
+    for (; i < j; ++i) {
+      for (k = 0; k < nreps && !samekey(cdbp, reps[k], recs[i].rpos); ++k)
+        ;
+      if (k < nreps) {
+        if (++cnt[k] == 2)
+          ++stp->dupkeys;
+        continue;
+      }
+      if (nreps == size) {
+        unsigned *r = (unsigned*)realloc(reps, (size + 16) * sizeof(*r));
+        unsigned *c = r ? (unsigned*)realloc(cnt, (size + 16) * sizeof(*c)) : NULL;
+        if (r) reps = r;
+        if (c) cnt = c;
+        if (!r || !c) {
+          free(reps);
+          free(cnt);
+          return errno = ENOMEM, -1;
+        }
+        size += 16;
+      }
+      reps[nreps] = recs[i].rpos;
+      cnt[nreps++] = 1;
+      ++stp->keys;
+    }
+  }
+  free(reps);
+  free(cnt);
+  return 0;
+}
+
+int
+cdb_analyze(const struct cdb *cdbp, struct cdb_stat *stp)
+{
+  const unsigned char *mem = cdbp->cdb_mem;
+  unsigned dend = cdbp->cdb_dend;
+  struct cdb_rec *recs;
+  unsigned n, t, i, pos, len, klen, vlen, rvlen;
+  struct cdb_result res;
+  struct cdb_srun sr;
+
+  memset(stp, 0, sizeof(*stp));
+  memset(&sr, 0, sizeof(sr));
+  if (!mem) /* pread mode */
+    return errno = EINVAL, -1;
+
+  /* size the index */
+  if (cdbp->cdb_flags & CDB_F_MPH)
+    n = cdb_unpack(mem + cdbp->cdb_mphpos + 4);
+  else
+    for (n = 0, t = 0; t < 256; ++t) {
+      len = cdb_unpack(mem + (t << 3) + 4);
+      pos = cdb_unpack(mem + (t << 3));
+      if (len && (len > (cdbp->cdb_fsize >> 3) || pos < dend ||
+                  pos > cdbp->cdb_fsize || (len << 3) > cdbp->cdb_fsize - pos))
+        return errno = EPROTO, -1;
+      n += len;
+    }
+  recs = (struct cdb_rec*)malloc((n + 1) * sizeof(*recs));
+  if (!recs)
+    return errno = ENOMEM, -1;
+
+  /* walk the index, collecting every (hval, rpos) it points to */
+  if (cdbp->cdb_flags & CDB_F_MPH) {
+    const unsigned char *slots = mem + cdbp->cdb_mphpos + 12 +
+                                 (cdb_unpack(mem + cdbp->cdb_mphpos + 8) << 2);
+    stp->slots = n;
+    for (i = 0; i < n; ++i) {
+      recs[stp->indexed].hval = 0;
+      recs[stp->indexed].rpos = cdb_unpack(slots + (i << 2));
+      if (recs[stp->indexed].rpos) {
+        ++stp->indexed;
+        _cdb_stat_probe(stp, 0);
+      }
+    }
+  }
+  else
+    for (t = 0; t < 256; ++t) {
+      const unsigned char *htab;
+      len = cdb_unpack(mem + (t << 3) + 4);
+      htab = mem + cdb_unpack(mem + (t << 3));
+      stp->tslots[t] = len;
+      stp->slots += len;
+      for (i = 0; i < len; ++i) {
+        unsigned hval = cdb_unpack(htab + (i << 3));
+        pos = cdb_unpack(htab + (i << 3) + 4);
+        _cdb_stat_slot(stp, &sr, pos != 0);
+        if (!pos)
+          continue;
+        ++stp->tused[t];
+        _cdb_stat_probe(stp, (i + len - (hval >> 8) % len) % len);
+        recs[stp->indexed].hval = hval;
+        recs[stp->indexed++].rpos = pos;
+      }
+      _cdb_stat_table(stp, &sr);
+    }
+  for (i = 0; i < stp->indexed; ++i)
+    if (recs[i].rpos < 2048 || recs[i].rpos > dend - 8 ||
+        cdb_unpack(mem + recs[i].rpos) > dend - recs[i].rpos - 8) {
+      free(recs);
+      return errno = EPROTO, -1;
+    }
+  _cdb_stat_done(stp);
+
+  /* distinct and duplicated keys */
+  if (cdbp->cdb_flags & CDB_F_MPH)
+    stp->keys = stp->indexed; /* unique by construction */
+  else {
+    qsort(recs, stp->indexed, sizeof(*recs), cmp_hval);
+    if (count_keys(cdbp, recs, stp->indexed, stp) < 0) {
+      free(recs);
+      return -1;
+    }
+  }
+
+  /* walk the data section; records no slot points to are dead */
+  qsort(recs, stp->indexed, sizeof(*recs), cmp_rpos);
+  for (i = 0, pos = 2048; pos <= dend - 8; pos += 8 + klen + rvlen) {
+    klen = cdb_unpack(mem + pos);
+    rvlen = cdb_unpack(mem + pos + 4);
+    if (dend - klen < pos + 8 ||
+        _cdb_value(cdbp, pos + 8 + klen, rvlen, &res) < 0) {
+      free(recs);
+      return errno = EPROTO, -1;
+    }
+    vlen = res.cdb_vlen;
+    if (rvlen == CDB_VREF && (cdbp->cdb_flags & CDB_F_DEDUP)) {
+      rvlen = 8; /* a shared value */
+      ++stp->shared;
+    }
+    ++stp->records;
+    while (i < stp->indexed && recs[i].rpos < pos)
+      ++i;
+    if (i < stp->indexed && recs[i].rpos == pos) {
+      stp->keybytes += klen;
+      stp->valbytes += vlen;
+      ++stp->ksizes[cdb_stat_sizeclass(klen)];
+      ++stp->vsizes[cdb_stat_sizeclass(vlen)];
+    }
+    else {
+      ++stp->dead;
+      stp->deadbytes += 8 + klen + rvlen;
+    }
+  }
+
+  free(recs);
+  return 0;
+}
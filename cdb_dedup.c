@@ -0,0 +1,148 @@
+/* shared values
+ *
+ * This file is a part of lua-tinycdb.
+ *
+ * A database built with CDB_MAKE_DEDUP stores every distinct value
+ * once.  The first record with a value holds it inline as usual; later
+ * records with the same value have CDB_VREF as their value length, and
+ * instead of the value an 8-byte vpos(4) vlen(4) reference to it.  The
+ * extension area carries a CDB_EXT_DEDUP section so that readers know
+ * to resolve them.  While building, the values written so far are
+ * found by their hash in an open addressing table, and compared to the
+ * new one byte for byte before it is shared.
+ */
+
+#include <sys/types.h>
+#include <stdlib.h>
+#include <unistd.h>
+#include "cdb_int.h"
+
+struct cdb_dval {
+  unsigned h;			/* value hash */
+  unsigned vpos, vlen;		/* where the value is; vpos 0 = free */
+};
+
+int internal_function
+_cdb_value(const struct cdb *cdbp, unsigned pos, unsigned vlen,
+           struct cdb_result *resp)
+{
+  const unsigned char *p;
+  unsigned dend = cdbp->cdb_dend;
+
+  if (vlen == CDB_VREF && (cdbp->cdb_flags & CDB_F_DEDUP)) {
+    if (dend - 8 < pos)
+      return errno = EPROTO, -1;
+    if (!(p = (const unsigned char *)cdb_get(cdbp, 8, pos)))
+      return -1;
+    pos = cdb_unpack(p);
+    vlen = cdb_unpack(p + 4);
+    if (pos < 2048)
+      return errno = EPROTO, -1;
+  }
+  if (dend < vlen || dend - vlen < pos)
+    return errno = EPROTO, -1;
+  resp->cdb_vpos = pos;
+  resp->cdb_vlen = vlen;
+  return 0;
+}
+
+/* whether the len bytes at pos of the file being built are val */
+static int
+dedup_same(struct cdb_make *cdbmp, unsigned pos,
+           const unsigned char *val, unsigned len)
+{
+  /* what is not yet written out is at the start of cdb_buf */
+  unsigned written = cdbmp->cdb_dpos - (unsigned)(cdbmp->cdb_bpos - cdbmp->cdb_buf);
+  unsigned char buf[4096];
+  unsigned n;
+  int l;
+
+  while (len && pos < written) {
+    n = written - pos;
+    if (n > len)
+      n = len;
+    if (n > sizeof(buf))
+      n = sizeof(buf);
+    l = _cdb_make_pread(cdbmp, buf, n, pos);
+    if (l < 0 && errno == EINTR)
+      continue;
+    if (l <= 0)
+      return l < 0 ? -1 : (errno = EPROTO, -1);
+    if (memcmp(buf, val, (unsigned)l) != 0)
+      return 0;
+    pos += l; val += l; len -= l;
+  }
+  return !len || memcmp(cdbmp->cdb_buf + (pos - written), val, len) == 0;
+}
+
+static int
+dedup_grow(struct cdb_make *cdbmp)
+{
+  unsigned size = cdbmp->cdb_dsize ? cdbmp->cdb_dsize << 1 : 1024;
+  struct cdb_dval *tab, *old = cdbmp->cdb_dvals;
+  unsigned i, j;
+
+  if (size < cdbmp->cdb_dsize ||
+      !(tab = (struct cdb_dval *)calloc(size, sizeof(*tab))))
+    return errno = ENOMEM, -1;
+  for (i = 0; i < cdbmp->cdb_dsize; ++i)
+    if (old[i].vpos) {
+      for (j = old[i].h & (size - 1); tab[j].vpos; j = (j + 1) & (size - 1))
+        ;
+      tab[j] = old[i];
+    }
+  free(old);
+  cdbmp->cdb_dvals = tab;
+  cdbmp->cdb_dsize = size;
+  return 0;
+}
+
+int internal_function
+_cdb_make_dedup(struct cdb_make *cdbmp, const void *val, unsigned vlen,
+                unsigned vpos, unsigned *refp)
+{
+  struct cdb_dval *dv;
+  unsigned h[2], i;
+  int r;
+
+  if (cdbmp->cdb_dcnt >= cdbmp->cdb_dsize >> 1 && dedup_grow(cdbmp) < 0)
+    return -1;
+  _cdb_mph_hash(val, vlen, 0, h);
+  for (i = h[0] & (cdbmp->cdb_dsize - 1); ; i = (i + 1) & (cdbmp->cdb_dsize - 1)) {
+    dv = cdbmp->cdb_dvals + i;
+    if (!dv->vpos)
+      break;
+    if (dv->h != h[0] || dv->vlen != vlen)
+      continue;
+    if ((r = dedup_same(cdbmp, dv->vpos, (const unsigned char *)val, vlen)) != 0) {
+      if (r < 0)
+        return -1;
+      *refp = dv->vpos;
+      return 1;
+    }
+  }
+  /* a new value, to be written inline at vpos */
+  dv->h = h[0];
+  dv->vpos = vpos;
+  dv->vlen = vlen;
+  cdbmp->cdb_dcnt++;
+  return 0;
+}
+
+int internal_function
+_cdb_make_dedup_ext(struct cdb_make *cdbmp)
+{
+  unsigned char hdr[12];
+  unsigned n = 0;
+
+  /* an mph index already started the extension area */
+  if (!(cdbmp->cdb_mflags & CDB_MAKE_MPH)) {
+    memcpy(hdr, CDB_EXT_MAGIC, 4);
+    n = 4;
+  }
+  cdb_pack(CDB_EXT_DEDUP, hdr + n);
+  cdb_pack(0, hdr + n + 4);
+  if (0xffffffff - cdbmp->cdb_dpos < n + 8)
+    return errno = ENOMEM, -1;
+  return _cdb_make_write(cdbmp, hdr, n + 8);
+}
@@ -9,19 +9,57 @@
 
 int
 cdb_find(struct cdb *cdbp, const void *key, unsigned klen)
+{
+  /* a perfect hash index does not use the cdb hash value */
+  return cdb_findh(cdbp, key, klen,
+                   (cdbp->cdb_flags & CDB_F_MPH) ? 0 : cdb_hash(key, klen));
+}
+
+int
+cdb_findh(struct cdb *cdbp, const void *key, unsigned klen, unsigned hval)
+{
+  struct cdb_result res;
+  int r = cdb_findh_r(cdbp, key, klen, hval, &res);
+  if (r > 0)
+    _cdb_setfound(cdbp, &res);
+  return r;
+}
+
+int
+cdb_find_r(const struct cdb *cdbp, const void *key, unsigned klen,
+           struct cdb_result *resp)
+{
+  return cdb_findh_r(cdbp, key, klen,
+                     (cdbp->cdb_flags & CDB_F_MPH) ? 0 : cdb_hash(key, klen),
+                     resp);
+}
+
+int
+cdb_findh_r(const struct cdb *cdbp, const void *key, unsigned klen,
+            unsigned hval, struct cdb_result *resp)
 {
   const unsigned char *htp;	/* hash table pointer */
   const unsigned char *htab;	/* hash table */
   const unsigned char *htend;	/* end of hash table */
+  const unsigned char *p;
   unsigned httodo;		/* ht bytes left to look */
   unsigned pos, n;
-
-  unsigned hval;
+  int r;
 
   if (klen >= cdbp->cdb_dend)	/* if key size is too large */
     return 0;
 
-  hval = cdb_hash(key, klen);
+  if (cdbp->cdb_bc) {		/* pread mode */
+    struct cdb_find cdbf;
+    if ((r = _cdb_bc_findinit(&cdbf, cdbp, key, klen, hval)) <= 0)
+      return r;
+    return _cdb_bc_findnext(&cdbf, resp);
+  }
+
+  if (cdbp->cdb_flags & CDB_F_MPH) { /* one candidate slot only */
+    htp = _cdb_mph_slot(cdbp, key, klen);
+    return htp ? _cdb_match(cdbp, cdb_unpack(htp), key, klen, resp) : 0;
+  }
 
   /* find (pos,n) hash table to use */
   /* first 2048 bytes (toc) are always available */
@@ -44,28 +82,24 @@ cdb_find(struct cdb *cdbp, const void *key, unsigned klen)
   htp = htab + (((hval >> 8) % n) << 3);
 
   for(;;) {
+    /* skip to the next slot that is empty or has our hash value */
+    n = (htend - htp) >> 3;
+    if (n > (httodo >> 3))
+      n = httodo >> 3;
+    if (!(p = _cdb_htscan(htp, n, hval))) {
+      httodo -= n << 3;
+      if (!httodo)
+        return 0;
+      htp = htab;
+      continue;
+    }
+    httodo -= p - htp;
+    htp = p;
     pos = cdb_unpack(htp + 4);	/* record position */
     if (!pos)
       return 0;
-    if (cdb_unpack(htp) == hval) {
-      if (pos > cdbp->cdb_dend - 8) /* key+val lengths */
-	return errno = EPROTO, -1;
-      if (cdb_unpack(cdbp->cdb_mem + pos) == klen) {
-	if (cdbp->cdb_dend - klen < pos + 8)
-	  return errno = EPROTO, -1;
-	if (memcmp(key, cdbp->cdb_mem + pos + 8, klen) == 0) {
-	  n = cdb_unpack(cdbp->cdb_mem + pos + 4);
-	  pos += 8;
-	  if (cdbp->cdb_dend < n || cdbp->cdb_dend - n < pos + klen)
-	    return errno = EPROTO, -1;
-	  cdbp->cdb_kpos = pos;
-	  cdbp->cdb_klen = klen;
-	  cdbp->cdb_vpos = pos + klen;
-	  cdbp->cdb_vlen = n;
-	  return 1;
-	}
-      }
-    }
+    if ((r = _cdb_match(cdbp, pos, key, klen, resp)) != 0)
+      return r;
     httodo -= 8;
     if (!httodo)
       return 0;
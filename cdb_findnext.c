@@ -12,13 +12,48 @@
 int
 cdb_findinit(struct cdb_find *cdbfp, struct cdb *cdbp,
              const void *key, unsigned klen)
+{
+  return cdb_findinith(cdbfp, cdbp, key, klen,
+                       (cdbp->cdb_flags & CDB_F_MPH) ? 0 : cdb_hash(key, klen));
+}
+
+int
+cdb_findinith(struct cdb_find *cdbfp, struct cdb *cdbp,
+              const void *key, unsigned klen, unsigned hval)
+{
+  return cdb_findinith_r(cdbfp, cdbp, key, klen, hval);
+}
+
+int
+cdb_findinit_r(struct cdb_find *cdbfp, const struct cdb *cdbp,
+               const void *key, unsigned klen)
+{
+  return cdb_findinith_r(cdbfp, cdbp, key, klen,
+                         (cdbp->cdb_flags & CDB_F_MPH) ? 0 : cdb_hash(key, klen));
+}
+
+int
+cdb_findinith_r(struct cdb_find *cdbfp, const struct cdb *cdbp,
+                const void *key, unsigned klen, unsigned hval)
 {
   unsigned n, pos;
 
+  if (cdbp->cdb_bc)
+    return _cdb_bc_findinit(cdbfp, cdbp, key, klen, hval);
+
   cdbfp->cdb_cdbp = cdbp;
   cdbfp->cdb_key = key;
   cdbfp->cdb_klen = klen;
-  cdbfp->cdb_hval = cdb_hash(key, klen);
+
+  if (cdbp->cdb_flags & CDB_F_MPH) {
+    /* htab stays NULL: cdb_findnext() checks the single slot at htp */
+    cdbfp->cdb_htab = NULL;
+    cdbfp->cdb_htp = _cdb_mph_slot(cdbp, key, klen);
+    cdbfp->cdb_httodo = cdbfp->cdb_htp ? 8 : 0;
+    return cdbfp->cdb_httodo != 0;
+  }
+
+  cdbfp->cdb_hval = hval;
 
   cdbfp->cdb_htp = cdbp->cdb_mem + ((cdbfp->cdb_hval << 3) & 2047);
   n = cdb_unpack(cdbfp->cdb_htp + 4);
@@ -30,7 +65,7 @@ cdb_findinit(struct cdb_find *cdbfp, struct cdb *cdbp,
       || pos < cdbp->cdb_dend
       || pos > cdbp->cdb_fsize
       || cdbfp->cdb_httodo > cdbp->cdb_fsize - pos)
-    return errno = EPROTO, -1;
+    return cdbfp->cdb_httodo = 0, errno = EPROTO, -1;
 
   cdbfp->cdb_htab = cdbp->cdb_mem + pos;
   cdbfp->cdb_htend = cdbfp->cdb_htab + cdbfp->cdb_httodo;
@@ -41,39 +76,52 @@ cdb_findinit(struct cdb_find *cdbfp, struct cdb *cdbp,
 
 int
 cdb_findnext(struct cdb_find *cdbfp) {
-  struct cdb *cdbp = cdbfp->cdb_cdbp;
+  struct cdb_result res;
+  int r = cdb_findnext_r(cdbfp, &res);
+  /* cdb_findinit() was given the struct cdb writable: the _r
+   * lookups, which may share it between threads, never come here */
+  if (r > 0)
+    _cdb_setfound((struct cdb *)cdbfp->cdb_cdbp, &res);
+  return r;
+}
+
+int
+cdb_findnext_r(struct cdb_find *cdbfp, struct cdb_result *resp) {
+  const struct cdb *cdbp = cdbfp->cdb_cdbp;
+  const unsigned char *p;
   unsigned pos, n;
   unsigned klen = cdbfp->cdb_klen;
+  int r;
+
+  if (cdbp->cdb_bc)
+    return _cdb_bc_findnext(cdbfp, resp);
+
+  if (cdbfp->cdb_httodo && !cdbfp->cdb_htab) {
+    cdbfp->cdb_httodo = 0;
+    return _cdb_match(cdbp, cdb_unpack(cdbfp->cdb_htp),
+                      cdbfp->cdb_key, klen, resp);
+  }
 
   while(cdbfp->cdb_httodo) {
-    pos = cdb_unpack(cdbfp->cdb_htp + 4);
-    if (!pos)
+    n = (cdbfp->cdb_htend - cdbfp->cdb_htp) >> 3;
+    if (n > (cdbfp->cdb_httodo >> 3))
+      n = cdbfp->cdb_httodo >> 3;
+    if (!(p = _cdb_htscan(cdbfp->cdb_htp, n, cdbfp->cdb_hval))) {
+      cdbfp->cdb_httodo -= n << 3;
+      cdbfp->cdb_htp = cdbfp->cdb_htab;
+      continue;
+    }
+    cdbfp->cdb_httodo -= p - cdbfp->cdb_htp;
+    pos = cdb_unpack(p + 4);
+    if (!pos) {
+      cdbfp->cdb_htp = p;
       return 0;
-    n = cdb_unpack(cdbfp->cdb_htp) == cdbfp->cdb_hval;
-    if ((cdbfp->cdb_htp += 8) >= cdbfp->cdb_htend)
+    }
+    if ((cdbfp->cdb_htp = p + 8) >= cdbfp->cdb_htend)
       cdbfp->cdb_htp = cdbfp->cdb_htab;
     cdbfp->cdb_httodo -= 8;
-    if (n) {
-      if (pos > cdbp->cdb_fsize - 8)
-	return errno = EPROTO, -1;
-      if (cdb_unpack(cdbp->cdb_mem + pos) == klen) {
-	if (cdbp->cdb_fsize - klen < pos + 8)
-	  return errno = EPROTO, -1;
-	if (memcmp(cdbfp->cdb_key,
-	    cdbp->cdb_mem + pos + 8, klen) == 0) {
-	  n = cdb_unpack(cdbp->cdb_mem + pos + 4);
-	  pos += 8;
-	  if (cdbp->cdb_fsize < n ||
-              cdbp->cdb_fsize - n < pos + klen)
-	    return errno = EPROTO, -1;
-	  cdbp->cdb_kpos = pos;
-	  cdbp->cdb_klen = klen;
-	  cdbp->cdb_vpos = pos + klen;
-	  cdbp->cdb_vlen = n;
-	  return 1;
-	}
-      }
-    }
+    if ((r = _cdb_match(cdbp, pos, cdbfp->cdb_key, klen, resp)) != 0)
+      return r;
   }
 
   return 0;
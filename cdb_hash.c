@@ -17,3 +17,15 @@ cdb_hash(const void *buf, unsigned len)
     hash = (hash + (hash << 5)) ^ *p++;
   return hash;
 }
+
+/* Shard of nshards a record with hash value hval belongs to.  The
+ * low bits of hval already pick a hash table and the rest a slot in it,
+ * so they are mixed before being mapped to [0, nshards) with a multiply
+ * rather than a modulo; every shard then still uses all 256 tables. */
+unsigned
+cdb_shard(unsigned hval, unsigned nshards)
+{
+  hval *= 0x9e3779b1;
+  hval ^= hval >> 16;
+  return (unsigned)(((unsigned long long)hval * nshards) >> 32);
+}
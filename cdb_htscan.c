@@ -0,0 +1,82 @@
+/* hash table slot scanning
+ *
+ * This file is a part of lua-tinycdb.
+ *
+ * _cdb_htscan() looks through cnt consecutive 8-byte slots for the first
+ * one that either carries the wanted hash value or is empty (zero record
+ * position), which is where every probe loop stops to look closer.  On
+ * x86 the slots are compared several at a time with SSE2 or, when the
+ * CPU has it, AVX2; the kernel is picked when the library is loaded.
+ */
+
+#include "cdb_int.h"
+
+typedef const unsigned char *htscan_fn(const unsigned char *htp,
+                                       unsigned cnt, unsigned hval);
+
+static const unsigned char *
+htscan_generic(const unsigned char *htp, unsigned cnt, unsigned hval)
+{
+  for (; cnt; --cnt, htp += 8)
+    if (cdb_unpack(htp) == hval || !cdb_unpack(htp + 4))
+      return htp;
+  return NULL;
+}
+
+#if defined(__GNUC__) && (defined(__x86_64__) || defined(__i386__))
+# include <immintrin.h>
+# define HTSCAN_X86
+
+/* The slots are little-endian (hval, rpos) pairs, which on x86 are the
+ * 32-bit lanes of a vector as they are: compare them against
+ * (hval, 0, hval, 0, ...) and the first set mask bit, halved, is the
+ * index of the slot we want. */
+
+__attribute__((target("sse2")))
+static const unsigned char *
+htscan_sse2(const unsigned char *htp, unsigned cnt, unsigned hval)
+{
+  const __m128i want = _mm_set_epi32(0, (int)hval, 0, (int)hval);
+  int m;
+  for (; cnt >= 2; cnt -= 2, htp += 16) {
+    m = _mm_movemask_ps(_mm_castsi128_ps(_mm_cmpeq_epi32(
+          _mm_loadu_si128((const __m128i *)htp), want)));
+    if (m)
+      return htp + ((__builtin_ctz(m) >> 1) << 3);
+  }
+  return htscan_generic(htp, cnt, hval);
+}
+
+__attribute__((target("avx2")))
+static const unsigned char *
+htscan_avx2(const unsigned char *htp, unsigned cnt, unsigned hval)
+{
+  const __m256i want = _mm256_set_epi32(0, (int)hval, 0, (int)hval,
+                                        0, (int)hval, 0, (int)hval);
+  int m;
+  for (; cnt >= 4; cnt -= 4, htp += 32) {
+    m = _mm256_movemask_ps(_mm256_castsi256_ps(_mm256_cmpeq_epi32(
+          _mm256_loadu_si256((const __m256i *)htp), want)));
+    if (m)
+      return htp + ((__builtin_ctz(m) >> 1) << 3);
+  }
+  return htscan_sse2(htp, cnt, hval);
+}
+#endif
+
+/* the kernel in use: threads share a struct cdb for the _r lookups, so
+ * it is picked once when the library is loaded rather than on first use */
+htscan_fn *_cdb_htscan internal_function = htscan_generic;
+
+#ifdef HTSCAN_X86
+__attribute__((constructor))
+static void
+htscan_init(void)
+{
+  __builtin_cpu_init();
+  if (__builtin_cpu_supports("avx2"))
+    _cdb_htscan = htscan_avx2;
+  else if (__builtin_cpu_supports("sse2"))
+    _cdb_htscan = htscan_sse2;
+}
+#endif
@@ -15,14 +15,108 @@
 # endif
 #endif
 #include <sys/stat.h>
+#include <stdlib.h>
+#include <unistd.h>
 #include "cdb_int.h"
 
+/* parse the extension area found after the last hash table, if any;
+ * it is read with cdb_get() so that the pread mode can share this */
+static int
+cdb_init_ext(struct cdb *cdbp)
+{
+  const unsigned char *mem;
+  unsigned fsize = cdbp->cdb_fsize;
+  unsigned pos, n, t, len;
+  unsigned hend = cdbp->cdb_dend;	/* end of hash tables */
+
+  if (!(mem = (const unsigned char *)cdb_get(cdbp, 2048, 0)))
+    return -1;
+  for (t = 0; t < 2048; t += 8) {
+    n = cdb_unpack(mem + t + 4);
+    pos = cdb_unpack(mem + t);
+    if (!n)
+      continue;
+    if (n > (fsize >> 3) || pos > fsize || (n << 3) > fsize - pos)
+      return 0; /* broken toc, let cdb_find() report it */
+    if (hend < pos + (n << 3))
+      hend = pos + (n << 3);
+  }
+  if (fsize - hend < 4)
+    return 0;
+  if (!(mem = (const unsigned char *)cdb_get(cdbp, 4, hend)))
+    return -1;
+  if (memcmp(mem, CDB_EXT_MAGIC, 4) != 0)
+    return 0;
+
+  for (pos = hend + 4; fsize - pos >= 8; pos += len) {
+    if (!(mem = (const unsigned char *)cdb_get(cdbp, 8, pos)))
+      return -1;
+    t = cdb_unpack(mem);
+    len = cdb_unpack(mem + 4);
+    pos += 8;
+    if (len > fsize - pos)
+      return errno = EPROTO, -1;
+    switch(t) {
+    case CDB_EXT_MPH:
+      if (len < 12)
+        return errno = EPROTO, -1;
+      if (!(mem = (const unsigned char *)cdb_get(cdbp, 12, pos)))
+        return -1;
+      n = cdb_unpack(mem + 8); /* nbuckets */
+      t = cdb_unpack(mem + 4); /* nslots */
+      if (n > (len >> 2) || t > (len >> 2) || ((len - 12) & 3)
+          || ((len - 12) >> 2) != n + t || (t && !n))
+        return errno = EPROTO, -1;
+      cdbp->cdb_flags |= CDB_F_MPH;
+      cdbp->cdb_mphpos = pos;
+      break;
+    case CDB_EXT_DEDUP:
+      cdbp->cdb_flags |= CDB_F_DEDUP;
+      break;
+    case CDB_EXT_META:
+      if (len < 32)
+        return errno = EPROTO, -1;
+      cdbp->cdb_metapos = pos;
+      break;
+    default: /* unknown sections are skipped */
+      break;
+    }
+  }
+  return 0;
+}
+
+/* the part of opening common to both access modes, once cdb_fd,
+ * cdb_fsize and cdb_mem or cdb_bc are set */
+static int
+cdb_init_common(struct cdb *cdbp)
+{
+  unsigned dend;
+
+  cdbp->cdb_vpos = cdbp->cdb_vlen = 0;
+  cdbp->cdb_kpos = cdbp->cdb_klen = 0;
+  dend = cdb_unpack((const unsigned char *)cdb_get(cdbp, 4, 0));
+  if (dend < 2048) dend = 2048;
+  else if (dend >= cdbp->cdb_fsize) dend = cdbp->cdb_fsize;
+  cdbp->cdb_dend = dend;
+  cdbp->cdb_flags &= CDB_F_MEM | CDB_F_LOADED;
+  cdbp->cdb_mphpos = 0;
+  cdbp->cdb_metapos = 0;
+
+  if (cdb_init_ext(cdbp) < 0) {
+    int xerrno = errno;
+    cdb_free(cdbp);
+    return errno = xerrno, -1;
+  }
+
+  return 0;
+}
+
 int
 cdb_init(struct cdb *cdbp, int fd)
 {
   struct stat st;
   unsigned char *mem;
-  unsigned fsize, dend;
+  unsigned fsize;
 #ifdef _WIN32
   HANDLE hFile, hMapping;
 #endif
@@ -54,6 +148,8 @@ cdb_init(struct cdb *cdbp, int fd)
   cdbp->cdb_fd = fd;
   cdbp->cdb_fsize = fsize;
   cdbp->cdb_mem = mem;
+  cdbp->cdb_bc = NULL;
+  cdbp->cdb_flags = 0;
 
 #if 0
   /* XXX don't know well about madvise syscall -- is it legal
@@ -68,20 +164,139 @@ cdb_init(struct cdb *cdbp, int fd)
 #endif
 #endif
 
-  cdbp->cdb_vpos = cdbp->cdb_vlen = 0;
-  cdbp->cdb_kpos = cdbp->cdb_klen = 0;
-  dend = cdb_unpack(mem);
-  if (dend < 2048) dend = 2048;
-  else if (dend >= fsize) dend = fsize;
-  cdbp->cdb_dend = dend;
+  return cdb_init_common(cdbp);
+}
 
-  return 0;
+int
+cdb_init_pread(struct cdb *cdbp, int fd, unsigned cachesize)
+{
+  struct stat st;
+
+  if (fstat(fd, &st) < 0)
+    return -1;
+  if (st.st_size < 2048)
+    return errno = EPROTO, -1;
+  cdbp->cdb_fd = fd;
+  cdbp->cdb_fsize = (unsigned)(st.st_size & 0xffffffffu);
+  cdbp->cdb_mem = NULL;
+  cdbp->cdb_flags = 0;
+  cdbp->cdb_bc = _cdb_bc_new(fd, cdbp->cdb_fsize, cachesize);
+  if (!cdbp->cdb_bc)
+    return -1;
+  return cdb_init_common(cdbp);
+}
+
+int
+cdb_init_mem(struct cdb *cdbp, const void *mem, unsigned len)
+{
+  if (len < 2048)
+    return errno = EPROTO, -1;
+  cdbp->cdb_fd = -1;
+  cdbp->cdb_fsize = len;
+  cdbp->cdb_mem = (const unsigned char *)mem;
+  cdbp->cdb_bc = NULL;
+  cdbp->cdb_flags = CDB_F_MEM;
+  return cdb_init_common(cdbp);
+}
+
+#ifndef _WIN32
+static size_t
+load_size(unsigned len)
+{
+  size_t psize = (size_t)sysconf(_SC_PAGESIZE);
+  return (len + psize - 1) & ~(psize - 1);
+}
+#endif
+
+#define CDB_HUGE_PAGE	(2u << 20)
+
+/* memory for a file of len bytes, ideally on huge pages */
+static unsigned char *
+load_alloc(unsigned len, unsigned flags)
+{
+#ifdef _WIN32
+  (void)flags;
+  return (unsigned char *)malloc(len);
+#else
+  size_t size = load_size(len), extra = 0;
+  unsigned char *mem, *start;
+
+# ifdef MADV_HUGEPAGE
+  /* transparent huge pages only back aligned ranges */
+  if (flags & CDB_LOAD_HUGE)
+    extra = CDB_HUGE_PAGE;
+# else
+  (void)flags;
+# endif
+  mem = (unsigned char*)mmap(NULL, size + extra, PROT_READ | PROT_WRITE,
+                             MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+  if (mem == MAP_FAILED)
+    return NULL;
+  if (!extra)
+    return mem;
+  start = mem + ((CDB_HUGE_PAGE - (size_t)mem % CDB_HUGE_PAGE) % CDB_HUGE_PAGE);
+  if (start > mem)
+    munmap(mem, start - mem);
+  if (start + size < mem + size + extra)
+    munmap(start + size, mem + size + extra - (start + size));
+# ifdef MADV_HUGEPAGE
+  madvise(start, size, MADV_HUGEPAGE);
+# endif
+  return start;
+#endif /* _WIN32 */
+}
+
+static void
+load_free(const unsigned char *mem, unsigned len)
+{
+#ifdef _WIN32
+  (void)len;
+  free((void*)mem);
+#else
+  munmap((void*)mem, load_size(len));
+#endif
+}
+
+int
+cdb_init_load(struct cdb *cdbp, int fd, unsigned flags)
+{
+  struct stat st;
+  unsigned char *mem;
+  unsigned fsize, pos, n;
+  int l;
+
+  if (fstat(fd, &st) < 0)
+    return -1;
+  if (st.st_size < 2048)
+    return errno = EPROTO, -1;
+  fsize = (unsigned)(st.st_size & 0xffffffffu);
+  if (!(mem = load_alloc(fsize, flags)))
+    return errno = ENOMEM, -1;
+  for (pos = 0; pos < fsize; pos += l) {
+    n = fsize - pos < 0x40000000 ? fsize - pos : 0x40000000;
+    l = (int)pread(fd, mem + pos, n, (off_t)pos);
+    if (l < 0 && errno == EINTR)
+      l = 0;
+    else if (l <= 0) {
+      int xerrno = l < 0 ? errno : EIO;
+      load_free(mem, fsize);
+      return errno = xerrno, -1;
+    }
+  }
+  cdbp->cdb_fd = -1;
+  cdbp->cdb_fsize = fsize;
+  cdbp->cdb_mem = mem;
+  cdbp->cdb_bc = NULL;
+  cdbp->cdb_flags = CDB_F_LOADED;
+  return cdb_init_common(cdbp);
 }
 
 void
 cdb_free(struct cdb *cdbp)
 {
-  if (cdbp->cdb_mem) {
+  if (cdbp->cdb_mem && (cdbp->cdb_flags & CDB_F_LOADED))
+    load_free(cdbp->cdb_mem, cdbp->cdb_fsize);
+  else if (cdbp->cdb_mem && !(cdbp->cdb_flags & CDB_F_MEM)) {
 #ifdef _WIN32
     HANDLE hFile, hMapping;
 #endif
@@ -94,7 +309,12 @@ cdb_free(struct cdb *cdbp)
 #else
     munmap((void*)cdbp->cdb_mem, cdbp->cdb_fsize);
 #endif /* _WIN32 */
-    cdbp->cdb_mem = NULL;
+  }
+  cdbp->cdb_mem = NULL;
+  cdbp->cdb_flags &= ~(CDB_F_MEM | CDB_F_LOADED);
+  if (cdbp->cdb_bc) {
+    _cdb_bc_free(cdbp->cdb_bc);
+    cdbp->cdb_bc = NULL;
   }
   cdbp->cdb_fsize = 0;
 }
@@ -106,13 +326,21 @@ cdb_get(const struct cdb *cdbp, unsigned len, unsigned pos)
     errno = EPROTO;
     return NULL;
   }
+  if (cdbp->cdb_bc)
+    return _cdb_bc_get(cdbp, len, pos);
   return cdbp->cdb_mem + pos;
 }
 
 int
 cdb_read(const struct cdb *cdbp, void *buf, unsigned len, unsigned pos)
 {
-  const void *data = cdb_get(cdbp, len, pos);
+  const void *data;
+  if (cdbp->cdb_bc) {
+    if (pos > cdbp->cdb_fsize || cdbp->cdb_fsize - pos < len)
+      return errno = EPROTO, -1;
+    return _cdb_bc_read(cdbp, (unsigned char *)buf, len, pos);
+  }
+  data = cdb_get(cdbp, len, pos);
   if (!data) return -1;
   memcpy(buf, data, len);
   return 0;
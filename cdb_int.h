@@ -9,6 +9,21 @@
 #include <errno.h>
 #include <string.h>
 
+/* decode little-endian words with a single load where the host allows */
+#if defined(__GNUC__) && defined(__BYTE_ORDER__)
+static __inline__ unsigned
+_cdb_unpack_word(const unsigned char *buf)
+{
+  unsigned n;
+  memcpy(&n, buf, 4);
+# if __BYTE_ORDER__ == __ORDER_BIG_ENDIAN__
+  n = __builtin_bswap32(n);
+# endif
+  return n;
+}
+# define cdb_unpack(buf) _cdb_unpack_word(buf)
+#endif
+
 #ifndef EPROTO
 # define EPROTO EINVAL
 #endif
@@ -21,6 +36,24 @@
 # endif
 #endif
 
+/* Optional extension area, following the last hash table.  It starts
+ * with CDB_EXT_MAGIC and holds sections of tag(4) length(4) payload.
+ * Readers unaware of it never look past the hash tables. */
+#define CDB_EXT_MAGIC	"cdbx"
+#define CDB_EXT_MPH	1	/* seed, nslots, nbuckets, disp[], slots[] */
+#define CDB_EXT_DEDUP	2	/* empty: values may be shared, see below */
+#define CDB_EXT_META	3	/* records, keys, keybytes(8), valbytes(8),
+				 * mflags, hslots; see cdb_info() */
+
+/* the value length of a record whose value is that of an earlier one:
+ * the record holds a vpos(4) vlen(4) reference to it instead */
+#define CDB_VREF	0xffffffff
+
+/* make the record found in *resp the current one of cdbp */
+#define _cdb_setfound(cdbp, resp) \
+  ((cdbp)->cdb_kpos = (resp)->cdb_kpos, (cdbp)->cdb_klen = (resp)->cdb_klen, \
+   (cdbp)->cdb_vpos = (resp)->cdb_vpos, (cdbp)->cdb_vlen = (resp)->cdb_vlen)
+
 struct cdb_rec {
   unsigned hval;
   unsigned rpos;
@@ -32,10 +65,77 @@ struct cdb_rl {
   struct cdb_rec rec[254];
 };
 
+/* a run of record infos spilled to disk: cnt[t] entries for each table,
+ * one table after another, starting at pos in the spill file */
+struct cdb_run {
+  unsigned long long pos;
+  unsigned cnt[256];
+};
+
 int _cdb_make_write(struct cdb_make *cdbmp,
 		    const unsigned char *ptr, unsigned len);
 int _cdb_make_fullwrite(int fd, const unsigned char *buf, unsigned len);
 int _cdb_make_flush(struct cdb_make *cdbmp);
+int _cdb_make_out(struct cdb_make *cdbmp,
+                  const unsigned char *buf, unsigned len);
+int _cdb_make_seek(struct cdb_make *cdbmp, unsigned pos);
+int _cdb_make_in(struct cdb_make *cdbmp, unsigned char *buf, unsigned len);
+int _cdb_make_pread(struct cdb_make *cdbmp,
+                    unsigned char *buf, unsigned len, unsigned pos);
+int _cdb_make_mem_put(struct cdb_make *cdbmp,
+                      const unsigned char *buf, unsigned len);
+int _cdb_make_wb(struct cdb_make *cdbmp);
+int _cdb_make_addrec(struct cdb_make *cdbmp, unsigned hval, unsigned rpos);
 int _cdb_make_add(struct cdb_make *cdbmp, unsigned hval,
                   const void *key, unsigned klen,
                   const void *val, unsigned vlen);
+int _cdb_make_read(struct cdb_make *cdbmp,
+                   unsigned char *buf, unsigned len, unsigned pos);
+int _cdb_make_mph(struct cdb_make *cdbmp);
+int _cdb_make_spill(struct cdb_make *cdbmp);
+int _cdb_make_htabs_spilled(struct cdb_make *cdbmp,
+                            unsigned hcnt[256], unsigned hpos[256],
+                            unsigned *keysp);
+int _cdb_make_samekey(struct cdb_make *cdbmp, unsigned a, unsigned b);
+int _cdb_make_meta(struct cdb_make *cdbmp, unsigned keys);
+int _cdb_make_tsize(const struct cdb_make *cdbmp, unsigned n,
+                    unsigned *lenp);
+void _cdb_make_free_runs(struct cdb_make *cdbmp);
+int _cdb_recs(const struct cdb *cdbp, struct cdb_rec **recsp);
+int _cdb_make_dedup(struct cdb_make *cdbmp, const void *val, unsigned vlen,
+                    unsigned vpos, unsigned *refp);
+int _cdb_make_dedup_ext(struct cdb_make *cdbmp);
+int _cdb_value(const struct cdb *cdbp, unsigned pos, unsigned vlen,
+               struct cdb_result *resp);
+
+int _cdb_match(const struct cdb *cdbp, unsigned pos,
+               const void *key, unsigned klen, struct cdb_result *resp);
+void _cdb_mph_hash(const void *key, unsigned klen, unsigned seed,
+                   unsigned h[2]);
+unsigned _cdb_mph_pos(unsigned h, unsigned d, unsigned nslots);
+const unsigned char *_cdb_mph_slot(const struct cdb *cdbp,
+                                   const void *key, unsigned klen);
+struct cdb_bcache *_cdb_bc_new(int fd, unsigned fsize, unsigned cachesize);
+void _cdb_bc_free(struct cdb_bcache *bc);
+const unsigned char *_cdb_bc_get(const struct cdb *cdbp,
+                                 unsigned len, unsigned pos);
+const unsigned char *_cdb_bc_peek(const struct cdb *cdbp,
+                                  unsigned len, unsigned pos);
+int _cdb_bc_read(const struct cdb *cdbp, unsigned char *buf,
+                 unsigned len, unsigned pos);
+int _cdb_bc_findinit(struct cdb_find *cdbfp, const struct cdb *cdbp,
+                     const void *key, unsigned klen, unsigned hval);
+int _cdb_bc_findnext(struct cdb_find *cdbfp, struct cdb_result *resp);
+void _cdb_stat_probe(struct cdb_stat *stp, unsigned dist);
+/* runs of used slots in a hash table, for the miss probe statistics */
+struct cdb_srun {
+  unsigned len;			/* used slots since the last empty one */
+  unsigned first;		/* used slots before the first empty one */
+  int empty;			/* whether there was an empty one */
+};
+void _cdb_stat_slot(struct cdb_stat *stp, struct cdb_srun *srp, int used);
+void _cdb_stat_table(struct cdb_stat *stp, struct cdb_srun *srp);
+void _cdb_stat_done(struct cdb_stat *stp);
+
+extern const unsigned char *(*_cdb_htscan)(const unsigned char *htp,
+                                           unsigned cnt, unsigned hval);
@@ -19,6 +19,13 @@ cdb_pack(unsigned num, unsigned char buf[4])
   buf[3] = num >> 8;
 }
 
+void
+cdb_pack64(unsigned long long num, unsigned char buf[8])
+{
+  cdb_pack((unsigned)(num & 0xffffffffu), buf);
+  cdb_pack((unsigned)(num >> 32), buf + 4);
+}
+
 int
 cdb_make_start(struct cdb_make *cdbmp, int fd)
 {
@@ -42,6 +49,54 @@ _cdb_make_fullwrite(int fd, const unsigned char *buf, unsigned len)
   return 0;
 }
 
+/* the file or memory the database goes to, see cdb_make_mem.c: write
+ * at the current position, move it, read from it, read anywhere */
+int internal_function
+_cdb_make_out(struct cdb_make *cdbmp, const unsigned char *buf, unsigned len)
+{
+  if (cdbmp->cdb_mbuf)
+    return _cdb_make_mem_put(cdbmp, buf, len);
+  return _cdb_make_fullwrite(cdbmp->cdb_fd, buf, len);
+}
+
+int internal_function
+_cdb_make_seek(struct cdb_make *cdbmp, unsigned pos)
+{
+  if (cdbmp->cdb_mbuf) {
+    cdbmp->cdb_mpos = pos;
+    return 0;
+  }
+  return lseek(cdbmp->cdb_fd, pos, SEEK_SET) < 0 ? -1 : 0;
+}
+
+int internal_function
+_cdb_make_in(struct cdb_make *cdbmp, unsigned char *buf, unsigned len)
+{
+  if (cdbmp->cdb_mbuf) {
+    if (len > cdbmp->cdb_mlen - cdbmp->cdb_mpos)
+      len = cdbmp->cdb_mlen - cdbmp->cdb_mpos;
+    memcpy(buf, cdbmp->cdb_mbuf + cdbmp->cdb_mpos, len);
+    cdbmp->cdb_mpos += len;
+    return (int)len;
+  }
+  return read(cdbmp->cdb_fd, buf, len);
+}
+
+int internal_function
+_cdb_make_pread(struct cdb_make *cdbmp, unsigned char *buf, unsigned len,
+                unsigned pos)
+{
+  if (cdbmp->cdb_mbuf) {
+    if (pos > cdbmp->cdb_mlen)
+      return 0;
+    if (len > cdbmp->cdb_mlen - pos)
+      len = cdbmp->cdb_mlen - pos;
+    memcpy(buf, cdbmp->cdb_mbuf + pos, len);
+    return (int)len;
+  }
+  return pread(cdbmp->cdb_fd, buf, len, pos);
+}
+
 int internal_function
 _cdb_make_flush(struct cdb_make *cdbmp) {
   unsigned len = cdbmp->cdb_bpos - cdbmp->cdb_buf;
@@ -57,6 +112,12 @@ int internal_function
 _cdb_make_write(struct cdb_make *cdbmp, const unsigned char *ptr, unsigned len)
 {
   unsigned l = sizeof(cdbmp->cdb_buf) - (cdbmp->cdb_bpos - cdbmp->cdb_buf);
+  if (cdbmp->cdb_mbuf) {
+    if (_cdb_make_mem_put(cdbmp, ptr, len) < 0)
+      return -1;
+    cdbmp->cdb_dpos += len;
+    return 0;
+  }
   cdbmp->cdb_dpos += len;
   if (len > l) {
     memcpy(cdbmp->cdb_bpos, ptr, l);
@@ -76,25 +137,70 @@ _cdb_make_write(struct cdb_make *cdbmp, const unsigned char *ptr, unsigned len)
     memcpy(cdbmp->cdb_bpos, ptr, len);
     cdbmp->cdb_bpos += len;
   }
+  if (cdbmp->cdb_wbchunk)
+    return _cdb_make_wb(cdbmp);
+  return 0;
+}
+
+int internal_function
+_cdb_make_read(struct cdb_make *cdbmp,
+               unsigned char *buf, unsigned len, unsigned pos)
+{
+  int l;
+  if (_cdb_make_flush(cdbmp) < 0)
+    return -1;
+  while(len) {
+    l = _cdb_make_pread(cdbmp, buf, len, pos);
+    if (l < 0 && errno == EINTR)
+      continue;
+    if (l <= 0) {
+      if (!l)
+        errno = EIO;
+      return -1;
+    }
+    buf += l; len -= l; pos += l;
+  }
+  return 0;
+}
+
+/* the number of slots in a table for n records */
+int internal_function
+_cdb_make_tsize(const struct cdb_make *cdbmp, unsigned n, unsigned *lenp)
+{
+  unsigned long long len;
+  unsigned per = cdbmp->cdb_hslots ? cdbmp->cdb_hslots : 512;
+
+  len = ((unsigned long long)n * per + 255) >> 8;
+  if (len < n)
+    len = n;
+  /* all the tables go between cdb_dpos and 4G */
+  if (len > (0xffffffffu - cdbmp->cdb_dpos) >> 3)
+    return errno = ENOMEM, -1;
+  *lenp = (unsigned)len;
   return 0;
 }
 
+/* distance of the slot at hi from the home of the record in it */
+#define cdb_dist(rec, hi, len) (((hi) + (len) - ((rec).hval >> 8) % (len)) % (len))
+
 static int
-cdb_make_finish_internal(struct cdb_make *cdbmp)
+cdb_make_htabs(struct cdb_make *cdbmp, unsigned hcnt[256], unsigned hpos[256],
+               unsigned *keysp)
 {
-  unsigned hcnt[256];		/* hash table counts */
-  unsigned hpos[256];		/* hash table positions */
+  struct cdb_stat *stp = cdbmp->cdb_statp;
   struct cdb_rec *htab;
   unsigned char *p;
   struct cdb_rl *rl;
+  struct cdb_srun sr;
+  unsigned long long total;
   unsigned hsize;
   unsigned t, i;
-
-  if (((0xffffffff - cdbmp->cdb_dpos) >> 3) < cdbmp->cdb_rcnt)
-    return errno = ENOMEM, -1;
+  int r = 0;
+  int robinhood = (cdbmp->cdb_mflags & CDB_MAKE_ROBINHOOD) != 0;
 
   /* count htab sizes and reorder reclists */
   hsize = 0;
+  total = 0;
   for (t = 0; t < 256; ++t) {
     struct cdb_rl *rlt = NULL;
     i = 0;
@@ -107,9 +213,14 @@ cdb_make_finish_internal(struct cdb_make *cdbmp)
       rl = rln;
     }
     cdbmp->cdb_rec[t] = rlt;
-    if (hsize < (hcnt[t] = i << 1))
+    if (_cdb_make_tsize(cdbmp, i, &hcnt[t]) < 0)
+      return -1;
+    if (hsize < hcnt[t])
       hsize = hcnt[t];
+    total += hcnt[t];
   }
+  if (total > (0xffffffffu - cdbmp->cdb_dpos) >> 3)
+    return errno = ENOMEM, -1;
 
   /* allocate memory to hold max htable */
   htab = (struct cdb_rec*)malloc((hsize + 2) * sizeof(struct cdb_rec));
@@ -117,10 +228,11 @@ cdb_make_finish_internal(struct cdb_make *cdbmp)
     return errno = ENOENT, -1;
   p = (unsigned char *)htab;
   htab += 2;
+  memset(&sr, 0, sizeof(sr));
 
   /* build hash tables */
   for (t = 0; t < 256; ++t) {
-    unsigned len, hi;
+    unsigned len, hi, d;
     hpos[t] = cdbmp->cdb_dpos;
     if ((len = hcnt[t]) == 0)
       continue;
@@ -128,12 +240,51 @@ cdb_make_finish_internal(struct cdb_make *cdbmp)
       htab[i].hval = htab[i].rpos = 0;
     for (rl = cdbmp->cdb_rec[t]; rl; rl = rl->next)
       for (i = 0; i < rl->cnt; ++i) {
-       hi = (rl->rec[i].hval >> 8) % len;
-        while(htab[hi].rpos)
+        struct cdb_rec rec = rl->rec[i], tmp;
+        /* a record starts a key unless one already placed has the same
+         * hash value and key; those all come before the first slot the
+         * record could take from another, as records keep the order of
+         * their homes along a probe sequence */
+        int key = 1, placing = 1;
+        hi = (rec.hval >> 8) % len;
+        for (d = 0; htab[hi].rpos; ++d) {
+          if (placing && key && htab[hi].hval == rec.hval &&
+              (r = _cdb_make_samekey(cdbmp, htab[hi].rpos, rec.rpos)) != 0) {
+            if (r < 0) {
+              free(p);
+              return -1;
+            }
+            key = 0;
+          }
+          /* a record closer to its home gives up its slot; of records
+           * with the same home, the earlier one stays first */
+          if (robinhood &&
+              (cdb_dist(htab[hi], hi, len) < d ||
+               (cdb_dist(htab[hi], hi, len) == d && rec.rpos < htab[hi].rpos))) {
+            tmp = htab[hi];
+            htab[hi] = rec;
+            rec = tmp;
+            d = cdb_dist(rec, hi, len);
+            placing = 0;
+          }
           if (++hi == len)
             hi = 0;
-        htab[hi] = rl->rec[i];
+        }
+        htab[hi] = rec;
+        *keysp += key;
+      }
+    if (stp) {
+      stp->tslots[t] = len;
+      stp->slots += len;
+      for (i = 0; i < len; ++i) {
+        _cdb_stat_slot(stp, &sr, htab[i].rpos != 0);
+        if (htab[i].rpos) {
+          ++stp->tused[t];
+          _cdb_stat_probe(stp, cdb_dist(htab[i], i, len));
+        }
       }
+      _cdb_stat_table(stp, &sr);
+    }
     for (i = 0; i < len; ++i) {
       cdb_pack(htab[i].hval, p + (i << 3));
       cdb_pack(htab[i].rpos, p + (i << 3) + 4);
@@ -144,15 +295,70 @@ cdb_make_finish_internal(struct cdb_make *cdbmp)
     }
   }
   free(p);
+  return 0;
+}
+
+static int
+cdb_make_finish_internal(struct cdb_make *cdbmp)
+{
+  unsigned hcnt[256];		/* hash table counts */
+  unsigned hpos[256];		/* hash table positions */
+  unsigned keys = 0;		/* distinct keys */
+  unsigned char *p;
+  unsigned t;
+
+  if (((0xffffffff - cdbmp->cdb_dpos) >> 3) < cdbmp->cdb_rcnt)
+    return errno = ENOMEM, -1;
+
+  if (cdbmp->cdb_statp) {
+    memset(cdbmp->cdb_statp, 0, sizeof(struct cdb_stat));
+    cdbmp->cdb_statp->records = cdbmp->cdb_rcnt;
+    cdbmp->cdb_statp->indexed = cdbmp->cdb_rcnt;
+  }
+
+  if (cdbmp->cdb_spillmax) {
+    if (cdbmp->cdb_mflags & CDB_MAKE_MPH)
+      return errno = EINVAL, -1;
+    if (_cdb_make_htabs_spilled(cdbmp, hcnt, hpos, &keys) < 0)
+      return -1;
+  }
+  else if (cdbmp->cdb_mflags & CDB_MAKE_MPH) {
+    /* empty tables: the index goes to the extension area instead */
+    for (t = 0; t < 256; ++t) {
+      hpos[t] = cdbmp->cdb_dpos;
+      hcnt[t] = 0;
+    }
+    if (_cdb_make_mph(cdbmp) < 0)
+      return -1;
+    keys = cdbmp->cdb_rcnt; /* unique, or _cdb_make_mph() fails */
+    if (cdbmp->cdb_statp) {
+      cdbmp->cdb_statp->slots = cdbmp->cdb_rcnt;
+      cdbmp->cdb_statp->probes[0] = cdbmp->cdb_rcnt;
+    }
+  }
+  else if (cdb_make_htabs(cdbmp, hcnt, hpos, &keys) < 0)
+    return -1;
+  if (cdbmp->cdb_statp)
+    _cdb_stat_done(cdbmp->cdb_statp);
+  if ((cdbmp->cdb_mflags & CDB_MAKE_DEDUP) && _cdb_make_dedup_ext(cdbmp) < 0)
+    return -1;
+  if (_cdb_make_meta(cdbmp, keys) < 0)
+    return -1;
+
   if (_cdb_make_flush(cdbmp) < 0)
     return -1;
+  /* records removed by cdb_make_put() may have left more behind */
+  if (cdbmp->cdb_mbuf)
+    cdbmp->cdb_mlen = cdbmp->cdb_dpos;
+  else if (ftruncate(cdbmp->cdb_fd, (off_t)cdbmp->cdb_dpos) < 0)
+    return -1;
   p = cdbmp->cdb_buf;
   for (t = 0; t < 256; ++t) {
     cdb_pack(hpos[t], p + (t << 3));
     cdb_pack(hcnt[t], p + (t << 3) + 4);
   }
-  if (lseek(cdbmp->cdb_fd, 0, 0) != 0 ||
-      _cdb_make_fullwrite(cdbmp->cdb_fd, p, 2048) != 0)
+  if (_cdb_make_seek(cdbmp, 0) < 0 ||
+      _cdb_make_out(cdbmp, p, 2048) < 0)
     return -1;
 
   return 0;
@@ -169,7 +375,12 @@ cdb_make_free(struct cdb_make *cdbmp)
       rl = rl->next;
       free(tm);
     }
+    cdbmp->cdb_rec[t] = NULL;
   }
+  _cdb_make_free_runs(cdbmp);
+  free(cdbmp->cdb_dvals);
+  cdbmp->cdb_dvals = NULL;
+  cdbmp->cdb_dsize = cdbmp->cdb_dcnt = 0;
 }
 
 int
@@ -9,16 +9,10 @@
 #include "cdb_int.h"
 
 int internal_function
-_cdb_make_add(struct cdb_make *cdbmp, unsigned hval,
-              const void *key, unsigned klen,
-              const void *val, unsigned vlen)
+_cdb_make_addrec(struct cdb_make *cdbmp, unsigned hval, unsigned rpos)
 {
-  unsigned char rlen[8];
   struct cdb_rl *rl;
   unsigned i;
-  if (klen > 0xffffffff - (cdbmp->cdb_dpos + 8) ||
-      vlen > 0xffffffff - (cdbmp->cdb_dpos + klen + 8))
-    return errno = ENOMEM, -1;
   i = hval & 255;
   rl = cdbmp->cdb_rec[i];
   if (!rl || rl->cnt >= sizeof(rl->rec)/sizeof(rl->rec[0])) {
@@ -31,10 +25,43 @@ _cdb_make_add(struct cdb_make *cdbmp, unsigned hval,
   }
   i = rl->cnt++;
   rl->rec[i].hval = hval;
-  rl->rec[i].rpos = cdbmp->cdb_dpos;
+  rl->rec[i].rpos = rpos;
   ++cdbmp->cdb_rcnt;
+  if (cdbmp->cdb_spillmax &&
+      cdbmp->cdb_rcnt - cdbmp->cdb_spilled >= cdbmp->cdb_spillmax &&
+      _cdb_make_spill(cdbmp) < 0)
+    return -1;
+  return 0;
+}
+
+int internal_function
+_cdb_make_add(struct cdb_make *cdbmp, unsigned hval,
+              const void *key, unsigned klen,
+              const void *val, unsigned vlen)
+{
+  unsigned char rlen[8], ref[8];
+  unsigned vpos;
+  int r = 0;
+  if (klen > 0xffffffff - (cdbmp->cdb_dpos + 8) ||
+      vlen > 0xffffffff - (cdbmp->cdb_dpos + klen + 8))
+    return errno = ENOMEM, -1;
+  /* a reference is 8 bytes: only longer values are worth sharing */
+  if ((cdbmp->cdb_mflags & CDB_MAKE_DEDUP) && vlen > 8 &&
+      (r = _cdb_make_dedup(cdbmp, val, vlen,
+                           cdbmp->cdb_dpos + 8 + klen, &vpos)) < 0)
+    return -1;
+  if (_cdb_make_addrec(cdbmp, hval, cdbmp->cdb_dpos) < 0)
+    return -1;
+  cdbmp->cdb_kbytes += klen;
+  cdbmp->cdb_vbytes += vlen;
   cdb_pack(klen, rlen);
-  cdb_pack(vlen, rlen + 4);
+  cdb_pack(r ? CDB_VREF : vlen, rlen + 4);
+  if (r) {
+    cdb_pack(vpos, ref);
+    cdb_pack(vlen, ref + 4);
+    val = ref;
+    vlen = 8;
+  }
   if (_cdb_make_write(cdbmp, rlen, 8) < 0 ||
       _cdb_make_write(cdbmp, key, klen) < 0 ||
       _cdb_make_write(cdbmp, val, vlen) < 0)
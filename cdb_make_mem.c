@@ -0,0 +1,64 @@
+/* building a cdb in memory
+ *
+ * This file is a part of lua-tinycdb.
+ *
+ * A cdb_make started with cdb_make_start_mem() has no file: what would
+ * be written to cdb_fd goes to cdb_mbuf instead, at cdb_mpos, which
+ * stands for the file offset so that the routines seeking back to
+ * rewrite records work the same.  cdb_buf is bypassed, as copying
+ * through it would buy nothing: cdb_bpos stays at its start.
+ */
+
+#include <stdlib.h>
+#include "cdb_int.h"
+
+int
+cdb_make_start_mem(struct cdb_make *cdbmp, void *buf, unsigned size)
+{
+  cdb_make_start(cdbmp, -1);
+  cdbmp->cdb_bpos = cdbmp->cdb_buf;
+  if (buf)
+    cdbmp->cdb_mbuf = (unsigned char *)buf;
+  else {
+    if (size < 4096)
+      size = 4096;
+    if (!(cdbmp->cdb_mbuf = (unsigned char *)malloc(size)))
+      return errno = ENOMEM, -1;
+    cdbmp->cdb_mgrow = 1;
+  }
+  cdbmp->cdb_msize = size;
+  if (size < 2048)
+    return errno = ENOSPC, -1;
+  /* room for the toc, written last */
+  memset(cdbmp->cdb_mbuf, 0, 2048);
+  cdbmp->cdb_mpos = cdbmp->cdb_mlen = 2048;
+  return 0;
+}
+
+int internal_function
+_cdb_make_mem_put(struct cdb_make *cdbmp, const unsigned char *buf,
+                  unsigned len)
+{
+  unsigned end = cdbmp->cdb_mpos + len, size;
+  unsigned char *p;
+
+  if (end < len)
+    return errno = ENOMEM, -1;
+  if (end > cdbmp->cdb_msize) {
+    if (!cdbmp->cdb_mgrow)
+      return errno = ENOSPC, -1;
+    size = cdbmp->cdb_msize << 1 > cdbmp->cdb_msize ?
+           cdbmp->cdb_msize << 1 : 0xffffffffu;
+    if (size < end)
+      size = end;
+    if (!(p = (unsigned char *)realloc(cdbmp->cdb_mbuf, size)))
+      return errno = ENOMEM, -1;
+    cdbmp->cdb_mbuf = p;
+    cdbmp->cdb_msize = size;
+  }
+  memcpy(cdbmp->cdb_mbuf + cdbmp->cdb_mpos, buf, len);
+  cdbmp->cdb_mpos = end;
+  if (cdbmp->cdb_mlen < end)
+    cdbmp->cdb_mlen = end;
+  return 0;
+}
@@ -0,0 +1,179 @@
+/* combining separately built shards into one cdb
+ *
+ * This file is a part of lua-tinycdb.
+ *
+ * A cdb_make is single-threaded, but shards of one database can be built
+ * concurrently, each by its own cdb_make writing its own file.  The data
+ * section of every shard is then copied after the records already in
+ * the final maker, and the shard's record infos are rebased by the
+ * difference in data positions and taken over, so cdb_make_finish()
+ * builds one standard database in which records keep their shard order.
+ */
+
+#include <stdlib.h>
+#include "cdb_int.h"
+
+#define COPYBUF 65536
+
+int
+cdb_make_append(struct cdb_make *cdbmp, struct cdb_make *shard)
+{
+  unsigned char *buf;
+  unsigned delta, pos, len, t, i;
+  struct cdb_rl *rl;
+
+  /* shared values would need their references rebased */
+  if (shard == cdbmp || shard->cdb_nruns ||
+      (shard->cdb_mflags & CDB_MAKE_DEDUP))
+    return errno = EINVAL, -1;
+  if (shard->cdb_dpos - 2048 > 0xffffffff - cdbmp->cdb_dpos ||
+      shard->cdb_rcnt > 0xffffffff - cdbmp->cdb_rcnt)
+    return errno = ENOMEM, -1;
+
+  /* copy the data section */
+  buf = (unsigned char*)malloc(COPYBUF);
+  if (!buf)
+    return errno = ENOMEM, -1;
+  delta = cdbmp->cdb_dpos - 2048;
+  for (pos = 2048; pos < shard->cdb_dpos; pos += len) {
+    len = shard->cdb_dpos - pos > COPYBUF ? COPYBUF : shard->cdb_dpos - pos;
+    if (_cdb_make_read(shard, buf, len, pos) < 0 ||
+        _cdb_make_write(cdbmp, buf, len) < 0) {
+      free(buf);
+      return -1;
+    }
+  }
+  free(buf);
+
+  /* rebase the record infos and put them, newer than ours, in front */
+  for (t = 0; t < 256; ++t) {
+    if (!(rl = shard->cdb_rec[t]))
+      continue;
+    for (;; rl = rl->next) {
+      for (i = 0; i < rl->cnt; ++i)
+        rl->rec[i].rpos += delta;
+      if (!rl->next)
+        break;
+    }
+    rl->next = cdbmp->cdb_rec[t];
+    cdbmp->cdb_rec[t] = shard->cdb_rec[t];
+    shard->cdb_rec[t] = NULL;
+  }
+  cdbmp->cdb_rcnt += shard->cdb_rcnt;
+  cdbmp->cdb_kbytes += shard->cdb_kbytes;
+  cdbmp->cdb_vbytes += shard->cdb_vbytes;
+  shard->cdb_rcnt = 0;
+  shard->cdb_kbytes = shard->cdb_vbytes = 0;
+
+  if (cdbmp->cdb_spillmax &&
+      cdbmp->cdb_rcnt - cdbmp->cdb_spilled >= cdbmp->cdb_spillmax &&
+      _cdb_make_spill(cdbmp) < 0)
+    return -1;
+  return 0;
+}
+
+static int
+cmp_rpos(const void *a, const void *b)
+{
+  const struct cdb_rec *ra = (const struct cdb_rec *)a;
+  const struct cdb_rec *rb = (const struct cdb_rec *)b;
+  return ra->rpos < rb->rpos ? -1 : ra->rpos > rb->rpos;
+}
+
+/* the indexed records of cdbp, with their hash values, in index order;
+ * returns how many were put in the malloc()ed *recsp, or -1 */
+int internal_function
+_cdb_recs(const struct cdb *cdbp, struct cdb_rec **recsp)
+{
+  const unsigned char *mem = cdbp->cdb_mem;
+  unsigned dend = cdbp->cdb_dend;
+  unsigned n, t, i, pos, len;
+  struct cdb_rec *recs;
+
+  /* pread mode, or records that would need their references rebased */
+  if (!mem || (cdbp->cdb_flags & CDB_F_DEDUP))
+    return errno = EINVAL, -1;
+  if (cdbp->cdb_flags & CDB_F_MPH)
+    n = cdb_unpack(mem + cdbp->cdb_mphpos + 4);
+  else
+    for (n = 0, t = 0; t < 256; ++t) {
+      len = cdb_unpack(mem + (t << 3) + 4);
+      pos = cdb_unpack(mem + (t << 3));
+      if (len && (len > (cdbp->cdb_fsize >> 3) || pos < dend ||
+                  pos > cdbp->cdb_fsize || (len << 3) > cdbp->cdb_fsize - pos))
+        return errno = EPROTO, -1;
+      n += len;
+    }
+  recs = (struct cdb_rec*)malloc((n + 1) * sizeof(*recs));
+  if (!recs)
+    return errno = ENOMEM, -1;
+
+  n = 0;
+  if (cdbp->cdb_flags & CDB_F_MPH) {
+    const unsigned char *slots = mem + cdbp->cdb_mphpos + 12 +
+                                 (cdb_unpack(mem + cdbp->cdb_mphpos + 8) << 2);
+    len = cdb_unpack(mem + cdbp->cdb_mphpos + 4);
+    for (i = 0; i < len; ++i)
+      if ((recs[n].rpos = cdb_unpack(slots + (i << 2))) != 0)
+        ++n;
+  }
+  else
+    for (t = 0; t < 256; ++t) {
+      const unsigned char *htab = mem + cdb_unpack(mem + (t << 3));
+      len = cdb_unpack(mem + (t << 3) + 4);
+      for (i = 0; i < len; ++i)
+        if ((recs[n].rpos = cdb_unpack(htab + (i << 3) + 4)) != 0)
+          recs[n++].hval = cdb_unpack(htab + (i << 3));
+    }
+  for (i = 0; i < n; ++i) {
+    pos = recs[i].rpos;
+    if (pos < 2048 || pos > dend - 8 ||
+        cdb_unpack(mem + pos) > dend - pos - 8 ||
+        cdb_unpack(mem + pos + 4) > dend - pos - 8 - cdb_unpack(mem + pos)) {
+      free(recs);
+      return errno = EPROTO, -1;
+    }
+    if (cdbp->cdb_flags & CDB_F_MPH)
+      recs[i].hval = cdb_hash(mem + pos + 8, cdb_unpack(mem + pos));
+  }
+  *recsp = recs;
+  return (int)n;
+}
+
+int
+cdb_make_merge(struct cdb_make *cdbmp, const struct cdb *cdbp)
+{
+  unsigned n, i, delta;
+  struct cdb_rec *recs;
+  int ret;
+
+  if (!cdbp->cdb_mem) /* pread mode */
+    return errno = EINVAL, -1;
+  if (cdbp->cdb_dend - 2048 > 0xffffffff - cdbmp->cdb_dpos)
+    return errno = ENOMEM, -1;
+  if ((ret = _cdb_recs(cdbp, &recs)) < 0)
+    return -1;
+  n = (unsigned)ret;
+  if (n > 0xffffffff - cdbmp->cdb_rcnt) {
+    free(recs);
+    return errno = ENOMEM, -1;
+  }
+
+  /* copy the data section, then add the records in their file order */
+  delta = cdbmp->cdb_dpos - 2048;
+  if (_cdb_make_write(cdbmp, cdbp->cdb_mem + 2048, cdbp->cdb_dend - 2048) < 0) {
+    free(recs);
+    return -1;
+  }
+  qsort(recs, n, sizeof(*recs), cmp_rpos);
+  for (i = 0; i < n; ++i) {
+    if (_cdb_make_addrec(cdbmp, recs[i].hval, recs[i].rpos + delta) < 0) {
+      free(recs);
+      return -1;
+    }
+    cdbmp->cdb_kbytes += cdb_unpack(cdbp->cdb_mem + recs[i].rpos);
+    cdbmp->cdb_vbytes += cdb_unpack(cdbp->cdb_mem + recs[i].rpos + 4);
+  }
+  free(recs);
+  return 0;
+}
@@ -0,0 +1,255 @@
+/* minimal perfect hash index construction
+ *
+ * This file is a part of lua-tinycdb.
+ *
+ * Keys are spread over n/4 buckets.  Buckets are placed largest first:
+ * for each one we search a displacement that sends all its keys to
+ * free, distinct slots.  Buckets of a single key, which come last, are
+ * given the remaining free slots directly.  See cdb_mph.c for lookup.
+ */
+
+#include <stdlib.h>
+#include "cdb_int.h"
+
+#define MPH_LAMBDA	4		/* average keys per bucket */
+#define MPH_MAXDISP	(1u << 24)	/* displacements tried per bucket */
+#define MPH_ATTEMPTS	8		/* seeds tried before giving up */
+
+struct mph_key {
+  unsigned h[2];
+  unsigned rpos;
+};
+
+/* read the key of the record at rpos into *bufp, growing it as needed */
+static int
+mph_readkey(struct cdb_make *cdbmp, unsigned rpos,
+            unsigned char **bufp, unsigned *sizep, unsigned *klenp)
+{
+  unsigned char hdr[8];
+  unsigned klen;
+
+  if (_cdb_make_read(cdbmp, hdr, 8, rpos) < 0)
+    return -1;
+  klen = cdb_unpack(hdr);
+  if (klen > *sizep) {
+    unsigned char *buf = (unsigned char*)realloc(*bufp, klen);
+    if (!buf)
+      return errno = ENOMEM, -1;
+    *bufp = buf;
+    *sizep = klen;
+  }
+  *klenp = klen;
+  return _cdb_make_read(cdbmp, *bufp, klen, rpos + 8);
+}
+
+static int
+mph_keycmp(const void *a, const void *b)
+{
+  const struct mph_key *ka = (const struct mph_key *)a;
+  const struct mph_key *kb = (const struct mph_key *)b;
+  if (ka->h[0] != kb->h[0])
+    return ka->h[0] < kb->h[0] ? -1 : 1;
+  if (ka->h[1] != kb->h[1])
+    return ka->h[1] < kb->h[1] ? -1 : 1;
+  return 0;
+}
+
+/* hash all keys with seed.
+ * return: 0 = ok, 1 = two keys collide (try another seed), -1 = error */
+static int
+mph_hashkeys(struct cdb_make *cdbmp, struct mph_key *keys, unsigned n,
+             unsigned seed)
+{
+  unsigned char *buf = NULL, *buf2 = NULL;
+  unsigned size = 0, size2 = 0;
+  unsigned i, klen, klen2;
+  int r = 0;
+
+  for (i = 0; i < n; ++i) {
+    if (mph_readkey(cdbmp, keys[i].rpos, &buf, &size, &klen) < 0) {
+      r = -1;
+      goto out;
+    }
+    _cdb_mph_hash(buf, klen, seed, keys[i].h);
+  }
+
+  qsort(keys, n, sizeof(*keys), mph_keycmp);
+  for (i = 1; i < n && !r; ++i) {
+    if (mph_keycmp(keys + i - 1, keys + i) != 0)
+      continue;
+    if (mph_readkey(cdbmp, keys[i - 1].rpos, &buf, &size, &klen) < 0 ||
+        mph_readkey(cdbmp, keys[i].rpos, &buf2, &size2, &klen2) < 0)
+      r = -1;
+    else if (klen == klen2 && memcmp(buf, buf2, klen) == 0)
+      r = -1, errno = EEXIST; /* duplicate key, no perfect hash for it */
+    else
+      r = 1;
+  }
+
+out:
+  free(buf);
+  free(buf2);
+  return r;
+}
+
+/* find displacements for all buckets and fill slots[] with positions.
+ * return: 0 = ok, 1 = some bucket could not be placed, -1 = error */
+static int
+mph_place(struct mph_key *keys, unsigned n, unsigned nb,
+          unsigned *disp, unsigned *slots)
+{
+  unsigned *cnt, *start, *members, *order, *pos;
+  unsigned char *taken;
+  unsigned i, j, b, d, s, maxs, nfree;
+  int r = 0;
+
+  cnt = (unsigned*)calloc(n + nb + 1, sizeof(unsigned));
+  start = (unsigned*)calloc(nb + 1, sizeof(unsigned));
+  members = (unsigned*)malloc(n * sizeof(unsigned));
+  order = (unsigned*)malloc(nb * sizeof(unsigned));
+  taken = (unsigned char*)calloc((n >> 3) + 1, 1);
+  pos = NULL;
+  if (!cnt || !start || !members || !order || !taken) {
+    r = -1, errno = ENOMEM;
+    goto out;
+  }
+
+  /* group keys by bucket */
+  maxs = 0;
+  for (i = 0; i < n; ++i)
+    if (++cnt[keys[i].h[0] % nb] > maxs)
+      maxs = cnt[keys[i].h[0] % nb];
+  for (b = 0; b < nb; ++b)
+    start[b + 1] = start[b] + cnt[b];
+  for (i = 0; i < n; ++i) {
+    b = keys[i].h[0] % nb;
+    members[start[b] + --cnt[b]] = i;
+  }
+
+  /* order buckets by decreasing size (counting sort, reusing cnt) */
+  memset(cnt, 0, (maxs + 1) * sizeof(unsigned));
+  for (b = 0; b < nb; ++b)
+    ++cnt[maxs - (start[b + 1] - start[b])];
+  for (s = 0, i = 0; s <= maxs; ++s) {
+    d = cnt[s];
+    cnt[s] = i;
+    i += d;
+  }
+  for (b = 0; b < nb; ++b)
+    order[cnt[maxs - (start[b + 1] - start[b])]++] = b;
+
+  pos = (unsigned*)malloc((maxs + 1) * sizeof(unsigned));
+  if (!pos) {
+    r = -1, errno = ENOMEM;
+    goto out;
+  }
+
+  nfree = 0;
+  for (i = 0; i < nb; ++i) {
+    b = order[i];
+    s = start[b + 1] - start[b];
+    disp[b] = 0;
+    if (!s)
+      continue;
+    if (s == 1) {
+      while(taken[nfree >> 3] & (1 << (nfree & 7)))
+        ++nfree;
+      disp[b] = 0x80000000 | nfree;
+      pos[0] = nfree;
+    }
+    else {
+      for (d = 0; d < MPH_MAXDISP; ++d) {
+        for (j = 0; j < s; ++j) {
+          unsigned k, p = _cdb_mph_pos(keys[members[start[b] + j]].h[1], d, n);
+          if (taken[p >> 3] & (1 << (p & 7)))
+            break;
+          for (k = 0; k < j && pos[k] != p; ++k)
+            ;
+          if (k < j)
+            break;
+          pos[j] = p;
+        }
+        if (j == s)
+          break;
+      }
+      if (d == MPH_MAXDISP) {
+        r = 1;
+        goto out;
+      }
+      disp[b] = d;
+    }
+    for (j = 0; j < s; ++j) {
+      taken[pos[j] >> 3] |= 1 << (pos[j] & 7);
+      slots[pos[j]] = keys[members[start[b] + j]].rpos;
+    }
+  }
+
+out:
+  free(cnt);
+  free(start);
+  free(members);
+  free(order);
+  free(taken);
+  free(pos);
+  return r;
+}
+
+int internal_function
+_cdb_make_mph(struct cdb_make *cdbmp)
+{
+  unsigned n = cdbmp->cdb_rcnt;
+  unsigned nb = n / MPH_LAMBDA + 1;
+  unsigned char hdr[24];
+  struct mph_key *keys;
+  unsigned *disp, *slots;
+  struct cdb_rl *rl;
+  unsigned seed, i, t, len;
+  int r;
+
+  /* magic, section tag and length, seed, nslots, nbuckets */
+  len = 12 + ((nb + n) << 2);
+  if (0xffffffff - cdbmp->cdb_dpos < len + 12)
+    return errno = ENOMEM, -1;
+
+  keys = (struct mph_key*)malloc((n + 1) * sizeof(struct mph_key));
+  disp = (unsigned*)malloc((nb + n) * sizeof(unsigned));
+  if (!keys || !disp) {
+    free(keys);
+    free(disp);
+    return errno = ENOMEM, -1;
+  }
+  slots = disp + nb;
+
+  r = 1;
+  for (seed = 0; seed < MPH_ATTEMPTS && r > 0; ++seed) {
+    for (i = 0, t = 0; t < 256; ++t)
+      for (rl = cdbmp->cdb_rec[t]; rl; rl = rl->next) {
+        unsigned j;
+        for (j = 0; j < rl->cnt; ++j)
+          keys[i++].rpos = rl->rec[j].rpos;
+      }
+    r = mph_hashkeys(cdbmp, keys, n, seed);
+    if (!r)
+      r = mph_place(keys, n, nb, disp, slots);
+  }
+  free(keys);
+  if (r) {
+    free(disp);
+    if (r > 0)
+      errno = EAGAIN;
+    return -1;
+  }
+
+  memcpy(hdr, CDB_EXT_MAGIC, 4);
+  cdb_pack(CDB_EXT_MPH, hdr + 4);
+  cdb_pack(len, hdr + 8);
+  cdb_pack(seed - 1, hdr + 12);
+  cdb_pack(n, hdr + 16);
+  cdb_pack(nb, hdr + 20);
+  for (i = 0; i < nb + n; ++i)
+    cdb_pack(disp[i], (unsigned char *)(disp + i));
+  r = _cdb_make_write(cdbmp, hdr, sizeof(hdr)) < 0 ||
+      _cdb_make_write(cdbmp, (unsigned char *)disp, (nb + n) << 2) < 0;
+  free(disp);
+  return r ? -1 : 0;
+}
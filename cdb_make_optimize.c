@@ -0,0 +1,144 @@
+/* rewriting a cdb for locality of reference
+ *
+ * This file is a part of lua-tinycdb.
+ *
+ * Records are written in the order they were added, so the records a
+ * hash table points to, or those of the most used keys, are spread over
+ * the whole data section and each lookup touches a page of its own.
+ * cdb_make_optimize() copies the reachable records of a database in a
+ * better order and adds them to a maker, whose cdb_make_finish() then
+ * writes hash tables to match.  The result is a standard cdb.
+ */
+
+#include <stdlib.h>
+#include "cdb_int.h"
+
+struct opt_rec {
+  unsigned rank;		/* position in hot[], nhot if not there */
+  unsigned home;		/* table << 24 | home slot, saturated */
+  unsigned hval;
+  unsigned rpos;
+};
+
+static int
+cmp_rpos(const void *a, const void *b)
+{
+  const struct opt_rec *ra = (const struct opt_rec *)a;
+  const struct opt_rec *rb = (const struct opt_rec *)b;
+  return ra->rpos < rb->rpos ? -1 : ra->rpos > rb->rpos;
+}
+
+static int
+cmp_order(const void *a, const void *b)
+{
+  const struct opt_rec *ra = (const struct opt_rec *)a;
+  const struct opt_rec *rb = (const struct opt_rec *)b;
+  if (ra->rank != rb->rank)
+    return ra->rank < rb->rank ? -1 : 1;
+  if (ra->home != rb->home)
+    return ra->home < rb->home ? -1 : 1;
+  return ra->rpos < rb->rpos ? -1 : ra->rpos > rb->rpos;
+}
+
+static int
+cmp_unsigned(const void *a, const void *b)
+{
+  unsigned ua = ((const unsigned *)a)[0], ub = ((const unsigned *)b)[0];
+  return ua < ub ? -1 : ua > ub;
+}
+
+int
+cdb_make_optimize(struct cdb_make *cdbmp, const struct cdb *cdbp,
+                  const unsigned *hot, unsigned nhot)
+{
+  const unsigned char *mem = cdbp->cdb_mem;
+  unsigned cnt[256], tlen[256], *byrpos = NULL;
+  unsigned n, i, j, len, total;
+  struct cdb_rec *recs;
+  struct opt_rec *orec;
+  int ret;
+
+  if ((ret = _cdb_recs(cdbp, &recs)) < 0)
+    return -1;
+  n = (unsigned)ret;
+  orec = (struct opt_rec*)malloc((n + 1) * sizeof(*orec));
+  if (nhot)
+    byrpos = (unsigned*)malloc(nhot * 2 * sizeof(*byrpos));
+  if (!orec || (nhot && !byrpos)) {
+    free(recs);
+    free(orec);
+    free(byrpos);
+    return errno = ENOMEM, -1;
+  }
+
+  /* home slots in the tables cdb_make_finish() will write, sized as it
+   * sizes them for the load of the maker */
+  memset(cnt, 0, sizeof(cnt));
+  for (i = 0; i < n; ++i)
+    ++cnt[recs[i].hval & 255];
+  for (i = 0; i < 256; ++i)
+    if (cnt[i] && _cdb_make_tsize(cdbmp, cnt[i], &tlen[i]) < 0) {
+      free(recs);
+      free(orec);
+      free(byrpos);
+      return -1;
+    }
+  for (i = 0, total = 0; i < n; ++i) {
+    unsigned t = recs[i].hval & 255;
+    unsigned home = (recs[i].hval >> 8) % tlen[t];
+    orec[i].rank = nhot;
+    orec[i].home = t << 24 | (home < 0xffffff ? home : 0xffffff);
+    orec[i].hval = recs[i].hval;
+    orec[i].rpos = recs[i].rpos;
+    len = 8 + cdb_unpack(mem + orec[i].rpos) + cdb_unpack(mem + orec[i].rpos + 4);
+    if (len > 0xffffffff - total) {
+      total = 0xffffffff;
+      break;
+    }
+    total += len;
+  }
+  free(recs);
+  if (total > 0xffffffff - cdbmp->cdb_dpos ||
+      n > 0xffffffff - cdbmp->cdb_rcnt) {
+    free(orec);
+    free(byrpos);
+    return errno = ENOMEM, -1;
+  }
+
+  /* rank the hot records: match both lists sorted by position */
+  if (nhot) {
+    for (i = 0; i < nhot; ++i) {
+      byrpos[i << 1] = hot[i];
+      byrpos[(i << 1) + 1] = i;
+    }
+    qsort(byrpos, nhot, 2 * sizeof(*byrpos), cmp_unsigned);
+    qsort(orec, n, sizeof(*orec), cmp_rpos);
+    for (i = 0, j = 0; i < n && j < nhot; ) {
+      if (byrpos[j << 1] < orec[i].rpos)
+        ++j;
+      else if (byrpos[j << 1] > orec[i].rpos)
+        ++i;
+      else {
+        /* the first mention of a record counts */
+        if (orec[i].rank > byrpos[(j << 1) + 1])
+          orec[i].rank = byrpos[(j << 1) + 1];
+        ++j;
+      }
+    }
+    free(byrpos);
+  }
+  qsort(orec, n, sizeof(*orec), cmp_order);
+
+  for (i = 0; i < n; ++i) {
+    len = 8 + cdb_unpack(mem + orec[i].rpos) + cdb_unpack(mem + orec[i].rpos + 4);
+    if (_cdb_make_addrec(cdbmp, orec[i].hval, cdbmp->cdb_dpos) < 0 ||
+        _cdb_make_write(cdbmp, mem + orec[i].rpos, len) < 0) {
+      free(orec);
+      return -1;
+    }
+    cdbmp->cdb_kbytes += cdb_unpack(mem + orec[i].rpos);
+    cdbmp->cdb_vbytes += cdb_unpack(mem + orec[i].rpos + 4);
+  }
+  free(orec);
+  return 0;
+}
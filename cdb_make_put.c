@@ -27,21 +27,20 @@ nexthash:;
 static int
 remove_record(struct cdb_make *cdbmp, unsigned rpos, unsigned rlen) {
   unsigned pos, len;
-  int r, fd;
+  int r;
 
   len = cdbmp->cdb_dpos - rpos - rlen;
   cdbmp->cdb_dpos -= rlen;
   if (!len)
     return 0;	/* it was the last record, nothing to do */
   pos = rpos;
-  fd = cdbmp->cdb_fd;
   do {
     r = len > sizeof(cdbmp->cdb_buf) ? sizeof(cdbmp->cdb_buf) : len;
-    if (lseek(fd, pos + rlen, SEEK_SET) < 0 ||
-        (r = read(fd, cdbmp->cdb_buf, r)) <= 0)
+    if (_cdb_make_seek(cdbmp, pos + rlen) < 0 ||
+        (r = _cdb_make_in(cdbmp, cdbmp->cdb_buf, r)) <= 0)
       return -1;
-    if (lseek(fd, pos, SEEK_SET) < 0 ||
-        _cdb_make_fullwrite(fd, cdbmp->cdb_buf, r) < 0)
+    if (_cdb_make_seek(cdbmp, pos) < 0 ||
+        _cdb_make_out(cdbmp, cdbmp->cdb_buf, r) < 0)
       return -1;
     pos += r;
     len -= r;
@@ -57,13 +56,13 @@ zerofill_record(struct cdb_make *cdbmp, unsigned rpos, unsigned rlen) {
     cdbmp->cdb_dpos = rpos;
     return 0;
   }
-  if (lseek(cdbmp->cdb_fd, rpos, SEEK_SET) < 0)
+  if (_cdb_make_seek(cdbmp, rpos) < 0)
     return -1;
   memset(cdbmp->cdb_buf, 0, sizeof(cdbmp->cdb_buf));
   cdb_pack(rlen - 8, cdbmp->cdb_buf + 4);
   for(;;) {
     rpos = rlen > sizeof(cdbmp->cdb_buf) ? sizeof(cdbmp->cdb_buf) : rlen;
-    if (_cdb_make_fullwrite(cdbmp->cdb_fd, cdbmp->cdb_buf, rpos) < 0)
+    if (_cdb_make_out(cdbmp, cdbmp->cdb_buf, rpos) < 0)
       return -1;
     rlen -= rpos;
     if (!rlen) return 0;
@@ -77,22 +76,24 @@ match(struct cdb_make *cdbmp, unsigned pos, const char *key, unsigned klen)
 {
   int len;
   unsigned rlen;
-  if (lseek(cdbmp->cdb_fd, pos, SEEK_SET) < 0)
+  if (_cdb_make_seek(cdbmp, pos) < 0)
     return 1;
-  if (read(cdbmp->cdb_fd, cdbmp->cdb_buf, 8) != 8)
+  if (_cdb_make_in(cdbmp, cdbmp->cdb_buf, 8) != 8)
     return 1;
   if (cdb_unpack(cdbmp->cdb_buf) != klen)
     return 0;
 
   /* record length; check its validity */
   rlen = cdb_unpack(cdbmp->cdb_buf + 4);
+  if (rlen == CDB_VREF && (cdbmp->cdb_mflags & CDB_MAKE_DEDUP))
+    rlen = 8;	/* a shared value */
   if (rlen > cdbmp->cdb_dpos - pos - klen - 8)
     return errno = EPROTO, 1;	/* someone changed our file? */
   rlen += klen + 8;
 
   while(klen) {
     len = klen > sizeof(cdbmp->cdb_buf) ? sizeof(cdbmp->cdb_buf) : klen;
-    len = read(cdbmp->cdb_fd, cdbmp->cdb_buf, len);
+    len = _cdb_make_in(cdbmp, cdbmp->cdb_buf, len);
     if (len <= 0)
       return 1;
     if (memcmp(cdbmp->cdb_buf, key, len) != 0)
@@ -114,6 +115,11 @@ findrec(struct cdb_make *cdbmp,
   unsigned r;
   int seeked = 0;
   int ret = 0;
+  if (cdbmp->cdb_spillmax) /* record infos may be on disk */
+    return errno = EINVAL, -1;
+  if ((cdbmp->cdb_mflags & CDB_MAKE_DEDUP) &&
+      (mode == CDB_FIND_REMOVE || mode == CDB_FIND_FILL0))
+    return errno = EINVAL, -1; /* later records may share its value */
   for(rl = cdbmp->cdb_rec[hval&255]; rl; rl = rl->next)
     for(rs = rl->rec, rp = rs + rl->cnt; --rp >= rs;) {
       if (rp->hval != hval)
@@ -145,9 +151,11 @@ findrec(struct cdb_make *cdbmp,
       memmove(rp, rp + 1, (rs + rl->cnt - 1 - rp) * sizeof(*rp));
       --rl->cnt;
       --cdbmp->cdb_rcnt;
+      cdbmp->cdb_kbytes -= klen;
+      cdbmp->cdb_vbytes -= r - 8 - klen;
   }
 finish:
-  if (seeked && lseek(cdbmp->cdb_fd, cdbmp->cdb_dpos, SEEK_SET) < 0)
+  if (seeked && _cdb_make_seek(cdbmp, cdbmp->cdb_dpos) < 0)
     return -1;
   return ret;
 }
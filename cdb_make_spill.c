@@ -0,0 +1,615 @@
+/* bounded memory cdb creation
+ *
+ * This file is a part of lua-tinycdb.
+ *
+ * Once the record infos held in memory would take more than
+ * cdb_spillmem bytes, all of them are written to the spill file as one
+ * run, grouped by hash table, and freed.  cdb_make_finish() writes what
+ * is left as a last run, then gathers one table at a time from all
+ * runs and writes its slots out in order: sorted by home slot, records
+ * take the next free slot as in linear probing, and those running past
+ * the end wrap into the first free slots.  Short of the wrapped ones
+ * and of the order within a home slot, this is the layout Robin Hood
+ * placement ends up with, so CDB_MAKE_ROBINHOOD makes no difference
+ * here.  The records gathered at once fit in cdb_spillmem as well: a
+ * table with more is written by write_bounded(), a pass over its part
+ * of the spill file for each share of its records that fits.
+ */
+
+#include <sys/types.h>
+#include <stdlib.h>
+#include <unistd.h>
+#include "cdb_int.h"
+
+/* record infos of a table being written out */
+struct spill_rec {
+  unsigned home;
+  unsigned hval;
+  unsigned rpos;
+};
+
+/* the record infos to hold before spilling them: the record lists
+ * that fit in cdb_spillmem next to the runs, one list of each table
+ * being partly used, and at least one more list per table */
+static void
+spill_size(struct cdb_make *cdbmp)
+{
+  const unsigned per = sizeof(((struct cdb_rl *)0)->rec) /
+                       sizeof(struct cdb_rec);
+  unsigned long long runs = (cdbmp->cdb_nruns + 1ull) * sizeof(struct cdb_run);
+  unsigned long long lists = cdbmp->cdb_spillmem > runs ?
+    (cdbmp->cdb_spillmem - runs) / sizeof(struct cdb_rl) : 0;
+  cdbmp->cdb_spillmax = lists > 512 ? (unsigned)(lists - 256) * per : 256 * per;
+}
+
+int
+cdb_make_spill(struct cdb_make *cdbmp, int fd, unsigned maxmem)
+{
+  if (cdbmp->cdb_rcnt || (cdbmp->cdb_mflags & CDB_MAKE_MPH) ||
+      cdbmp->cdb_mbuf)
+    return errno = EINVAL, -1;
+  cdbmp->cdb_spillfd = fd;
+  cdbmp->cdb_spillmem = maxmem;
+  cdbmp->cdb_spillpeak = 0;
+  spill_size(cdbmp);
+  return 0;
+}
+
+static int
+spill_write(int fd, const void *buf, unsigned len, unsigned long long pos)
+{
+  const char *p = (const char *)buf;
+  int l;
+  while(len) {
+    l = pwrite(fd, p, len, (off_t)pos);
+    if (l < 0 && errno == EINTR)
+      continue;
+    if (l <= 0)
+      return -1;
+    p += l; len -= l; pos += l;
+  }
+  return 0;
+}
+
+static int
+spill_read(int fd, void *buf, unsigned len, unsigned long long pos)
+{
+  char *p = (char *)buf;
+  int l;
+  while(len) {
+    l = pread(fd, p, len, (off_t)pos);
+    if (l < 0 && errno == EINTR)
+      continue;
+    if (l <= 0) {
+      if (!l)
+        errno = EIO;
+      return -1;
+    }
+    p += l; len -= l; pos += l;
+  }
+  return 0;
+}
+
+/* reverse a newest-first record list into insertion order */
+static struct cdb_rl *
+rl_reverse(struct cdb_rl *rl)
+{
+  struct cdb_rl *rlt = NULL, *rln;
+  for (; rl; rl = rln) {
+    rln = rl->next;
+    rl->next = rlt;
+    rlt = rl;
+  }
+  return rlt;
+}
+
+int internal_function
+_cdb_make_spill(struct cdb_make *cdbmp)
+{
+  struct cdb_run *run;
+  struct cdb_rl *rl, *rln;
+  unsigned long long pos, mem;
+  unsigned t;
+
+  run = (struct cdb_run*)realloc(cdbmp->cdb_runs,
+                                 (cdbmp->cdb_nruns + 1) * sizeof(*run));
+  if (!run)
+    return errno = ENOMEM, -1;
+  cdbmp->cdb_runs = run;
+  mem = (cdbmp->cdb_nruns + 1ull) * sizeof(*run);
+  run += cdbmp->cdb_nruns;
+  pos = run->pos = (unsigned long long)cdbmp->cdb_spilled * sizeof(struct cdb_rec);
+
+  for (t = 0; t < 256; ++t) {
+    run->cnt[t] = 0;
+    for (rl = rl_reverse(cdbmp->cdb_rec[t]); rl; rl = rln) {
+      rln = rl->next;
+      if (spill_write(cdbmp->cdb_spillfd, rl->rec,
+                      rl->cnt * sizeof(struct cdb_rec), pos) < 0) {
+        cdbmp->cdb_rec[t] = rl_reverse(rl);
+        return -1;
+      }
+      pos += rl->cnt * sizeof(struct cdb_rec);
+      run->cnt[t] += rl->cnt;
+      cdbmp->cdb_spilled += rl->cnt;
+      mem += sizeof(*rl);
+      free(rl);
+    }
+    cdbmp->cdb_rec[t] = NULL;
+  }
+  if (cdbmp->cdb_spillpeak < mem)
+    cdbmp->cdb_spillpeak = mem;
+  ++cdbmp->cdb_nruns;
+  spill_size(cdbmp); /* the runs take more of it now */
+  return 0;
+}
+
+void internal_function
+_cdb_make_free_runs(struct cdb_make *cdbmp)
+{
+  free(cdbmp->cdb_runs);
+  cdbmp->cdb_runs = NULL;
+  cdbmp->cdb_nruns = 0;
+}
+
+/* records sorted by home, those of a hash value, and so all those of
+ * a key, next to each other in the order they were added */
+static int
+cmp_rec(const void *a, const void *b)
+{
+  const struct spill_rec *ra = (const struct spill_rec *)a;
+  const struct spill_rec *rb = (const struct spill_rec *)b;
+  if (ra->home != rb->home)
+    return ra->home < rb->home ? -1 : 1;
+  if (ra->hval != rb->hval)
+    return ra->hval < rb->hval ? -1 : 1;
+  return ra->rpos < rb->rpos ? -1 : ra->rpos > rb->rpos;
+}
+
+/* move recs[i] up, or down, the max-heap of the first n records */
+static void
+heap_up(struct spill_rec *recs, unsigned i)
+{
+  struct spill_rec r = recs[i];
+  for (; i && cmp_rec(recs + (i - 1) / 2, &r) < 0; i = (i - 1) / 2)
+    recs[i] = recs[(i - 1) / 2];
+  recs[i] = r;
+}
+
+static void
+heap_down(struct spill_rec *recs, unsigned n, unsigned i)
+{
+  struct spill_rec r = recs[i];
+  unsigned c;
+  while ((c = 2 * i + 1) < n) {
+    if (c + 1 < n && cmp_rec(recs + c + 1, recs + c) > 0)
+      ++c;
+    if (cmp_rec(recs + c, &r) <= 0)
+      break;
+    recs[i] = recs[c];
+    i = c;
+  }
+  recs[i] = r;
+}
+
+/* records of a table gathered into recs: every one with max 0, else
+ * the first max of those after *after (from the start if NULL) in the
+ * order of cmp_rec, kept in a max-heap while gathering */
+struct tgather {
+  struct spill_rec *recs;
+  unsigned n, len;
+  unsigned max;
+  const struct spill_rec *after;
+};
+
+static void
+tg_add(struct tgather *tg, unsigned hval, unsigned rpos)
+{
+  struct spill_rec r;
+  r.home = (hval >> 8) % tg->len;
+  r.hval = hval;
+  r.rpos = rpos;
+  if (!tg->max)
+    tg->recs[tg->n++] = r;
+  else if (tg->after && cmp_rec(&r, tg->after) <= 0)
+    return;
+  else if (tg->n < tg->max) {
+    tg->recs[tg->n] = r;
+    heap_up(tg->recs, tg->n++);
+  }
+  else if (cmp_rec(&r, tg->recs) < 0) {
+    tg->recs[0] = r;
+    heap_down(tg->recs, tg->n, 0);
+  }
+}
+
+/* pass the record infos of table t to tg_add(), from every run, whose
+ * part for t starts at off[r] */
+static int
+table_each(struct cdb_make *cdbmp, unsigned t, const unsigned long long *off,
+           struct cdb_rec *rb, struct tgather *tg)
+{
+  const unsigned per = sizeof(((struct cdb_rl *)0)->rec) / sizeof(*rb);
+  unsigned long long pos;
+  unsigned r, i, c, cnt;
+
+  for (r = 0; r < cdbmp->cdb_nruns; ++r)
+    for (cnt = cdbmp->cdb_runs[r].cnt[t], pos = off[r]; cnt; cnt -= c) {
+      c = cnt > per ? per : cnt;
+      if (spill_read(cdbmp->cdb_spillfd, rb, c * sizeof(*rb), pos) < 0)
+        return -1;
+      pos += c * sizeof(*rb);
+      for (i = 0; i < c; ++i)
+        tg_add(tg, rb[i].hval, rb[i].rpos);
+    }
+  return 0;
+}
+
+/* a table being written out in parts, by write_bounded() */
+struct tbound {
+  unsigned tpos, len;		/* where the table starts, its slots */
+  unsigned s;			/* next slot to write */
+  unsigned next;		/* first slot a record can take */
+  unsigned fs;			/* first slot that may be free, for wraps */
+  int grp;			/* a record was written, and so: */
+  unsigned ghval;		/* the hash value of the last one */
+  unsigned gs;			/* the slot of the first one with it, or
+				 * len if all of those wrapped */
+  unsigned b;			/* bytes in buf */
+  unsigned char buf[4096];
+};
+
+static int
+tb_flush(struct cdb_make *cdbmp, struct tbound *tb)
+{
+  if (tb->b && _cdb_make_write(cdbmp, tb->buf, tb->b) < 0)
+    return -1;
+  tb->b = 0;
+  return 0;
+}
+
+static int
+tb_slot(struct cdb_make *cdbmp, struct tbound *tb,
+        const struct spill_rec *r)
+{
+  if (r) {
+    cdb_pack(r->hval, tb->buf + tb->b);
+    cdb_pack(r->rpos, tb->buf + tb->b + 4);
+    if (!tb->grp || r->hval != tb->ghval) {
+      tb->grp = 1;
+      tb->ghval = r->hval;
+      tb->gs = tb->s;
+    }
+  }
+  else
+    memset(tb->buf + tb->b, 0, 8);
+  ++tb->s;
+  if ((tb->b += 8) == sizeof(tb->buf) || tb->s == tb->len)
+    return tb_flush(cdbmp, tb);
+  return 0;
+}
+
+/* whether a record written out with the hash value of r, which is that
+ * of the last one written, has the same key: 1, 0 or -1.  They take
+ * the slots from gs on, and may have wrapped into the first ones */
+static int
+tb_samekey(struct cdb_make *cdbmp, struct tbound *tb,
+           const struct spill_rec *r)
+{
+  unsigned char buf[4096];
+  unsigned pos, end, c, i, rpos;
+  int ret, part;
+
+  if (tb_flush(cdbmp, tb) < 0)
+    return -1;
+  for (part = 0; part < 2; ++part) {
+    pos = part ? 0 : tb->gs;
+    end = part ? tb->fs : (tb->s < tb->len ? tb->s : tb->len);
+    for (; pos < end; pos += c) {
+      c = end - pos < sizeof(buf) >> 3 ? end - pos : sizeof(buf) >> 3;
+      if (_cdb_make_read(cdbmp, buf, c << 3, tb->tpos + (pos << 3)) < 0)
+        return -1;
+      for (i = 0; i < c; ++i) {
+        rpos = cdb_unpack(buf + (i << 3) + 4);
+        if (rpos && cdb_unpack(buf + (i << 3)) == r->hval &&
+            (ret = _cdb_make_samekey(cdbmp, rpos, r->rpos)) != 0)
+          return ret;
+      }
+    }
+  }
+  return 0;
+}
+
+/* add the distinct keys among the n sorted records in recs to *keysp:
+ * a record starts a key unless an earlier one of its hash value has the
+ * same key.  With tb, the first ones may share the hash value of
+ * records of the table that are already written out */
+static int
+count_keys(struct cdb_make *cdbmp, const struct spill_rec *recs,
+           unsigned n, unsigned *keysp, struct tbound *tb)
+{
+  unsigned i, g, b;
+  int found;
+
+  for (i = 0, g = 0; i < n; ++i) {
+    if (recs[i].hval != recs[g].hval)
+      g = i;
+    for (found = 0, b = g; b < i && !found; ++b)
+      if ((found = _cdb_make_samekey(cdbmp, recs[b].rpos, recs[i].rpos)) < 0)
+        return -1;
+    if (!found && !g && tb && tb->grp && tb->ghval == recs[i].hval &&
+        (found = tb_samekey(cdbmp, tb, recs + i)) < 0)
+      return -1;
+    if (!found)
+      ++*keysp;
+  }
+  return 0;
+}
+
+/* write out one table of len slots holding the n records in recs,
+ * adding the distinct keys among them to *keysp */
+static int
+write_table(struct cdb_make *cdbmp, struct spill_rec *recs,
+            unsigned n, unsigned len, unsigned *keysp)
+{
+  struct cdb_stat *stp = cdbmp->cdb_statp;
+  unsigned char buf[4096];
+  unsigned i, s, b, next, nwrap, wrap, pos;
+  struct cdb_srun sr;
+
+  qsort(recs, n, sizeof(*recs), cmp_rec);
+  if (count_keys(cdbmp, recs, n, keysp, NULL) < 0)
+    return -1;
+  memset(&sr, 0, sizeof(sr));
+  /* records placed past the end are the tail of the sorted list */
+  for (i = 0, next = 0; i < n; ++i) {
+    pos = recs[i].home > next ? recs[i].home : next;
+    if (pos >= len)
+      break;
+    next = pos + 1;
+  }
+  nwrap = n - i;
+  wrap = i;
+
+  for (s = 0, i = 0, next = 0, b = 0; s < len; ++s) {
+    struct spill_rec *r = NULL;
+    if (i < wrap) {
+      pos = recs[i].home > next ? recs[i].home : next;
+      if (pos == s) {
+        r = recs + i++;
+        next = pos + 1;
+      }
+    }
+    if (!r && nwrap) {
+      r = recs + wrap++;
+      --nwrap;
+    }
+    if (r) {
+      cdb_pack(r->hval, buf + b);
+      cdb_pack(r->rpos, buf + b + 4);
+      if (stp)
+        _cdb_stat_probe(stp, (s + len - r->home) % len);
+    }
+    else
+      memset(buf + b, 0, 8);
+    if (stp)
+      _cdb_stat_slot(stp, &sr, r != NULL);
+    if ((b += 8) == sizeof(buf) || s == len - 1) {
+      if (_cdb_make_write(cdbmp, buf, b) < 0)
+        return -1;
+      b = 0;
+    }
+  }
+  if (stp)
+    _cdb_stat_table(stp, &sr);
+  return 0;
+}
+
+/* put the n records that ran past the end of the table, which is all
+ * written out, into its first free slots */
+static int
+tb_wrap(struct cdb_make *cdbmp, struct tbound *tb,
+        const struct spill_rec *recs, unsigned n)
+{
+  struct cdb_stat *stp = cdbmp->cdb_statp;
+  unsigned char buf[4096];
+  unsigned c, i;
+
+  while (n) {
+    if (tb->fs >= tb->len)
+      return errno = EPROTO, -1;
+    c = tb->len - tb->fs < sizeof(buf) >> 3 ? tb->len - tb->fs : sizeof(buf) >> 3;
+    if (_cdb_make_read(cdbmp, buf, c << 3, tb->tpos + (tb->fs << 3)) < 0)
+      return -1;
+    for (i = 0; i < c && n; ++i)
+      if (!cdb_unpack(buf + (i << 3) + 4)) {
+        cdb_pack(recs->hval, buf + (i << 3));
+        cdb_pack(recs->rpos, buf + (i << 3) + 4);
+        if (stp)
+          _cdb_stat_probe(stp, (tb->fs + i + tb->len - recs->home) % tb->len);
+        if (!tb->grp || recs->hval != tb->ghval) {
+          tb->grp = 1;
+          tb->ghval = recs->hval;
+          tb->gs = tb->len;
+        }
+        ++recs;
+        --n;
+      }
+    if (_cdb_make_seek(cdbmp, tb->tpos + (tb->fs << 3)) < 0 ||
+        _cdb_make_out(cdbmp, buf, i << 3) < 0 ||
+        _cdb_make_seek(cdbmp, cdbmp->cdb_dpos) < 0)
+      return -1;
+    tb->fs += i;
+  }
+  return 0;
+}
+
+/* write out table t of len slots, whose records are more than the max
+ * that fit in recs, the same as write_table() would: each pass over
+ * its part of the spill file gathers the next max records in order,
+ * which are then written out.  Records running past the end go into
+ * the free slots at the start, once the others are written. */
+static int
+write_bounded(struct cdb_make *cdbmp, unsigned t, unsigned len,
+              const unsigned long long *off, struct cdb_rec *rb,
+              struct spill_rec *recs, unsigned max, unsigned *keysp)
+{
+  struct cdb_stat *stp = cdbmp->cdb_statp;
+  struct tbound *tb;
+  struct tgather tg;
+  struct spill_rec last;
+  struct cdb_srun sr;
+  unsigned i, cnt, pos;
+  int ret = -1;
+
+  if (!(tb = (struct tbound *)malloc(sizeof(*tb))))
+    return errno = ENOMEM, -1;
+  memset(tb, 0, sizeof(*tb));
+  tb->tpos = cdbmp->cdb_dpos;
+  tb->len = len;
+  memset(&tg, 0, sizeof(tg));
+  tg.recs = recs;
+  tg.len = len;
+  tg.max = max;
+
+  do {
+    tg.n = 0;
+    if (table_each(cdbmp, t, off, rb, &tg) < 0)
+      goto out;
+    qsort(recs, tg.n, sizeof(*recs), cmp_rec);
+    if (count_keys(cdbmp, recs, tg.n, keysp, tb) < 0)
+      goto out;
+    for (i = 0; i < tg.n; ++i) {
+      pos = recs[i].home > tb->next ? recs[i].home : tb->next;
+      if (pos >= len)
+        break;
+      while (tb->s < pos)
+        if (tb_slot(cdbmp, tb, NULL) < 0)
+          goto out;
+      if (tb_slot(cdbmp, tb, recs + i) < 0)
+        goto out;
+      if (stp)
+        _cdb_stat_probe(stp, pos - recs[i].home);
+      tb->next = pos + 1;
+    }
+    if (i < tg.n && tb_wrap(cdbmp, tb, recs + i, tg.n - i) < 0)
+      goto out;
+    if (tg.n) {
+      last = recs[tg.n - 1];
+      tg.after = &last;
+    }
+  } while (tg.n == max);
+  while (tb->s < len)
+    if (tb_slot(cdbmp, tb, NULL) < 0)
+      goto out;
+
+  if (stp) {
+    /* with the wrapped records in, see which slots are used */
+    memset(&sr, 0, sizeof(sr));
+    for (pos = 0; pos < len; pos += cnt) {
+      cnt = len - pos < sizeof(tb->buf) >> 3 ? len - pos : sizeof(tb->buf) >> 3;
+      if (_cdb_make_read(cdbmp, tb->buf, cnt << 3, tb->tpos + (pos << 3)) < 0)
+        goto out;
+      for (i = 0; i < cnt; ++i)
+        _cdb_stat_slot(stp, &sr, cdb_unpack(tb->buf + (i << 3) + 4) != 0);
+    }
+    _cdb_stat_table(stp, &sr);
+  }
+  ret = 0;
+out:
+  free(tb);
+  return ret;
+}
+
+int internal_function
+_cdb_make_htabs_spilled(struct cdb_make *cdbmp,
+                        unsigned hcnt[256], unsigned hpos[256],
+                        unsigned *keysp)
+{
+  const unsigned per = sizeof(((struct cdb_rl *)0)->rec) /
+                       sizeof(struct cdb_rec);
+  struct cdb_stat *stp = cdbmp->cdb_statp;
+  unsigned long long *off;
+  struct spill_rec *recs;
+  struct cdb_rec *rb;
+  unsigned long long total, fixed, fit;
+  unsigned t, r, n, max, len;
+  struct tgather tg;
+  int ret = -1;
+
+  /* what is still in memory goes to the spill file as the last run */
+  if (cdbmp->cdb_rcnt > cdbmp->cdb_spilled && _cdb_make_spill(cdbmp) < 0)
+    return -1;
+
+  /* size the tables */
+  max = 0;
+  total = 0;
+  for (t = 0; t < 256; ++t) {
+    for (n = 0, r = 0; r < cdbmp->cdb_nruns; ++r)
+      n += cdbmp->cdb_runs[r].cnt[t];
+    if (_cdb_make_tsize(cdbmp, n, &hcnt[t]) < 0)
+      return -1;
+    total += hcnt[t];
+    if (max < n)
+      max = n;
+  }
+  if (total > (0xffffffffu - cdbmp->cdb_dpos) >> 3)
+    return errno = ENOMEM, -1;
+  /* no more records at once than fit in cdb_spillmem next to the runs
+   * and the buffers, but at least as many as while building */
+  fixed = cdbmp->cdb_nruns * (sizeof(struct cdb_run) + sizeof(*off)) +
+          sizeof(((struct cdb_rl *)0)->rec) + sizeof(struct tbound);
+  fit = cdbmp->cdb_spillmem > fixed + sizeof(*recs) ?
+        (cdbmp->cdb_spillmem - fixed) / sizeof(*recs) - 1 : 0;
+  if (fit < 256 * per)
+    fit = 256 * per;
+  if (max > fit)
+    max = (unsigned)fit;
+  if (cdbmp->cdb_spillpeak < fixed + (max + 1ull) * sizeof(*recs))
+    cdbmp->cdb_spillpeak = fixed + (max + 1ull) * sizeof(*recs);
+
+  off = (unsigned long long*)malloc((cdbmp->cdb_nruns + 1) * sizeof(*off));
+  recs = (struct spill_rec*)malloc((max + 1) * sizeof(*recs));
+  rb = (struct cdb_rec*)malloc(sizeof(((struct cdb_rl *)0)->rec));
+  if (!off || !recs || !rb) {
+    errno = ENOMEM;
+    goto out;
+  }
+  for (r = 0; r < cdbmp->cdb_nruns; ++r)
+    off[r] = cdbmp->cdb_runs[r].pos;
+
+  for (t = 0; t < 256; ++t) {
+    hpos[t] = cdbmp->cdb_dpos;
+    if ((len = hcnt[t]) == 0)
+      continue;
+    for (n = 0, r = 0; r < cdbmp->cdb_nruns; ++r)
+      n += cdbmp->cdb_runs[r].cnt[t];
+    if (n > max) {
+      if (write_bounded(cdbmp, t, len, off, rb, recs, max, keysp) < 0)
+        goto out;
+    }
+    else {
+      /* gather the table from every run */
+      memset(&tg, 0, sizeof(tg));
+      tg.recs = recs;
+      tg.len = len;
+      if (table_each(cdbmp, t, off, rb, &tg) < 0 ||
+          write_table(cdbmp, recs, tg.n, len, keysp) < 0)
+        goto out;
+    }
+    for (r = 0; r < cdbmp->cdb_nruns; ++r)
+      off[r] += (unsigned long long)cdbmp->cdb_runs[r].cnt[t] * sizeof(*rb);
+    if (stp) {
+      stp->tslots[t] = len;
+      stp->tused[t] = n;
+      stp->slots += len;
+    }
+  }
+  ret = 0;
+
+out:
+  free(off);
+  free(recs);
+  free(rb);
+  return ret;
+}
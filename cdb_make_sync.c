@@ -0,0 +1,112 @@
+/* incremental writeback of a cdb being built
+ *
+ * This file is a part of lua-tinycdb.
+ *
+ * Left alone, the kernel lets a build dirty gigabytes of page cache and
+ * the fsync() after cdb_make_finish() then writes all of it at once.
+ * With cdb_make_writeback(), every cdb_wbchunk bytes written starts the
+ * writeback of that chunk with sync_file_range() and waits for the
+ * chunk before it, which had a whole chunk's worth of building to get
+ * to the disk.  At most two chunks are ever dirty, so the final fsync()
+ * is short.  Chunks on the disk can then be dropped from the page cache
+ * so the build does not evict the pages of readers, and the builder is
+ * put to sleep whenever it runs ahead of the bandwidth cap.
+ */
+
+#ifndef _GNU_SOURCE
+# define _GNU_SOURCE /* sync_file_range() */
+#endif
+#include <sys/types.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <time.h>
+#include "cdb_int.h"
+
+static unsigned long long
+wb_now(void)
+{
+  struct timespec ts;
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return (unsigned long long)ts.tv_sec * 1000000000u + ts.tv_nsec;
+}
+
+int
+cdb_make_writeback(struct cdb_make *cdbmp, unsigned chunk, unsigned flags,
+                   unsigned maxrate)
+{
+  if (cdbmp->cdb_rcnt || !chunk || cdbmp->cdb_mbuf)
+    return errno = EINVAL, -1;
+  cdbmp->cdb_wbchunk = chunk;
+  cdbmp->cdb_wbflags = flags;
+  cdbmp->cdb_wbrate = maxrate;
+  cdbmp->cdb_wbpos = cdbmp->cdb_wbprev = 0;
+  cdbmp->cdb_wbt0 = wb_now();
+  return 0;
+}
+
+/* start writing [pos, pos + len) back, without waiting */
+static void
+wb_start(int fd, unsigned pos, unsigned len)
+{
+#ifdef SYNC_FILE_RANGE_WRITE
+  /* only a hint: if it fails, wb_wait() reports why */
+  sync_file_range(fd, (off_t)pos, (off_t)len, SYNC_FILE_RANGE_WRITE);
+#else
+  (void)fd; (void)pos; (void)len;
+#endif
+}
+
+/* wait until [pos, pos + len) is on the disk */
+static int
+wb_wait(int fd, unsigned pos, unsigned len)
+{
+#ifdef SYNC_FILE_RANGE_WRITE
+  return sync_file_range(fd, (off_t)pos, (off_t)len,
+                         SYNC_FILE_RANGE_WAIT_BEFORE | SYNC_FILE_RANGE_WRITE |
+                         SYNC_FILE_RANGE_WAIT_AFTER);
+#else
+  (void)pos; (void)len;
+  return fsync(fd);
+#endif
+}
+
+int internal_function
+_cdb_make_wb(struct cdb_make *cdbmp)
+{
+  /* what was written to the file so far; the rest is in cdb_buf */
+  unsigned end = cdbmp->cdb_dpos - (unsigned)(cdbmp->cdb_bpos - cdbmp->cdb_buf);
+  unsigned long long due, now;
+  struct timespec ts;
+
+  if (end - cdbmp->cdb_wbpos < cdbmp->cdb_wbchunk)
+    return 0;
+  if (cdbmp->cdb_wbpos > cdbmp->cdb_wbprev) {
+    if (wb_wait(cdbmp->cdb_fd, cdbmp->cdb_wbprev,
+                cdbmp->cdb_wbpos - cdbmp->cdb_wbprev) < 0)
+      return -1;
+#ifdef POSIX_FADV_DONTNEED
+    /* clean pages only: those of the chunk just waited for */
+    if (cdbmp->cdb_wbflags & CDB_WB_DONTNEED)
+      posix_fadvise(cdbmp->cdb_fd, (off_t)cdbmp->cdb_wbprev,
+                    (off_t)(cdbmp->cdb_wbpos - cdbmp->cdb_wbprev),
+                    POSIX_FADV_DONTNEED);
+#endif
+  }
+  wb_start(cdbmp->cdb_fd, cdbmp->cdb_wbpos, end - cdbmp->cdb_wbpos);
+  cdbmp->cdb_wbprev = cdbmp->cdb_wbpos;
+  cdbmp->cdb_wbpos = end;
+
+  if (cdbmp->cdb_wbrate) {
+    /* when end bytes are due at maxrate */
+    due = cdbmp->cdb_wbt0 +
+          (unsigned long long)end * 1000000000u / cdbmp->cdb_wbrate;
+    now = wb_now();
+    if (due > now) {
+      ts.tv_sec = (time_t)((due - now) / 1000000000u);
+      ts.tv_nsec = (long)((due - now) % 1000000000u);
+      while (nanosleep(&ts, &ts) < 0 && errno == EINTR)
+        ;
+    }
+  }
+  return 0;
+}
@@ -0,0 +1,84 @@
+/* the metadata block: what cdb_make_finish() knows about a database
+ *
+ * This file is a part of lua-tinycdb.
+ *
+ * The hash tables only say how many slots there are, so counting the
+ * records of a database, let alone its keys, takes a pass over the
+ * index or the data.  cdb_make_finish() has all of it at hand, and
+ * writes it into a CDB_EXT_META section last in the extension area.
+ * Record counts and sizes are kept up to date while building; keys
+ * are counted once the tables are laid out, as the records of one key
+ * all share a hash value and so sit in the same probe sequence: a
+ * record starts a key unless an earlier slot of its sequence holds a
+ * record with the same hash value and key.
+ */
+
+#include <sys/types.h>
+#include "cdb_int.h"
+
+int
+cdb_info(const struct cdb *cdbp, struct cdb_info *ip)
+{
+  const unsigned char *p;
+
+  memset(ip, 0, sizeof(*ip));
+  if (!cdbp->cdb_metapos)
+    return 0;
+  if (!(p = (const unsigned char *)cdb_get(cdbp, 32, cdbp->cdb_metapos)))
+    return -1;
+  ip->records = cdb_unpack(p);
+  ip->keys = cdb_unpack(p + 4);
+  ip->keybytes = cdb_unpack64(p + 8);
+  ip->valbytes = cdb_unpack64(p + 16);
+  ip->mflags = cdb_unpack(p + 24);
+  ip->hslots = cdb_unpack(p + 28);
+  return 1;
+}
+
+/* whether the records at a and b of the file being built have the
+ * same key: 1, 0 or -1 */
+int internal_function
+_cdb_make_samekey(struct cdb_make *cdbmp, unsigned a, unsigned b)
+{
+  unsigned char ka[4096], kb[4096];
+  unsigned klen, n;
+
+  if (_cdb_make_read(cdbmp, ka, 8, a) < 0 ||
+      _cdb_make_read(cdbmp, kb, 8, b) < 0)
+    return -1;
+  if ((klen = cdb_unpack(ka)) != cdb_unpack(kb))
+    return 0;
+  for (a += 8, b += 8; klen; klen -= n, a += n, b += n) {
+    n = klen < sizeof(ka) ? klen : sizeof(ka);
+    if (_cdb_make_read(cdbmp, ka, n, a) < 0 ||
+        _cdb_make_read(cdbmp, kb, n, b) < 0)
+      return -1;
+    if (memcmp(ka, kb, n) != 0)
+      return 0;
+  }
+  return 1;
+}
+
+int internal_function
+_cdb_make_meta(struct cdb_make *cdbmp, unsigned keys)
+{
+  unsigned char buf[44];
+  unsigned n = 0;
+
+  /* an mph index or shared values already started the extension area */
+  if (!(cdbmp->cdb_mflags & (CDB_MAKE_MPH | CDB_MAKE_DEDUP))) {
+    memcpy(buf, CDB_EXT_MAGIC, 4);
+    n = 4;
+  }
+  cdb_pack(CDB_EXT_META, buf + n);
+  cdb_pack(32, buf + n + 4);
+  cdb_pack(cdbmp->cdb_rcnt, buf + n + 8);
+  cdb_pack(keys, buf + n + 12);
+  cdb_pack64(cdbmp->cdb_kbytes, buf + n + 16);
+  cdb_pack64(cdbmp->cdb_vbytes, buf + n + 24);
+  cdb_pack(cdbmp->cdb_mflags, buf + n + 32);
+  cdb_pack(cdbmp->cdb_hslots ? cdbmp->cdb_hslots : 512, buf + n + 36);
+  if (0xffffffff - cdbmp->cdb_dpos < n + 40)
+    return errno = ENOMEM, -1;
+  return _cdb_make_write(cdbmp, buf, n + 40);
+}
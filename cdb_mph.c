@@ -0,0 +1,82 @@
+/* minimal perfect hash index lookup
+ *
+ * This file is a part of lua-tinycdb.
+ *
+ * A database built with CDB_MAKE_MPH has empty hash tables; its
+ * extension area instead holds a hash-and-displace index mapping every
+ * key to exactly one slot.  A slot is the 4-byte position of a record,
+ * so a lookup is one slot read plus one key comparison.
+ */
+
+#include "cdb_int.h"
+
+/* 64-bit FNV-1a with a seed, finalized with the splitmix64 mixer and
+ * returned as the bucket (h[0]) and slot (h[1]) halves */
+void internal_function
+_cdb_mph_hash(const void *key, unsigned klen, unsigned seed, unsigned h[2])
+{
+  register const unsigned char *p = (const unsigned char *)key;
+  register const unsigned char *end = p + klen;
+  register unsigned long long x = 14695981039346656037ULL ^ seed;
+  while (p < end)
+    x = (x ^ *p++) * 1099511628211ULL;
+  x ^= x >> 30; x *= 0xbf58476d1ce4e5b9ULL;
+  x ^= x >> 27; x *= 0x94d049bb133111ebULL;
+  x ^= x >> 31;
+  h[0] = (unsigned)(x >> 32);
+  h[1] = (unsigned)x;
+}
+
+/* slot for a key in a bucket with displacement d; the high bit of d
+ * marks a bucket of one key that was assigned its slot directly */
+unsigned internal_function
+_cdb_mph_pos(unsigned h, unsigned d, unsigned nslots)
+{
+  if (d & 0x80000000)
+    return (d & 0x7fffffff) % nslots;
+  d = (d + 1) * 0x9e3779b1;
+  d ^= d >> 15;
+  return (h ^ d) % nslots;
+}
+
+/* pointer to the only slot that can hold key, or NULL if index is empty */
+internal_function const unsigned char *
+_cdb_mph_slot(const struct cdb *cdbp, const void *key, unsigned klen)
+{
+  const unsigned char *idx = cdbp->cdb_mem + cdbp->cdb_mphpos;
+  unsigned nslots = cdb_unpack(idx + 4);
+  unsigned nbuckets = cdb_unpack(idx + 8);
+  unsigned h[2], d;
+
+  if (!nslots)
+    return NULL;
+  _cdb_mph_hash(key, klen, cdb_unpack(idx), h);
+  d = cdb_unpack(idx + 12 + ((h[0] % nbuckets) << 2));
+  return idx + 12 + (nbuckets << 2) + (_cdb_mph_pos(h[1], d, nslots) << 2);
+}
+
+/* check that the record at pos holds key and make it the found one */
+int internal_function
+_cdb_match(const struct cdb *cdbp, unsigned pos, const void *key,
+           unsigned klen, struct cdb_result *resp)
+{
+  unsigned n;
+
+  if (!pos)
+    return 0;
+  if (pos < 2048 || pos > cdbp->cdb_dend - 8) /* key+val lengths */
+    return errno = EPROTO, -1;
+  if (cdb_unpack(cdbp->cdb_mem + pos) != klen)
+    return 0;
+  if (cdbp->cdb_dend - klen < pos + 8)
+    return errno = EPROTO, -1;
+  if (memcmp(key, cdbp->cdb_mem + pos + 8, klen) != 0)
+    return 0;
+  n = cdb_unpack(cdbp->cdb_mem + pos + 4);
+  pos += 8;
+  if (_cdb_value(cdbp, pos + klen, n, resp) < 0)
+    return -1;
+  resp->cdb_kpos = pos;
+  resp->cdb_klen = klen;
+  return 1;
+}
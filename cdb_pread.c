@@ -0,0 +1,396 @@
+/* pread access mode with a block cache
+ *
+ * This file is a part of lua-tinycdb.
+ *
+ * A database opened with cdb_init_pread() is not mapped.  The TOC is
+ * read once and kept; everything else is read with pread() in blocks of
+ * CDB_BC_BLOCK bytes into a fixed number of cache slots, replaced with
+ * the CLOCK policy.  Memory use is thus fixed at open time, and a lookup
+ * whose blocks are cached makes no system call at all.
+ *
+ * cdb_find(), cdb_findnext(), cdb_seqnext(), cdb_get() and cdb_read()
+ * come here when cdb_mem is NULL.  Pointers returned by _cdb_bc_get()
+ * are only valid until the next read through the same cache.
+ */
+
+#include <sys/types.h>
+#include <stdlib.h>
+#include <unistd.h>
+#include "cdb_int.h"
+
+#define CDB_BC_BLOCK	4096
+/* reads spanning blocks up to this long go to a buffer kept with the
+ * cache; longer ones get their own, freed by the next read, so that
+ * one large value does not stay allocated for as long as the cache */
+#define BC_SCRATCH	(4 * CDB_BC_BLOCK)
+
+struct cdb_bcache {
+  int fd;
+  unsigned fsize;
+  unsigned char toc[2048];	/* pinned */
+  unsigned nblocks;		/* cache slots */
+  unsigned char *mem;		/* nblocks * CDB_BC_BLOCK bytes */
+  unsigned *blk;		/* file block + 1 in each slot, 0 if free */
+  unsigned char *ref;		/* slot used since the hand last passed */
+  unsigned hand;		/* CLOCK hand */
+  unsigned *map;		/* block -> slot + 1, linear probing */
+  unsigned mapbits;
+  unsigned char *scratch;	/* reads spanning blocks, BC_SCRATCH bytes */
+  unsigned char *big;		/* a longer one, until the next read */
+  unsigned long long hits, misses;
+};
+
+static int
+bc_pread(int fd, unsigned char *buf, unsigned len, unsigned pos)
+{
+  int l;
+  while(len) {
+    l = pread(fd, buf, len, (off_t)pos);
+    if (l < 0 && errno == EINTR)
+      continue;
+    if (l <= 0) {
+      if (!l)
+        errno = EIO;
+      return -1;
+    }
+    buf += l; len -= l; pos += l;
+  }
+  return 0;
+}
+
+internal_function struct cdb_bcache *
+_cdb_bc_new(int fd, unsigned fsize, unsigned cachesize)
+{
+  struct cdb_bcache *bc;
+  unsigned n = cachesize / CDB_BC_BLOCK;
+
+  if (n < 4)
+    n = 4;
+  bc = (struct cdb_bcache*)calloc(1, sizeof(*bc));
+  if (!bc)
+    return errno = ENOMEM, NULL;
+  bc->fd = fd;
+  bc->fsize = fsize;
+  bc->nblocks = n;
+  for (bc->mapbits = 1; (1u << bc->mapbits) < 2 * n; ++bc->mapbits)
+    ;
+  bc->mem = (unsigned char*)malloc((size_t)n * CDB_BC_BLOCK);
+  bc->blk = (unsigned*)calloc(n, sizeof(unsigned));
+  bc->ref = (unsigned char*)calloc(n, 1);
+  bc->map = (unsigned*)calloc(1u << bc->mapbits, sizeof(unsigned));
+  bc->scratch = (unsigned char*)malloc(BC_SCRATCH);
+  if (!bc->mem || !bc->blk || !bc->ref || !bc->map || !bc->scratch) {
+    _cdb_bc_free(bc);
+    return errno = ENOMEM, NULL;
+  }
+  if (bc_pread(fd, bc->toc, 2048, 0) < 0) {
+    _cdb_bc_free(bc);
+    return NULL;
+  }
+  return bc;
+}
+
+void internal_function
+_cdb_bc_free(struct cdb_bcache *bc)
+{
+  free(bc->mem);
+  free(bc->blk);
+  free(bc->ref);
+  free(bc->map);
+  free(bc->scratch);
+  free(bc->big);
+  free(bc);
+}
+
+int
+cdb_bcache_stat(const struct cdb *cdbp,
+                unsigned long long *hits, unsigned long long *misses)
+{
+  if (!cdbp->cdb_bc)
+    return errno = EINVAL, -1;
+  *hits = cdbp->cdb_bc->hits;
+  *misses = cdbp->cdb_bc->misses;
+  return 0;
+}
+
+#define bc_home(bc, b) (((b) * 0x9e3779b1u) >> (32 - (bc)->mapbits))
+
+/* drop block b, held in a slot, from the map */
+static void
+bc_unmap(struct cdb_bcache *bc, unsigned b)
+{
+  unsigned mask = (1u << bc->mapbits) - 1;
+  unsigned i = bc_home(bc, b), j, k;
+  while (bc->blk[bc->map[i] - 1] != b + 1)
+    i = (i + 1) & mask;
+  /* shift back the entries displaced past the hole */
+  for (j = i;;) {
+    j = (j + 1) & mask;
+    if (!bc->map[j])
+      break;
+    k = bc_home(bc, bc->blk[bc->map[j] - 1] - 1);
+    if (i <= j ? (i < k && k <= j) : (i < k || k <= j))
+      continue;
+    bc->map[i] = bc->map[j];
+    i = j;
+  }
+  bc->map[i] = 0;
+}
+
+/* the cached contents of file block b */
+static const unsigned char *
+bc_block(struct cdb_bcache *bc, unsigned b)
+{
+  unsigned mask = (1u << bc->mapbits) - 1;
+  unsigned i, s, len;
+
+  for (i = bc_home(bc, b); bc->map[i]; i = (i + 1) & mask)
+    if (bc->blk[bc->map[i] - 1] == b + 1) {
+      s = bc->map[i] - 1;
+      bc->ref[s] = 1;
+      ++bc->hits;
+      return bc->mem + (size_t)s * CDB_BC_BLOCK;
+    }
+  ++bc->misses;
+
+  /* pick a victim: free, or not used since the hand last passed */
+  for (;;) {
+    s = bc->hand;
+    if (++bc->hand == bc->nblocks)
+      bc->hand = 0;
+    if (!bc->blk[s])
+      break;
+    if (!bc->ref[s]) {
+      bc_unmap(bc, bc->blk[s] - 1);
+      bc->blk[s] = 0;
+      break;
+    }
+    bc->ref[s] = 0;
+  }
+
+  len = bc->fsize - b * CDB_BC_BLOCK;
+  if (len > CDB_BC_BLOCK)
+    len = CDB_BC_BLOCK;
+  if (bc_pread(bc->fd, bc->mem + (size_t)s * CDB_BC_BLOCK, len,
+               b * CDB_BC_BLOCK) < 0)
+    return NULL;
+  bc->blk[s] = b + 1;
+  bc->ref[s] = 0;
+  /* the slot freed above, if any, left the probe chain intact */
+  for (i = bc_home(bc, b); bc->map[i]; i = (i + 1) & mask)
+    ;
+  bc->map[i] = s + 1;
+  return bc->mem + (size_t)s * CDB_BC_BLOCK;
+}
+
+/* len bytes at pos if they are in one block that is cached, else NULL;
+ * never reads */
+internal_function const unsigned char *
+_cdb_bc_peek(const struct cdb *cdbp, unsigned len, unsigned pos)
+{
+  struct cdb_bcache *bc = cdbp->cdb_bc;
+  unsigned mask = (1u << bc->mapbits) - 1;
+  unsigned b = pos / CDB_BC_BLOCK, i;
+
+  if (pos + len <= 2048)
+    return bc->toc + pos;
+  if (pos % CDB_BC_BLOCK + len > CDB_BC_BLOCK)
+    return NULL;
+  for (i = bc_home(bc, b); bc->map[i]; i = (i + 1) & mask)
+    if (bc->blk[bc->map[i] - 1] == b + 1)
+      return bc->mem + (size_t)(bc->map[i] - 1) * CDB_BC_BLOCK +
+             pos % CDB_BC_BLOCK;
+  return NULL;
+}
+
+int internal_function
+_cdb_bc_read(const struct cdb *cdbp, unsigned char *buf,
+             unsigned len, unsigned pos)
+{
+  struct cdb_bcache *bc = cdbp->cdb_bc;
+  const unsigned char *p;
+  unsigned l;
+
+  if (bc->big) {
+    free(bc->big);
+    bc->big = NULL;
+  }
+  /* large values would only push everything else out of the cache */
+  if (len >= 4 * CDB_BC_BLOCK)
+    return bc_pread(bc->fd, buf, len, pos);
+  while (len) {
+    l = CDB_BC_BLOCK - pos % CDB_BC_BLOCK;
+    if (l > len)
+      l = len;
+    if (!(p = bc_block(bc, pos / CDB_BC_BLOCK)))
+      return -1;
+    memcpy(buf, p + pos % CDB_BC_BLOCK, l);
+    buf += l; len -= l; pos += l;
+  }
+  return 0;
+}
+
+/* len bytes at pos, which the caller has checked are inside the file */
+internal_function const unsigned char *
+_cdb_bc_get(const struct cdb *cdbp, unsigned len, unsigned pos)
+{
+  struct cdb_bcache *bc = cdbp->cdb_bc;
+  const unsigned char *p;
+  unsigned char *buf;
+
+  if (bc->big) {
+    free(bc->big);
+    bc->big = NULL;
+  }
+  if (pos + len <= 2048)
+    return bc->toc + pos;
+  if (pos % CDB_BC_BLOCK + len <= CDB_BC_BLOCK) {
+    p = bc_block(bc, pos / CDB_BC_BLOCK);
+    return p ? p + pos % CDB_BC_BLOCK : NULL;
+  }
+  if (len <= BC_SCRATCH)
+    buf = bc->scratch;
+  else if (!(buf = bc->big = (unsigned char*)malloc(len)))
+    return errno = ENOMEM, NULL;
+  if (_cdb_bc_read(cdbp, buf, len, pos) < 0)
+    return NULL;
+  return buf;
+}
+
+/* _cdb_match() for the pread mode: key is compared block by block */
+static int
+bc_match(const struct cdb *cdbp, unsigned pos, const void *key, unsigned klen,
+         struct cdb_result *resp)
+{
+  const unsigned char *p;
+  const unsigned char *k = (const unsigned char *)key;
+  unsigned n, l, kpos, vlen;
+
+  if (!pos)
+    return 0;
+  if (pos < 2048 || pos > cdbp->cdb_dend - 8)
+    return errno = EPROTO, -1;
+  if (!(p = _cdb_bc_get(cdbp, 8, pos)))
+    return -1;
+  if (cdb_unpack(p) != klen)
+    return 0;
+  vlen = cdb_unpack(p + 4);
+  pos += 8;
+  if (cdbp->cdb_dend - klen < pos)
+    return errno = EPROTO, -1;
+  for (kpos = pos, l = 0; l < klen; kpos += n) {
+    n = CDB_BC_BLOCK - kpos % CDB_BC_BLOCK;
+    if (n > klen - l)
+      n = klen - l;
+    if (!(p = _cdb_bc_get(cdbp, n, kpos)))
+      return -1;
+    if (memcmp(k + l, p, n) != 0)
+      return 0;
+    l += n;
+  }
+  if (_cdb_value(cdbp, pos + klen, vlen, resp) < 0)
+    return -1;
+  resp->cdb_kpos = pos;
+  resp->cdb_klen = klen;
+  return 1;
+}
+
+int internal_function
+_cdb_bc_findinit(struct cdb_find *cdbfp, const struct cdb *cdbp,
+                 const void *key, unsigned klen, unsigned hval)
+{
+  const unsigned char *p;
+  unsigned n, pos;
+
+  cdbfp->cdb_cdbp = cdbp;
+  cdbfp->cdb_key = key;
+  cdbfp->cdb_klen = klen;
+  cdbfp->cdb_hval = hval;
+  cdbfp->cdb_htp = cdbfp->cdb_htab = cdbfp->cdb_htend = NULL;
+  cdbfp->cdb_httodo = 0;
+
+  if (cdbp->cdb_flags & CDB_F_MPH) {
+    unsigned h[2], nslots, nbuckets, seed;
+    if (!(p = _cdb_bc_get(cdbp, 12, cdbp->cdb_mphpos)))
+      return -1;
+    seed = cdb_unpack(p);
+    nslots = cdb_unpack(p + 4);
+    nbuckets = cdb_unpack(p + 8);
+    if (!nslots)
+      return 0;
+    _cdb_mph_hash(key, klen, seed, h);
+    pos = cdbp->cdb_mphpos + 12 + ((h[0] % nbuckets) << 2);
+    if (!(p = _cdb_bc_get(cdbp, 4, pos)))
+      return -1;
+    cdbfp->cdb_hpos = cdbp->cdb_mphpos + 12 + (nbuckets << 2) +
+                      (_cdb_mph_pos(h[1], cdb_unpack(p), nslots) << 2);
+    cdbfp->cdb_httodo = 8;
+    return 1;
+  }
+
+  p = cdbp->cdb_bc->toc + ((hval << 3) & 2047);
+  n = cdb_unpack(p + 4);
+  if (!n)
+    return 0;
+  pos = cdb_unpack(p);
+  if (n > (cdbp->cdb_fsize >> 3)
+      || pos < cdbp->cdb_dend
+      || pos > cdbp->cdb_fsize
+      || (n << 3) > cdbp->cdb_fsize - pos)
+    return errno = EPROTO, -1;
+  cdbfp->cdb_httodo = n << 3;
+  cdbfp->cdb_hstart = pos;
+  cdbfp->cdb_hend = pos + (n << 3);
+  cdbfp->cdb_hpos = pos + (((hval >> 8) % n) << 3);
+  return 1;
+}
+
+int internal_function
+_cdb_bc_findnext(struct cdb_find *cdbfp, struct cdb_result *resp)
+{
+  const struct cdb *cdbp = cdbfp->cdb_cdbp;
+  const unsigned char *p, *q;
+  unsigned pos, n;
+  int r;
+
+  if (cdbp->cdb_flags & CDB_F_MPH) {
+    if (!cdbfp->cdb_httodo)
+      return 0;
+    cdbfp->cdb_httodo = 0;
+    if (!(p = _cdb_bc_get(cdbp, 4, cdbfp->cdb_hpos)))
+      return -1;
+    return bc_match(cdbp, cdb_unpack(p), cdbfp->cdb_key, cdbfp->cdb_klen,
+                    resp);
+  }
+
+  while(cdbfp->cdb_httodo) {
+    /* the slots up to the end of this block, or one spanning two */
+    n = (CDB_BC_BLOCK - cdbfp->cdb_hpos % CDB_BC_BLOCK) >> 3;
+    if (!n)
+      n = 1;
+    if (n > (cdbfp->cdb_hend - cdbfp->cdb_hpos) >> 3)
+      n = (cdbfp->cdb_hend - cdbfp->cdb_hpos) >> 3;
+    if (n > cdbfp->cdb_httodo >> 3)
+      n = cdbfp->cdb_httodo >> 3;
+    if (!(p = _cdb_bc_get(cdbp, n << 3, cdbfp->cdb_hpos)))
+      return -1;
+    if (!(q = _cdb_htscan(p, n, cdbfp->cdb_hval))) {
+      cdbfp->cdb_httodo -= n << 3;
+      if ((cdbfp->cdb_hpos += n << 3) >= cdbfp->cdb_hend)
+        cdbfp->cdb_hpos = cdbfp->cdb_hstart;
+      continue;
+    }
+    cdbfp->cdb_httodo -= q - p;
+    cdbfp->cdb_hpos += q - p;
+    pos = cdb_unpack(q + 4);
+    if (!pos)
+      return 0;
+    if ((cdbfp->cdb_hpos += 8) >= cdbfp->cdb_hend)
+      cdbfp->cdb_hpos = cdbfp->cdb_hstart;
+    cdbfp->cdb_httodo -= 8;
+    if ((r = bc_match(cdbp, pos, cdbfp->cdb_key, cdbfp->cdb_klen,
+                      resp)) != 0)
+      return r;
+  }
+  return 0;
+}
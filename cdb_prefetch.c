@@ -0,0 +1,251 @@
+/* cdb_prefetch and cdb_find_nowait routines
+ *
+ * This file is a part of lua-tinycdb.
+ *
+ * Both follow the path of a lookup as far as they can without waiting
+ * for the disk: pages are only read once mincore() (or, in pread mode,
+ * the block cache) says they are in memory.  cdb_prefetch() hands the
+ * first page that is not to madvise(MADV_WILLNEED) or
+ * posix_fadvise(WILLNEED) instead; it never compares keys, so every
+ * record whose hash value matches is prefetched.  cdb_find_nowait()
+ * is cdb_find() failing with EAGAIN rather than taking a major fault.
+ */
+
+#include <sys/types.h>
+#include <fcntl.h>
+#include <unistd.h>
+#ifndef _WIN32
+# include <sys/mman.h>
+#endif
+#include "cdb_int.h"
+
+struct pf {
+  const struct cdb *cdbp;
+  unsigned psize;		/* page size */
+  unsigned okpage;		/* last page found resident, + 1 */
+  int nowait;			/* cdb_find_nowait(), not prefetching */
+  struct cdb_result *resp;	/* where cdb_find_nowait() puts the record */
+};
+
+/* start reading [pos, pos + len) in the background */
+static void
+pf_advise(struct pf *pf, unsigned pos, unsigned len)
+{
+  const struct cdb *cdbp = pf->cdbp;
+  if (len > cdbp->cdb_fsize - pos)
+    len = cdbp->cdb_fsize - pos;
+  if (cdbp->cdb_bc) {
+#ifdef POSIX_FADV_WILLNEED
+    posix_fadvise(cdbp->cdb_fd, (off_t)pos, (off_t)len, POSIX_FADV_WILLNEED);
+#endif
+  }
+  else {
+#ifdef MADV_WILLNEED
+    unsigned start = pos - pos % pf->psize;
+    madvise((void *)(cdbp->cdb_mem + start), pos + len - start, MADV_WILLNEED);
+#endif
+  }
+}
+
+/* the len bytes at pos if they can be read without blocking, else NULL */
+static const unsigned char *
+pf_peek(struct pf *pf, unsigned len, unsigned pos)
+{
+  const struct cdb *cdbp = pf->cdbp;
+  unsigned page, last, i, n;
+  unsigned char vec[64];
+
+  if (cdbp->cdb_bc)
+    return _cdb_bc_peek(cdbp, len, pos);
+  if (cdbp->cdb_flags & (CDB_F_MEM | CDB_F_LOADED))
+    return cdbp->cdb_mem + pos; /* not a mapping of the file */
+#ifdef MADV_WILLNEED
+  page = pos / pf->psize;
+  last = (pos + (len ? len - 1 : 0)) / pf->psize;
+  if (page + 1 == pf->okpage)
+    ++page;
+  for (; page <= last; page += n) {
+    n = last - page + 1 < sizeof(vec) ? last - page + 1 : sizeof(vec);
+    if (mincore((void *)(cdbp->cdb_mem + (size_t)page * pf->psize),
+                (size_t)n * pf->psize, (void *)vec) < 0)
+      return NULL;
+    for (i = 0; i < n; ++i)
+      if (!(vec[i] & 1))
+        return NULL;
+    pf->okpage = page + n;
+  }
+#endif
+  return cdbp->cdb_mem + pos;
+}
+
+/* prefetch the record at rpos: all of it if its header is at hand */
+static void
+pf_record(struct pf *pf, unsigned rpos, unsigned klen)
+{
+  const struct cdb *cdbp = pf->cdbp;
+  const unsigned char *p;
+  unsigned len = 8 + klen;
+
+  if (rpos < 2048 || rpos > cdbp->cdb_dend - 8)
+    return;
+  if ((p = pf_peek(pf, 8, rpos)) != NULL) {
+    len = cdb_unpack(p + 4);
+    if (len == CDB_VREF && (cdbp->cdb_flags & CDB_F_DEDUP))
+      len = 8; /* the shared value is prefetched once it can be found */
+    len = len > cdbp->cdb_dend - rpos - 8 - klen ?
+          cdbp->cdb_dend - rpos : 8 + klen + len;
+  }
+  pf_advise(pf, rpos, len);
+}
+
+/* check the record at rpos for cdb_find_nowait(): only once all of it
+ * is resident is it handed to _cdb_match() */
+static int
+pf_match(struct pf *pf, unsigned rpos, const void *key, unsigned klen)
+{
+  const struct cdb *cdbp = pf->cdbp;
+  const unsigned char *p;
+  unsigned vlen, vpos;
+
+  if (rpos < 2048 || rpos > cdbp->cdb_dend - 8)
+    return errno = EPROTO, -1;
+  if (!(p = pf_peek(pf, 8, rpos)))
+    return errno = EAGAIN, -1;
+  if (cdb_unpack(p) != klen)
+    return 0;
+  vlen = cdb_unpack(p + 4);
+  if (vlen == CDB_VREF && (cdbp->cdb_flags & CDB_F_DEDUP)) {
+    /* the reference, then the value it points to */
+    if (cdbp->cdb_dend - klen < rpos + 16)
+      return errno = EPROTO, -1;
+    if (!(p = pf_peek(pf, klen + 8, rpos + 8)))
+      return errno = EAGAIN, -1;
+    vpos = cdb_unpack(p + klen);
+    vlen = cdb_unpack(p + klen + 4);
+    if (vpos < 2048 || cdbp->cdb_dend < vlen || cdbp->cdb_dend - vlen < vpos)
+      return errno = EPROTO, -1;
+    if (!pf_peek(pf, vlen, vpos))
+      return errno = EAGAIN, -1;
+    return _cdb_match(cdbp, rpos, key, klen, pf->resp);
+  }
+  if (cdbp->cdb_dend - klen < rpos + 8 ||
+      cdbp->cdb_dend - vlen < rpos + 8 + klen)
+    return errno = EPROTO, -1;
+  if (!pf_peek(pf, klen + vlen, rpos + 8))
+    return errno = EAGAIN, -1;
+  return _cdb_match(cdbp, rpos, key, klen, pf->resp);
+}
+
+/* a record found at rpos while walking the index for key */
+static int
+pf_found(struct pf *pf, unsigned rpos, const void *key, unsigned klen)
+{
+  if (pf->nowait)
+    return pf_match(pf, rpos, key, klen);
+  pf_record(pf, rpos, klen);
+  return 1;
+}
+
+/* a page needed is not resident */
+static int
+pf_cold(struct pf *pf, unsigned pos, unsigned len, int ret)
+{
+  if (pf->nowait)
+    return errno = EAGAIN, -1;
+  pf_advise(pf, pos, len);
+  return ret;
+}
+
+static int
+pf_walk(struct pf *pf, const void *key, unsigned klen)
+{
+  const struct cdb *cdbp = pf->cdbp;
+  const unsigned char *p;
+  unsigned hval, n, pos, i, todo, rpos;
+  int r, ret = 0;
+
+  if (klen >= cdbp->cdb_dend)
+    return 0;
+#ifdef _WIN32
+  pf->psize = 4096;
+#else
+  pf->psize = (unsigned)sysconf(_SC_PAGESIZE);
+#endif
+  pf->okpage = 0;
+
+  if (cdbp->cdb_flags & CDB_F_MPH) {
+    unsigned h[2], nslots, nbuckets;
+    pos = cdbp->cdb_mphpos;
+    if (!(p = pf_peek(pf, 12, pos)))
+      return pf_cold(pf, pos, 12, 0);
+    nslots = cdb_unpack(p + 4);
+    nbuckets = cdb_unpack(p + 8);
+    if (!nslots)
+      return 0;
+    _cdb_mph_hash(key, klen, cdb_unpack(p), h);
+    pos += 12 + ((h[0] % nbuckets) << 2);
+    if (!(p = pf_peek(pf, 4, pos)))
+      return pf_cold(pf, pos, 4, 0);
+    pos = cdbp->cdb_mphpos + 12 + (nbuckets << 2) +
+          (_cdb_mph_pos(h[1], cdb_unpack(p), nslots) << 2);
+    if (!(p = pf_peek(pf, 4, pos)))
+      return pf_cold(pf, pos, 4, 0);
+    if (!(rpos = cdb_unpack(p)))
+      return 0;
+    return pf_found(pf, rpos, key, klen);
+  }
+
+  hval = cdb_hash(key, klen);
+  if (!(p = pf_peek(pf, 8, (hval << 3) & 2047)))
+    return pf_cold(pf, (hval << 3) & 2047, 8, 0);
+  n = cdb_unpack(p + 4);
+  pos = cdb_unpack(p);
+  if (!n)
+    return 0;
+  if (n > (cdbp->cdb_fsize >> 3)
+      || pos < cdbp->cdb_dend
+      || pos > cdbp->cdb_fsize
+      || (n << 3) > cdbp->cdb_fsize - pos)
+    return errno = EPROTO, -1;
+
+  /* walk the probe sequence while its slots are resident */
+  for (i = (hval >> 8) % n, todo = n; todo; --todo) {
+    if (!(p = pf_peek(pf, 8, pos + (i << 3))))
+      return pf_cold(pf, pos + (i << 3), 8, ret);
+    if (!(rpos = cdb_unpack(p + 4)))
+      break;
+    if (cdb_unpack(p) == hval) {
+      if ((r = pf_found(pf, rpos, key, klen)) != 0 && pf->nowait)
+        return r;
+      ret = 1;
+    }
+    if (++i == n)
+      i = 0;
+  }
+  return pf->nowait ? 0 : ret;
+}
+
+int
+cdb_prefetch(const struct cdb *cdbp, const void *key, unsigned klen)
+{
+  struct pf pf;
+  pf.cdbp = cdbp;
+  pf.nowait = 0;
+  return pf_walk(&pf, key, klen);
+}
+
+int
+cdb_find_nowait(struct cdb *cdbp, const void *key, unsigned klen)
+{
+  struct pf pf;
+  struct cdb_result res;
+  int r;
+  if (cdbp->cdb_bc) /* the block cache is not resident memory */
+    return errno = EINVAL, -1;
+  pf.cdbp = cdbp;
+  pf.nowait = 1;
+  pf.resp = &res;
+  if ((r = pf_walk(&pf, key, klen)) > 0)
+    _cdb_setfound(cdbp, &res);
+  return r;
+}
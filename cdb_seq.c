@@ -9,21 +9,39 @@
 
 int
 cdb_seqnext(unsigned *cptr, struct cdb *cdbp) {
+  struct cdb_result res;
+  int r = cdb_seqnext_r(cptr, cdbp, &res);
+  if (r > 0)
+    _cdb_setfound(cdbp, &res);
+  return r;
+}
+
+int
+cdb_seqnext_r(unsigned *cptr, const struct cdb *cdbp,
+              struct cdb_result *resp) {
   unsigned klen, vlen;
   unsigned pos = *cptr;
   unsigned dend = cdbp->cdb_dend;
-  const unsigned char *mem = cdbp->cdb_mem;
+  const unsigned char *p;
   if (pos > dend - 8)
     return 0;
-  klen = cdb_unpack(mem + pos);
-  vlen = cdb_unpack(mem + pos + 4);
+  if (cdbp->cdb_bc) {
+    if (!(p = _cdb_bc_get(cdbp, 8, pos)))
+      return -1;
+  }
+  else
+    p = cdbp->cdb_mem + pos;
+  klen = cdb_unpack(p);
+  vlen = cdb_unpack(p + 4);
   pos += 8;
-  if (dend - klen < pos || dend - vlen < pos + klen)
+  if (dend - klen < pos)
     return errno = EPROTO, -1;
-  cdbp->cdb_kpos = pos;
-  cdbp->cdb_klen = klen;
-  cdbp->cdb_vpos = pos + klen;
-  cdbp->cdb_vlen = vlen;
+  if (_cdb_value(cdbp, pos + klen, vlen, resp) < 0)
+    return -1;
+  resp->cdb_kpos = pos;
+  resp->cdb_klen = klen;
+  if (vlen == CDB_VREF && (cdbp->cdb_flags & CDB_F_DEDUP))
+    vlen = 8; /* the reference */
   *cptr = pos + klen + vlen;
   return 1;
 }
@@ -0,0 +1,160 @@
+/* lookup trace writer
+ *
+ * This file is a part of lua-tinycdb.
+ *
+ * The thread doing lookups is the only producer of a trace and its
+ * writer thread the only consumer, so the ring buffer needs no lock:
+ * the producer publishes a record by advancing head after copying it
+ * in, and the writer frees space by advancing tail after writing it
+ * out.  Both are running byte counts; their difference is the fill.
+ */
+
+#include <sys/types.h>
+#include <stdlib.h>
+#include <unistd.h>
+#include <time.h>
+#include <pthread.h>
+#include "cdb_int.h"
+
+#ifdef __GNUC__
+# define tr_load(p) __atomic_load_n(p, __ATOMIC_ACQUIRE)
+# define tr_store(p, v) __atomic_store_n(p, v, __ATOMIC_RELEASE)
+#else /* the shared fields are volatile at least */
+# define tr_load(p) (*(p))
+# define tr_store(p, v) (*(p) = (v))
+#endif
+
+struct cdb_trace {
+  unsigned char *ring;
+  unsigned size;		/* ring size, a power of 2 */
+  volatile unsigned long long head;	/* bytes put, by the producer */
+  volatile unsigned long long tail;	/* bytes written out, by the writer */
+  unsigned long long records;	/* records put */
+  unsigned long long dropped;	/* records that did not fit */
+  int fd;
+  volatile int stop;		/* set by cdb_trace_stop() */
+  int err;			/* errno of a failed write */
+  pthread_t writer;
+};
+
+static void *
+tr_writer(void *arg)
+{
+  struct cdb_trace *trp = (struct cdb_trace *)arg;
+  unsigned long long head, tail = trp->tail;
+  struct timespec ts;
+  unsigned off, len;
+  int stop, l;
+
+  for (;;) {
+    stop = tr_load(&trp->stop);
+    head = tr_load(&trp->head);
+    if (head == tail) {
+      if (stop)
+        break;
+      ts.tv_sec = 0;
+      ts.tv_nsec = 1000000;
+      nanosleep(&ts, NULL);
+      continue;
+    }
+    off = (unsigned)(tail & (trp->size - 1));
+    len = head - tail > trp->size - off ? trp->size - off
+                                        : (unsigned)(head - tail);
+    if (!trp->err) {
+      l = write(trp->fd, trp->ring + off, len);
+      if (l < 0 && errno == EINTR)
+        continue;
+      if (l <= 0)
+        trp->err = l < 0 ? errno : EIO;
+      else
+        len = l;
+    }
+    /* after an error, records are consumed and lost */
+    tail += len;
+    tr_store(&trp->tail, tail);
+  }
+  return NULL;
+}
+
+struct cdb_trace *
+cdb_trace_start(int fd, unsigned ringsize)
+{
+  struct cdb_trace *trp;
+  unsigned char hdr[8];
+  unsigned size;
+
+  for (size = 4096; size < ringsize && size < 0x80000000u; size <<= 1)
+    ;
+  memcpy(hdr, CDB_TRACE_MAGIC, 4);
+  cdb_pack(CDB_TRACE_VERSION, hdr + 4);
+  if (_cdb_make_fullwrite(fd, hdr, 8) < 0)
+    return NULL;
+  trp = (struct cdb_trace *)calloc(1, sizeof(*trp));
+  if (!trp || !(trp->ring = (unsigned char *)malloc(size))) {
+    free(trp);
+    errno = ENOMEM;
+    return NULL;
+  }
+  trp->size = size;
+  trp->fd = fd;
+  if ((errno = pthread_create(&trp->writer, NULL, tr_writer, trp)) != 0) {
+    free(trp->ring);
+    free(trp);
+    return NULL;
+  }
+  return trp;
+}
+
+/* copy len bytes into the ring at byte count pos */
+static void
+tr_copy(struct cdb_trace *trp, unsigned long long pos,
+        const void *buf, unsigned len)
+{
+  unsigned off = (unsigned)(pos & (trp->size - 1));
+  unsigned n = len < trp->size - off ? len : trp->size - off;
+  memcpy(trp->ring + off, buf, n);
+  memcpy(trp->ring, (const unsigned char *)buf + n, len - n);
+}
+
+int
+cdb_trace_put(struct cdb_trace *trp, enum cdb_trace_op op,
+              unsigned hval, unsigned hits, unsigned nsec,
+              const void *key, unsigned klen)
+{
+  unsigned char hdr[CDB_TRACE_HDR];
+  unsigned long long head = trp->head;
+
+  ++trp->records;
+  if (klen > trp->size - CDB_TRACE_HDR ||
+      head - tr_load(&trp->tail) > trp->size - CDB_TRACE_HDR - klen) {
+    ++trp->dropped;
+    return errno = ENOBUFS, -1;
+  }
+  hdr[0] = (unsigned char)op;
+  hdr[1] = (unsigned char)(hits < 255 ? hits : 255);
+  cdb_pack(hval, hdr + 2);
+  cdb_pack(nsec, hdr + 6);
+  cdb_pack(klen, hdr + 10);
+  tr_copy(trp, head, hdr, CDB_TRACE_HDR);
+  tr_copy(trp, head + CDB_TRACE_HDR, key, klen);
+  tr_store(&trp->head, head + CDB_TRACE_HDR + klen);
+  return 0;
+}
+
+int
+cdb_trace_stop(struct cdb_trace *trp,
+               unsigned long long *written, unsigned long long *dropped)
+{
+  int err;
+
+  tr_store(&trp->stop, 1);
+  pthread_join(trp->writer, NULL);
+  err = trp->err;
+  if (written)
+    *written = trp->records - trp->dropped;
+  if (dropped)
+    *dropped = trp->dropped;
+  free(trp->ring);
+  free(trp);
+  return err ? (errno = err, -1) : 0;
+}
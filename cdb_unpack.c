@@ -1,5 +1,5 @@
 /* $Id: cdb_unpack.c,v 1.5 2003/11/03 16:42:41 mjt Exp $
- * unpack 32bit integer
+ * unpack 32bit and 64bit integers
  *
  * This file is a part of tinycdb package by Michael Tokarev, mjt@corpit.ru.
  * Public domain.
@@ -16,3 +16,9 @@ cdb_unpack(const unsigned char buf[4])
   n <<= 8; n |= buf[0];
   return n;
 }
+
+unsigned long long
+cdb_unpack64(const unsigned char buf[8])
+{
+  return (unsigned long long)cdb_unpack(buf + 4) << 32 | cdb_unpack(buf);
+}
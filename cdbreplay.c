@@ -0,0 +1,291 @@
+/* cdb-replay: run a lookup trace against cdb files
+ *
+ * This file is a part of lua-tinycdb.
+ *
+ * usage: cdb-replay [-p cache_mb] [-r repeat] trace file.cdb...
+ *   -p  read the files in pread mode with a block cache of cache_mb MB
+ *   -r  run the trace this many times (the first runs warm the cache)
+ *
+ * Every operation of the trace (written by db:trace()) is repeated with
+ * cdb_find(), cdb_findnext() or cdb_seqnext() and timed; values are
+ * read, as a Lua lookup would.  The report gives the latencies of the
+ * last run per operation, next to those recorded in the trace, and how
+ * many lookups found a different number of records than when traced.
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <time.h>
+#include "cdb.h"
+
+#ifndef O_BINARY
+# define O_BINARY 0
+#endif
+#ifndef EPROTO
+# define EPROTO EINVAL
+#endif
+
+#define NOPS 4	/* CDB_TRACE_xxx are 1..3 */
+
+static const char *const opnames[NOPS] = { NULL, "get", "find_all", "seq" };
+
+struct op {
+  unsigned char op, hits;
+  unsigned hval, nsec, klen;
+  const unsigned char *key;
+};
+
+static unsigned long long
+now_ns(void)
+{
+  struct timespec ts;
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return (unsigned long long)ts.tv_sec * 1000000000u + ts.tv_nsec;
+}
+
+static int
+cmp_unsigned(const void *a, const void *b)
+{
+  unsigned ua = *(const unsigned *)a, ub = *(const unsigned *)b;
+  return ua < ub ? -1 : ua > ub;
+}
+
+/* read the whole trace; return its operations, or NULL */
+static struct op *
+load_trace(const char *name, unsigned char **bufp, unsigned *nopsp)
+{
+  FILE *f = fopen(name, "rb");
+  unsigned char *buf = NULL, *p, *end;
+  size_t len = 0, max = 0, l;
+  struct op *ops;
+  unsigned i, n;
+
+  if (!f)
+    return NULL;
+  for (;;) {
+    if (len == max) {
+      unsigned char *nbuf = realloc(buf, max = max ? max << 1 : 1 << 20);
+      if (!nbuf) {
+        free(buf);
+        fclose(f);
+        return errno = ENOMEM, NULL;
+      }
+      buf = nbuf;
+    }
+    if ((l = fread(buf + len, 1, max - len, f)) == 0)
+      break;
+    len += l;
+  }
+  fclose(f);
+  if (len < 8 || memcmp(buf, CDB_TRACE_MAGIC, 4) != 0 ||
+      cdb_unpack(buf + 4) != CDB_TRACE_VERSION) {
+    free(buf);
+    return errno = EPROTO, NULL;
+  }
+
+  /* a record cut short ends the trace, as if the writer was killed */
+  end = buf + len;
+  for (n = 0, p = buf + 8; end - p >= CDB_TRACE_HDR &&
+       cdb_unpack(p + 10) <= (size_t)(end - p - CDB_TRACE_HDR); ++n)
+    p += CDB_TRACE_HDR + cdb_unpack(p + 10);
+  if (!(ops = (struct op *)malloc((n + 1) * sizeof(*ops)))) {
+    free(buf);
+    return errno = ENOMEM, NULL;
+  }
+  for (i = 0, p = buf + 8; i < n; ++i) {
+    ops[i].op = p[0];
+    ops[i].hits = p[1];
+    ops[i].hval = cdb_unpack(p + 2);
+    ops[i].nsec = cdb_unpack(p + 6);
+    ops[i].klen = cdb_unpack(p + 10);
+    ops[i].key = p + CDB_TRACE_HDR;
+    if (!ops[i].op || ops[i].op >= NOPS) {
+      free(ops);
+      free(buf);
+      return errno = EPROTO, NULL;
+    }
+    p += CDB_TRACE_HDR + ops[i].klen;
+  }
+  *bufp = buf;
+  *nopsp = n;
+  return ops;
+}
+
+/* where found values are read to */
+static volatile unsigned char sink;
+
+/* read a found value, so that its pages are touched */
+static void
+touch(struct cdb *cdbp)
+{
+  const unsigned char *v = cdb_get(cdbp, cdb_datalen(cdbp), cdb_datapos(cdbp));
+  unsigned i;
+  if (v)
+    for (i = 0; i < cdb_datalen(cdbp); i += 4096)
+      sink = v[i];
+}
+
+/* the number of records the operation finds, or -1 */
+static int
+run_op(struct cdb *cdbp, const struct op *o, unsigned *seqpos)
+{
+  struct cdb_find cdbf;
+  int ret, n = 0;
+
+  switch (o->op) {
+  case CDB_TRACE_GET:
+    if ((ret = cdb_findh(cdbp, o->key, o->klen, o->hval)) > 0)
+      touch(cdbp);
+    return ret;
+  case CDB_TRACE_FIND_ALL:
+    if (cdb_findinith(&cdbf, cdbp, o->key, o->klen, o->hval) < 0)
+      return -1;
+    while ((ret = cdb_findnext(&cdbf)) > 0) {
+      touch(cdbp);
+      ++n;
+    }
+    return ret < 0 ? -1 : n;
+  default:
+    if ((ret = cdb_seqnext(seqpos, cdbp)) == 0) {
+      cdb_seqinit(seqpos, cdbp);
+      ret = cdb_seqnext(seqpos, cdbp);
+    }
+    if (ret > 0)
+      touch(cdbp);
+    return ret;
+  }
+}
+
+static void
+print_lat(const char *what, unsigned *lat, unsigned n)
+{
+  unsigned long long total = 0;
+  unsigned i;
+  for (i = 0; i < n; ++i)
+    total += lat[i];
+  qsort(lat, n, sizeof(*lat), cmp_unsigned);
+  printf("    %-9s mean %8.0f ns  p50 %8u  p99 %8u  max %8u\n", what,
+         (double)total / n, lat[n / 2], lat[n - 1 - n / 100], lat[n - 1]);
+}
+
+static int
+replay_file(const char *name, const struct op *ops, unsigned nops,
+            unsigned cachemb, unsigned repeat)
+{
+  struct cdb cdb;
+  unsigned *lat, *rec, cnt[NOPS], hits[NOPS], differ[NOPS];
+  unsigned i, r, o, n, seqpos;
+  unsigned long long t0, t;
+  int fd, ret;
+
+  fd = open(name, O_RDONLY | O_BINARY);
+  if (fd < 0 || (cachemb ? cdb_init_pread(&cdb, fd, cachemb << 20)
+                         : cdb_init(&cdb, fd)) < 0) {
+    fprintf(stderr, "cdb-replay: %s: %s\n", name, strerror(errno));
+    if (fd >= 0)
+      close(fd);
+    return 1;
+  }
+  lat = (unsigned *)malloc((nops + 1) * sizeof(*lat));
+  rec = (unsigned *)malloc((nops + 1) * sizeof(*rec));
+  if (!lat || !rec) {
+    fprintf(stderr, "cdb-replay: %s\n", strerror(ENOMEM));
+    free(lat);
+    free(rec);
+    cdb_free(&cdb);
+    close(fd);
+    return 1;
+  }
+
+  for (r = 0; r < repeat; ++r) {
+    memset(cnt, 0, sizeof(cnt));
+    memset(hits, 0, sizeof(hits));
+    memset(differ, 0, sizeof(differ));
+    cdb_seqinit(&seqpos, &cdb);
+    t0 = now_ns();
+    for (i = 0; i < nops; ++i) {
+      t = now_ns();
+      ret = run_op(&cdb, ops + i, &seqpos);
+      lat[i] = (unsigned)(now_ns() - t);
+      if (ret < 0) {
+        fprintf(stderr, "cdb-replay: %s: %s\n", name, strerror(errno));
+        free(lat);
+        free(rec);
+        cdb_free(&cdb);
+        close(fd);
+        return 1;
+      }
+      ++cnt[ops[i].op];
+      hits[ops[i].op] += ret > 0;
+      differ[ops[i].op] += (ret < 255 ? ret : 255) != ops[i].hits;
+    }
+    t0 = now_ns() - t0;
+  }
+
+  printf("%s: %u ops in %.3f ms%s\n", name, nops, t0 / 1e6,
+         cachemb ? " (pread)" : "");
+  for (o = 1; o < NOPS; ++o) {
+    if (!cnt[o])
+      continue;
+    printf("  %s: %u ops, %u hits, %u differ from the trace\n",
+           opnames[o], cnt[o], hits[o], differ[o]);
+    for (i = 0, n = 0; i < nops; ++i)
+      if (ops[i].op == o) {
+        rec[n] = ops[i].nsec;
+        lat[n++] = lat[i];
+      }
+    print_lat("replayed", lat, n);
+    print_lat("traced", rec, n);
+  }
+  free(lat);
+  free(rec);
+  cdb_free(&cdb);
+  close(fd);
+  return 0;
+}
+
+int
+main(int argc, char **argv)
+{
+  unsigned char *buf;
+  struct op *ops;
+  unsigned nops, cachemb = 0, repeat = 1;
+  int c, i, ret = 0;
+
+  while ((c = getopt(argc, argv, "p:r:")) != -1)
+    switch (c) {
+    case 'p':
+      cachemb = (unsigned)atoi(optarg);
+      break;
+    case 'r':
+      repeat = (unsigned)atoi(optarg);
+      break;
+    default:
+      argc = 0;
+    }
+  if (argc - optind < 2 || !repeat || cachemb >= 4096) {
+    fprintf(stderr,
+            "usage: cdb-replay [-p cache_mb] [-r repeat] trace file.cdb...\n");
+    return 2;
+  }
+  if (!(ops = load_trace(argv[optind], &buf, &nops))) {
+    fprintf(stderr, "cdb-replay: %s: %s\n", argv[optind], strerror(errno));
+    return 1;
+  }
+  if (!nops) {
+    fprintf(stderr, "cdb-replay: %s: empty trace\n", argv[optind]);
+    return 1;
+  }
+  for (i = optind + 1; i < argc; ++i) {
+    if (i > optind + 1)
+      printf("\n");
+    ret |= replay_file(argv[i], ops, nops, cachemb, repeat);
+  }
+  free(ops);
+  free(buf);
+  return ret;
+}
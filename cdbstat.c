@@ -0,0 +1,110 @@
+/* cdb-stat: print index and data statistics of cdb files
+ *
+ * This file is a part of lua-tinycdb.
+ *
+ * usage: cdb-stat [-t] file.cdb...
+ *   -t  also list the load of every hash table
+ */
+
+#include <stdio.h>
+#include <string.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include "cdb.h"
+
+#ifndef O_BINARY
+# define O_BINARY 0
+#endif
+
+static void
+print_hist(const char *title, const unsigned *h, unsigned n)
+{
+  unsigned i, last = 0;
+  char range[32];
+  for (i = 0; i < n; ++i)
+    if (h[i])
+      last = i + 1;
+  printf("%s:\n", title);
+  for (i = 0; i < last; ++i) {
+    if (i < 2)
+      sprintf(range, "%u", i);
+    else
+      sprintf(range, "%u-%u", 1u << (i - 1),
+              (i < 32 ? (1u << i) : 0u) - 1);
+    printf("  %21s  %u\n", range, h[i]);
+  }
+}
+
+static int
+stat_file(const char *name, int tables)
+{
+  struct cdb cdb;
+  struct cdb_stat st;
+  unsigned i;
+  int fd = open(name, O_RDONLY | O_BINARY);
+
+  if (fd < 0 || cdb_init(&cdb, fd) < 0) {
+    fprintf(stderr, "cdb-stat: %s: %s\n", name, strerror(errno));
+    if (fd >= 0)
+      close(fd);
+    return 1;
+  }
+  if (cdb_analyze(&cdb, &st) < 0) {
+    fprintf(stderr, "cdb-stat: %s: %s\n", name, strerror(errno));
+    cdb_free(&cdb);
+    close(fd);
+    return 1;
+  }
+
+  printf("%s:\n", name);
+  printf("index: %s\n", (cdb.cdb_flags & CDB_F_MPH) ?
+         "minimal perfect hash" : "hash tables");
+  printf("records: %u (%u indexed, %u dead using %u bytes)\n",
+         st.records, st.indexed, st.dead, st.deadbytes);
+  printf("keys: %u distinct, %u with duplicates\n", st.keys, st.dupkeys);
+  printf("key bytes: %llu, value bytes: %llu\n", st.keybytes, st.valbytes);
+  printf("slots: %u, load %.3f\n", st.slots,
+         st.slots ? (double)st.indexed / st.slots : 0.0);
+  printf("probe distance: max %u, mean %.3f\n", st.maxprobe, st.meanprobe);
+  for (i = 0; i < CDB_STAT_PROBES; ++i)
+    if (st.probes[i])
+      printf("  %19s%2u  %u\n", i == CDB_STAT_PROBES - 1 ? ">=" : "", i,
+             st.probes[i]);
+  printf("absent keys probe past: max %u, mean %.3f\n", st.maxmiss,
+         st.meanmiss);
+  print_hist("key sizes", st.ksizes, CDB_STAT_SIZES);
+  print_hist("value sizes", st.vsizes, CDB_STAT_SIZES);
+  if (tables) {
+    printf("tables:\n");
+    for (i = 0; i < 256; ++i)
+      if (st.tslots[i])
+        printf("  %3u  %8u slots  %8u used  load %.3f\n", i, st.tslots[i],
+               st.tused[i], (double)st.tused[i] / st.tslots[i]);
+  }
+
+  cdb_free(&cdb);
+  close(fd);
+  return 0;
+}
+
+int
+main(int argc, char **argv)
+{
+  int i, tables = 0, ret = 0;
+
+  if (argc > 1 && strcmp(argv[1], "-t") == 0) {
+    tables = 1;
+    --argc, ++argv;
+  }
+  if (argc < 2) {
+    fprintf(stderr, "usage: cdb-stat [-t] file.cdb...\n");
+    return 2;
+  }
+  for (i = 1; i < argc; ++i) {
+    if (i > 1)
+      printf("\n");
+    ret |= stat_file(argv[i], tables);
+  }
+  return ret;
+}
@@ -0,0 +1,383 @@
+/* cdb-tool: build cdb files from cdbmake input, and dump them
+ *
+ * This file is a part of lua-tinycdb.
+ *
+ * usage: cdb-tool -c [-r|-0|-u|-e|-w] [-M] [-D] [-R] [-W mb] [-t tmp] file.cdb [input]
+ *        cdb-tool -d file.cdb
+ *        cdb-tool -l file.cdb
+ *   -c  create file.cdb from records in cdbmake format
+ *       (+klen,dlen:key->data, one per line, ending with an empty line)
+ *       read from input or the standard input; written to tmp (default
+ *       file.cdb.tmp) and renamed once on the disk.  When a key is
+ *       already there:
+ *         -r  replace the earlier records
+ *         -0  replace them, filling them with zeros
+ *         -u  keep them and skip the new one
+ *         -e  keep them and fail
+ *         -w  add the new one and warn
+ *       (the default adds it silently, as cdbmake does)
+ *   -M  write a minimal perfect hash index; keys must be unique
+ *   -D  store each distinct value once (not with -r or -0)
+ *   -R  place records in the hash tables by Robin Hood displacement
+ *   -W  start writing back every mb megabytes while building
+ *   -d  dump file.cdb in cdbmake format
+ *   -l  list the keys of file.cdb, as +klen:key lines
+ *
+ * Input is parsed straight out of a large read buffer (grown only for
+ * records larger than it) and handed to cdb_make_put(); dumps walk the
+ * mapped file with cdb_seqnext() into a large output buffer.
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <unistd.h>
+#ifndef _WIN32
+# include <sys/mman.h>
+#endif
+#include "cdb.h"
+
+#ifndef O_BINARY
+# define O_BINARY 0
+#endif
+
+#define BUFSIZE (1 << 20)
+
+static const char *progname = "cdb-tool";
+
+/* buffered input: [pos, end) of buf is unread */
+struct in {
+  int fd;
+  unsigned char *buf;
+  size_t pos, end, size;
+  int eof;
+};
+
+/* make at least n unread bytes contiguous in buf; 0 if input ends first */
+static int
+in_need(struct in *ip, size_t n)
+{
+  ssize_t l;
+
+  if (ip->end - ip->pos >= n)
+    return 1;
+  if (ip->pos) {
+    memmove(ip->buf, ip->buf + ip->pos, ip->end - ip->pos);
+    ip->end -= ip->pos;
+    ip->pos = 0;
+  }
+  if (n > ip->size) {
+    unsigned char *nbuf = (unsigned char *)realloc(ip->buf, n);
+    if (!nbuf)
+      return errno = ENOMEM, -1;
+    ip->buf = nbuf;
+    ip->size = n;
+  }
+  while (ip->end < n && !ip->eof) {
+    l = read(ip->fd, ip->buf + ip->end, ip->size - ip->end);
+    if (l < 0 && errno == EINTR)
+      continue;
+    if (l < 0)
+      return -1;
+    if (l == 0)
+      ip->eof = 1;
+    ip->end += (size_t)l;
+  }
+  return ip->end >= n;
+}
+
+/* the next byte, or -1 at the end of the input */
+static int
+in_getc(struct in *ip)
+{
+  if (ip->pos == ip->end && in_need(ip, 1) <= 0)
+    return -1;
+  return ip->buf[ip->pos++];
+}
+
+/* a decimal number ended by the byte term */
+static int
+in_number(struct in *ip, unsigned *np, int term)
+{
+  unsigned n = 0;
+  int c = in_getc(ip);
+  if (c < '0' || c > '9')
+    return -1;
+  do {
+    if (n > (0xffffffffu - (unsigned)(c - '0')) / 10)
+      return -1;
+    n = n * 10 + (unsigned)(c - '0');
+  } while ((c = in_getc(ip)) >= '0' && c <= '9');
+  *np = n;
+  return c == term ? 0 : -1;
+}
+
+/* buffered output */
+struct out {
+  int fd;
+  unsigned char *buf;
+  size_t len;
+};
+
+static int
+out_flush(struct out *op)
+{
+  const unsigned char *p = op->buf;
+  ssize_t l;
+  while (op->len) {
+    l = write(op->fd, p, op->len);
+    if (l < 0 && errno == EINTR)
+      continue;
+    if (l < 0)
+      return -1;
+    p += l;
+    op->len -= (size_t)l;
+  }
+  return 0;
+}
+
+static int
+out_put(struct out *op, const void *ptr, size_t n)
+{
+  const unsigned char *p = (const unsigned char *)ptr;
+  ssize_t l;
+  if (op->len + n <= BUFSIZE) {
+    memcpy(op->buf + op->len, p, n);
+    op->len += n;
+    return 0;
+  }
+  if (out_flush(op) < 0)
+    return -1;
+  if (n < BUFSIZE)
+    return out_put(op, p, n);
+  /* a large value goes out from the map directly */
+  while (n) {
+    l = write(op->fd, p, n);
+    if (l < 0 && errno == EINTR)
+      continue;
+    if (l < 0)
+      return -1;
+    p += l;
+    n -= (size_t)l;
+  }
+  return 0;
+}
+
+/* print a key in a message, cut short */
+static void
+warn_key(const char *what, unsigned rec, const unsigned char *key,
+         unsigned klen)
+{
+  fprintf(stderr, "%s: record %u: key %.*s%s %s\n", progname, rec,
+          (int)(klen < 64 ? klen : 64), (const char *)key,
+          klen > 64 ? "..." : "", what);
+}
+
+/* build name from the cdbmake input on infd; with strict, an existing
+ * key is an error (mode is then CDB_PUT_INSERT) */
+static int
+create(const char *name, const char *tmpname, int infd,
+       enum cdb_put_mode mode, int strict, int mflags, unsigned wbmb)
+{
+  struct cdb_make cdbm;
+  struct in in;
+  unsigned klen, dlen, rec = 0;
+  const unsigned char *p;
+  int fd, c, r;
+
+  memset(&in, 0, sizeof(in));
+  in.fd = infd;
+  fd = open(tmpname, O_RDWR | O_CREAT | O_TRUNC | O_BINARY, 0666);
+  if (fd < 0) {
+    fprintf(stderr, "%s: %s: %s\n", progname, tmpname, strerror(errno));
+    return 1;
+  }
+  cdb_make_start(&cdbm, fd);
+  cdbm.cdb_mflags = mflags;
+  if (wbmb && cdb_make_writeback(&cdbm, wbmb << 20, 0, 0) < 0)
+    goto err;
+  if (!(in.buf = (unsigned char *)malloc(in.size = BUFSIZE)))
+    goto err;
+
+  for (;;) {
+    if ((c = in_getc(&in)) == '\n' || (c < 0 && in.eof))
+      break;
+    ++rec;
+    if (c != '+' || in_number(&in, &klen, ',') < 0 ||
+        in_number(&in, &dlen, ':') < 0 || klen > 0xffffffffu - 3 - dlen)
+      goto bad;
+    /* key, "->", data and the newline in one piece */
+    if ((r = in_need(&in, (size_t)klen + dlen + 3)) < 0)
+      goto err;
+    p = in.buf + in.pos;
+    if (!r || p[klen] != '-' || p[klen + 1] != '>' || p[klen + 2 + dlen] != '\n')
+      goto bad;
+    in.pos += (size_t)klen + dlen + 3;
+    if ((r = cdb_make_put(&cdbm, p, klen, p + klen + 2, dlen, mode)) < 0)
+      goto err;
+    if (r && strict) {
+      warn_key("already exists", rec, p, klen);
+      goto fail;
+    }
+    if (r && mode == CDB_PUT_WARN)
+      warn_key("duplicated", rec, p, klen);
+  }
+  if (c < 0 && !in.eof)
+    goto err;
+  free(in.buf);
+  if (cdb_make_finish(&cdbm) < 0 || fsync(fd) < 0) {
+    fprintf(stderr, "%s: %s: %s\n", progname, tmpname, strerror(errno));
+    close(fd);
+    unlink(tmpname);
+    return 1;
+  }
+  if (close(fd) < 0 || rename(tmpname, name) < 0) {
+    fprintf(stderr, "%s: %s: %s\n", progname, name, strerror(errno));
+    unlink(tmpname);
+    return 1;
+  }
+  return 0;
+
+bad:
+  fprintf(stderr, "%s: input: bad format at record %u\n", progname, rec);
+  goto fail;
+err:
+  fprintf(stderr, "%s: %s: %s\n", progname, tmpname, strerror(errno));
+fail:
+  free(in.buf);
+  cdb_make_free(&cdbm);
+  close(fd);
+  unlink(tmpname);
+  return 1;
+}
+
+/* write every record of name in cdbmake format, or only its keys */
+static int
+dump(const char *name, int keys)
+{
+  struct cdb cdb;
+  struct out out;
+  unsigned pos, klen, vlen;
+  char head[32];
+  int fd, r, ret = 1;
+
+  fd = open(name, O_RDONLY | O_BINARY);
+  if (fd < 0 || cdb_init(&cdb, fd) < 0) {
+    fprintf(stderr, "%s: %s: %s\n", progname, name, strerror(errno));
+    if (fd >= 0)
+      close(fd);
+    return 1;
+  }
+#ifdef MADV_SEQUENTIAL
+  madvise((void *)cdb.cdb_mem, cdb.cdb_fsize, MADV_SEQUENTIAL);
+#endif
+  out.fd = 1;
+  out.len = 0;
+  if (!(out.buf = (unsigned char *)malloc(BUFSIZE))) {
+    fprintf(stderr, "%s: %s\n", progname, strerror(ENOMEM));
+    goto done;
+  }
+
+  cdb_seqinit(&pos, &cdb);
+  while ((r = cdb_seqnext(&pos, &cdb)) > 0) {
+    klen = cdb_keylen(&cdb);
+    vlen = cdb_datalen(&cdb);
+    if (keys)
+      sprintf(head, "+%u:", klen);
+    else
+      sprintf(head, "+%u,%u:", klen, vlen);
+    if (out_put(&out, head, strlen(head)) < 0 ||
+        out_put(&out, cdb_get(&cdb, klen, cdb_keypos(&cdb)), klen) < 0 ||
+        (!keys && (out_put(&out, "->", 2) < 0 ||
+                   out_put(&out, cdb_get(&cdb, vlen, cdb_datapos(&cdb)),
+                           vlen) < 0)) ||
+        out_put(&out, "\n", 1) < 0)
+      goto werr;
+  }
+  if (r < 0) {
+    fprintf(stderr, "%s: %s: %s\n", progname, name, strerror(errno));
+    goto done;
+  }
+  if ((!keys && out_put(&out, "\n", 1) < 0) || out_flush(&out) < 0)
+    goto werr;
+  ret = 0;
+  goto done;
+
+werr:
+  fprintf(stderr, "%s: output: %s\n", progname, strerror(errno));
+done:
+  free(out.buf);
+  cdb_free(&cdb);
+  close(fd);
+  return ret;
+}
+
+static int
+usage(void)
+{
+  fprintf(stderr,
+          "usage: %s -c [-r|-0|-u|-e|-w] [-M] [-D] [-R] [-W mb] [-t tmp] file.cdb [input]\n"
+          "       %s -d file.cdb\n"
+          "       %s -l file.cdb\n", progname, progname, progname);
+  return 2;
+}
+
+int
+main(int argc, char **argv)
+{
+  enum cdb_put_mode mode = CDB_PUT_ADD;
+  const char *tmpname = NULL;
+  char *tmpbuf = NULL;
+  unsigned wbmb = 0;
+  int c, cmd = 0, strict = 0, mflags = 0, infd = 0, ret;
+
+  while ((c = getopt(argc, argv, "cdlr0uewMDRW:t:")) != -1)
+    switch (c) {
+    case 'c': case 'd': case 'l':
+      if (cmd && cmd != c)
+        return usage();
+      cmd = c;
+      break;
+    case 'r': mode = CDB_PUT_REPLACE; strict = 0; break;
+    case '0': mode = CDB_PUT_REPLACE0; strict = 0; break;
+    case 'u': mode = CDB_PUT_INSERT; strict = 0; break;
+    case 'e': mode = CDB_PUT_INSERT; strict = 1; break;
+    case 'w': mode = CDB_PUT_WARN; strict = 0; break;
+    case 'M': mflags |= CDB_MAKE_MPH; break;
+    case 'D': mflags |= CDB_MAKE_DEDUP; break;
+    case 'R': mflags |= CDB_MAKE_ROBINHOOD; break;
+    case 'W':
+      if ((wbmb = (unsigned)atoi(optarg)) == 0 || wbmb >= 4096)
+        return usage();
+      break;
+    case 't': tmpname = optarg; break;
+    default:
+      return usage();
+    }
+  argc -= optind;
+  argv += optind;
+  if (!cmd || argc < 1 || argc > (cmd == 'c' ? 2 : 1))
+    return usage();
+  if (cmd != 'c')
+    return dump(argv[0], cmd == 'l');
+
+  if (argc > 1 && (infd = open(argv[1], O_RDONLY | O_BINARY)) < 0) {
+    fprintf(stderr, "%s: %s: %s\n", progname, argv[1], strerror(errno));
+    return 1;
+  }
+  if (!tmpname) {
+    if (!(tmpbuf = (char *)malloc(strlen(argv[0]) + 5))) {
+      fprintf(stderr, "%s: %s\n", progname, strerror(ENOMEM));
+      return 1;
+    }
+    sprintf(tmpbuf, "%s.tmp", argv[0]);
+    tmpname = tmpbuf;
+  }
+  ret = create(argv[0], tmpname, infd, mode, strict, mflags, wbmb);
+  free(tmpbuf);
+  if (infd)
+    close(infd);
+  return ret;
+}
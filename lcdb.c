@@ -1,92 +1,1727 @@
+/* dladdr() */
+#ifndef _GNU_SOURCE
+# define _GNU_SOURCE
+#endif
+#include <stdio.h>
+#include <stdlib.h>
+#include <sys/types.h>
+#include <sys/stat.h>
 #include <fcntl.h>
 #include <unistd.h>
 #include <errno.h>
 #include <string.h>
+#include <time.h>
+#include <pthread.h>
+#include <dlfcn.h>
 #include <lua.h>
 #include <lauxlib.h>
 
-#ifndef O_BINARY
-  #ifdef _O_BINARY
-    #define O_BINARY _O_BINARY
-  #else
-    #define O_BINARY 0 // system doesn't need O_BINARY 
-  #endif
-#endif
+#ifndef O_BINARY
+  #ifdef _O_BINARY
+    #define O_BINARY _O_BINARY
+  #else
+    #define O_BINARY 0 // system doesn't need O_BINARY 
+  #endif
+#endif
+
+
+#include "cdb.h"
+
+#define LCDB_DB "cdb.db"
+#define LCDB_MAKE "cdb.make"
+#define LCDB_SHARDED "cdb.sharded"
+#define LCDB_PENDING "cdb.pending"
+#define LCDB_POOL "cdb.pool"
+
+/* helper threads faulting in pages for db:get_nowait() */
+#define LCDB_ASYNC_THREADS 4
+
+/* a set of databases records are spread over with cdb_shard() */
+struct lcdb_sharded {
+  unsigned n;			/* number of shards, 0 once closed */
+  struct cdb *shards[1];	/* the shard userdata, in its environment */
+};
+
+/* a cache slot: the key and value strings themselves are kept in the
+ * cache's registry table, at 2 * slot + 1 and 2 * slot + 2 */
+struct lcdb_slot {
+  unsigned char used;		/* holds an entry */
+  unsigned char ref;		/* hit since the clock hand last passed */
+  unsigned size;		/* value length */
+};
+
+/* a db: the struct cdb comes first so check_cdb() can return it */
+struct lcdb_db {
+  struct cdb cdb;
+  /* hot key cache, disabled while max_entries is 0 */
+  unsigned max_entries, max_bytes;	/* limits */
+  unsigned entries, bytes;		/* current use */
+  unsigned hand;			/* CLOCK hand */
+  lua_Number hits, misses, evictions;
+  struct lcdb_slot *slots;
+  int keys_ref;			/* registry: key -> slot + 1 */
+  int vals_ref;			/* registry: slot keys and values */
+  unsigned gen;			/* bumped by db:reload() */
+  unsigned bcsize;		/* pread mode block cache size, 0 = mmap */
+  unsigned inflight;		/* lookups queued to the helper threads */
+  struct cdb_trace *trace;	/* set by db:trace(filename) */
+  int trace_fd;
+  struct lcdb_pool *hpool;	/* set for the handles of a cdb.pool */
+  struct lcdb_db *newer, *older;	/* in its LRU list while open */
+  dev_t dev; ino_t ino;		/* and the file it last opened */
+  off_t size; time_t mtime;
+  unsigned load;		/* read into memory: LCDB_LOAD | CDB_LOAD_xxx */
+};
+
+#define LCDB_LOAD	0x100
+
+/* whether db is open; those held in memory have no cdb_fd */
+#define db_isopen(db) ((db)->cdb.cdb_fsize != 0)
+
+/* a cdb.pool: at most max_open of its handles have their file open and
+ * at most max_mapped bytes mapped; the least recently used ones are
+ * closed to make room, and reopened when used again.  It is shared by
+ * the cdb.pool userdata and its handles and freed with the last one. */
+struct lcdb_pool {
+  unsigned refs;
+  unsigned max_open, nopen;
+  unsigned long long max_mapped, mapped;
+  struct lcdb_db *mru, *lru;	/* open handles, most recently used first */
+  unsigned handles;
+  lua_Number opens, evictions;
+};
+
+/* a lookup handed to the helper threads, which repeat it on their own
+ * copy of the struct cdb to take the page faults */
+struct lcdb_req {
+  struct lcdb_req *next;
+  struct lcdb_db *db;		/* whose inflight count it is in */
+  int done;			/* the pages were touched */
+  int orphan;			/* its cdb.pending was collected first */
+  unsigned klen;
+  char key[1];
+};
+
+/* the helper threads, shared by every Lua state in the process */
+static struct {
+  pthread_mutex_t mu;
+  pthread_cond_t work;		/* a request was queued */
+  pthread_cond_t done;		/* a request was completed */
+  struct lcdb_req *head, *tail;
+  int started;
+  int pipe[2];			/* a byte is written per completed request */
+} pool = {
+  PTHREAD_MUTEX_INITIALIZER, PTHREAD_COND_INITIALIZER,
+  PTHREAD_COND_INITIALIZER, NULL, NULL, 0, { -1, -1 }
+};
+
+static struct cdb *new_cdb(lua_State *L) {
+  struct lcdb_db *db = (struct lcdb_db*)lua_newuserdata(L, sizeof(struct lcdb_db));
+  memset(db, 0, sizeof(*db));
+  db->cdb.cdb_fd = db->trace_fd = -1;
+  db->keys_ref = db->vals_ref = LUA_NOREF;
+  luaL_getmetatable(L, LCDB_DB);
+  lua_setmetatable(L, -2);
+  return &db->cdb;
+}
+
+/* whether the value at index n is a userdata with metatable tname */
+static int is_udata(lua_State *L, int n, const char *tname) {
+  int ret = 0;
+  if (lua_isuserdata(L, n) && lua_getmetatable(L, n)) {
+    luaL_getmetatable(L, tname);
+    ret = lua_rawequal(L, -1, -2);
+    lua_pop(L, 2);
+  }
+  return ret;
+}
+
+static int push_errno(lua_State *L, int xerrno) {
+  lua_pushnil(L);
+  lua_pushstring(L, strerror(xerrno));
+  return 2;
+}
+
+/* numeric field `name` of the optional options table at index n */
+static lua_Number opt_number(lua_State *L, int n, const char *name,
+                             lua_Number def) {
+  if (!lua_isnoneornil(L, n)) {
+    luaL_checktype(L, n, LUA_TTABLE);
+    lua_getfield(L, n, name);
+    if (!lua_isnil(L, -1)) {
+      if (!lua_isnumber(L, -1))
+        return luaL_error(L, "option '%s' must be a number", name);
+      def = lua_tonumber(L, -1);
+    }
+    lua_pop(L, 1);
+  }
+  return def;
+}
+
+/* look up string field `name` of the optional options table at index n,
+ * returning its index in lst like luaL_checkoption */
+static int opt_option(lua_State *L, int n, const char *name, const char *def,
+                      const char *const lst[]) {
+  const char *s = def;
+  int i;
+  if (!lua_isnoneornil(L, n)) {
+    luaL_checktype(L, n, LUA_TTABLE);
+    lua_getfield(L, n, name);
+    if (!lua_isnil(L, -1))
+      s = lua_tostring(L, -1);
+    if (!s)
+      return luaL_error(L, "option '%s' must be a string", name);
+  }
+  else
+    lua_pushnil(L);
+  /* s may be a number converted in place: only pop once it is used */
+  for (i = 0; lst[i]; i++)
+    if (strcmp(lst[i], s) == 0) {
+      lua_pop(L, 1);
+      return i;
+    }
+  return luaL_error(L, "invalid value '%s' for option '%s'", s, name);
+}
+
+/* look up boolean field `name` of the optional options table at index n */
+static int opt_boolean(lua_State *L, int n, const char *name, int def) {
+  if (!lua_isnoneornil(L, n)) {
+    luaL_checktype(L, n, LUA_TTABLE);
+    lua_getfield(L, n, name);
+    if (!lua_isnil(L, -1)) {
+      if (!lua_isboolean(L, -1))
+        return luaL_error(L, "option '%s' must be a boolean", name);
+      def = lua_toboolean(L, -1);
+    }
+    lua_pop(L, 1);
+  }
+  return def;
+}
+
+/* drop every cache entry, keeping the configured limits */
+static void cache_clear(lua_State *L, struct lcdb_db *db) {
+  if (!db->max_entries)
+    return;
+  luaL_unref(L, LUA_REGISTRYINDEX, db->keys_ref);
+  luaL_unref(L, LUA_REGISTRYINDEX, db->vals_ref);
+  lua_newtable(L);
+  db->keys_ref = luaL_ref(L, LUA_REGISTRYINDEX);
+  lua_createtable(L, db->max_entries < 1024 ? 2 * db->max_entries : 2048, 0);
+  db->vals_ref = luaL_ref(L, LUA_REGISTRYINDEX);
+  memset(db->slots, 0, db->max_entries * sizeof(*db->slots));
+  db->entries = db->bytes = db->hand = 0;
+}
+
+/* release the cache altogether */
+static void cache_free(lua_State *L, struct lcdb_db *db) {
+  luaL_unref(L, LUA_REGISTRYINDEX, db->keys_ref);
+  luaL_unref(L, LUA_REGISTRYINDEX, db->vals_ref);
+  db->keys_ref = db->vals_ref = LUA_NOREF;
+  free(db->slots);
+  db->slots = NULL;
+  db->max_entries = 0;
+}
+
+/* push the cached value of the key at index k, or return 0 */
+static int cache_get(lua_State *L, struct lcdb_db *db, int k) {
+  int slot;
+  lua_rawgeti(L, LUA_REGISTRYINDEX, db->keys_ref);
+  lua_pushvalue(L, k);
+  lua_rawget(L, -2);
+  slot = lua_tointeger(L, -1);
+  lua_pop(L, 2);
+  if (!slot) {
+    db->misses++;
+    return 0;
+  }
+  db->hits++;
+  db->slots[--slot].ref = 1;
+  lua_rawgeti(L, LUA_REGISTRYINDEX, db->vals_ref);
+  lua_rawgeti(L, -1, 2 * slot + 2);
+  lua_remove(L, -2);
+  return 1;
+}
+
+/* CLOCK: clear the reference bits under the hand until it reaches an
+ * unreferenced entry, and evict that one */
+static void cache_evict(lua_State *L, struct lcdb_db *db, int vals, int keys) {
+  struct lcdb_slot *sp;
+  for (;;) {
+    sp = db->slots + db->hand;
+    if (sp->used && !sp->ref)
+      break;
+    sp->ref = 0;
+    if (++db->hand == db->max_entries)
+      db->hand = 0;
+  }
+  lua_rawgeti(L, vals, 2 * db->hand + 1);
+  lua_pushnil(L);
+  lua_rawset(L, keys);
+  lua_pushnil(L);
+  lua_rawseti(L, vals, 2 * db->hand + 1);
+  lua_pushnil(L);
+  lua_rawseti(L, vals, 2 * db->hand + 2);
+  sp->used = 0;
+  db->entries--;
+  db->bytes -= sp->size;
+  db->evictions++;
+}
+
+/* remember the key at index k with the value on top of the stack */
+static void cache_put(lua_State *L, struct lcdb_db *db, int k, unsigned vlen) {
+  struct lcdb_slot *sp;
+  int keys, vals;
+  if (vlen > db->max_bytes)
+    return;
+  lua_rawgeti(L, LUA_REGISTRYINDEX, db->keys_ref);
+  keys = lua_gettop(L);
+  lua_rawgeti(L, LUA_REGISTRYINDEX, db->vals_ref);
+  vals = keys + 1;
+  while (db->entries == db->max_entries || db->max_bytes - db->bytes < vlen)
+    cache_evict(L, db, vals, keys);
+  /* a free slot is at or soon after the hand */
+  while (db->slots[db->hand].used)
+    if (++db->hand == db->max_entries)
+      db->hand = 0;
+  sp = db->slots + db->hand;
+  sp->used = 1;
+  sp->ref = 0;
+  sp->size = vlen;
+  db->entries++;
+  db->bytes += vlen;
+  lua_pushvalue(L, k);
+  lua_pushinteger(L, db->hand + 1);
+  lua_rawset(L, keys);
+  lua_pushvalue(L, k);
+  lua_rawseti(L, vals, 2 * db->hand + 1);
+  lua_pushvalue(L, keys - 1);
+  lua_rawseti(L, vals, 2 * db->hand + 2);
+  lua_pop(L, 2);
+}
+
+/* set up cdbp on the open fd, taking the fd over: read into memory
+ * with load, else mapped if cachesize is 0 */
+static int init_cdb(struct cdb *cdbp, int fd, unsigned cachesize,
+                    unsigned load) {
+  if ((load ? cdb_init_load(cdbp, fd, load & ~LCDB_LOAD) :
+       cachesize ? cdb_init_pread(cdbp, fd, cachesize) : cdb_init(cdbp, fd)) < 0) {
+    int xerrno = errno; /* EPROTO if it is not a database */
+    close(fd);
+    cdbp->cdb_fd = -1;
+    return errno = xerrno, -1;
+  }
+  if (load)
+    close(fd); /* all of it is in memory */
+  return 0;
+}
+
+static int open_cdb(struct cdb *cdbp, const char *filename, unsigned cachesize,
+                    unsigned load) {
+  int fd = open(filename, O_RDONLY | O_BINARY);
+  if (fd < 0)
+    return -1;
+  return init_cdb(cdbp, fd, cachesize, load);
+}
+
+/* release what the struct cdb of db holds */
+static void close_db(struct lcdb_db *db) {
+  if (db->cdb.cdb_fd >= 0)
+    close(db->cdb.cdb_fd);
+  cdb_free(&db->cdb);
+  db->cdb.cdb_fd = -1;
+}
+
+/* push len bytes at pos; in pread mode reading them may fail, and
+ * long values are read straight into the string being built rather
+ * than through a buffer of the block cache */
+static void push_get(lua_State *L, const struct cdb *cdbp,
+                     unsigned len, unsigned pos) {
+  const char *p;
+  if (cdbp->cdb_bc && len > LUAL_BUFFERSIZE) {
+    luaL_Buffer b;
+    unsigned n;
+    luaL_buffinit(L, &b);
+    for (; len; len -= n, pos += n) {
+      n = len < LUAL_BUFFERSIZE ? len : LUAL_BUFFERSIZE;
+      if (cdb_read(cdbp, luaL_prepbuffer(&b), n, pos) < 0)
+        luaL_error(L, LCDB_DB": read error: %s", strerror(errno));
+      luaL_addsize(&b, n);
+    }
+    luaL_pushresult(&b);
+    return;
+  }
+  if (!(p = (const char*)cdb_get(cdbp, len, pos)))
+    luaL_error(L, LCDB_DB": read error: %s", strerror(errno));
+  lua_pushlstring(L, p, len);
+}
+
+/* where the helper threads read the value pages to */
+static volatile unsigned char pool_sink;
+
+static void *pool_worker(void *arg) {
+  struct lcdb_req *req;
+  struct cdb_result res;
+  const struct cdb *cdbp;
+  const unsigned char *p;
+  unsigned i, len;
+  (void)arg;
+
+  for (;;) {
+    pthread_mutex_lock(&pool.mu);
+    while (!pool.head)
+      pthread_cond_wait(&pool.work, &pool.mu);
+    req = pool.head;
+    if (!(pool.head = req->next))
+      pool.tail = NULL;
+    pthread_mutex_unlock(&pool.mu);
+
+    /* the lookup faults in the index and the key, then touch the value;
+     * it only reads the db's struct cdb, which close and reload leave
+     * alone until inflight drops to 0 */
+    cdbp = &req->db->cdb;
+    if (cdb_find_r(cdbp, req->key, req->klen, &res) > 0) {
+      len = cdb_datalen(&res);
+      p = (const unsigned char*)cdb_get(cdbp, len, cdb_datapos(&res));
+      for (i = 0; i < len; i += 4096)
+        pool_sink = p[i];
+      if (len)
+        pool_sink = p[len - 1];
+    }
+
+    pthread_mutex_lock(&pool.mu);
+    req->done = 1;
+    req->db->inflight--;
+    if (req->orphan)
+      free(req);
+    pthread_cond_broadcast(&pool.done);
+    pthread_mutex_unlock(&pool.mu);
+    if (write(pool.pipe[1], "", 1) < 0) {
+      /* the pipe is full: whoever polls it is woken anyway */
+    }
+  }
+  return NULL;
+}
+
+/* start the helper threads on first use; pool.mu is held */
+static int pool_start(void) {
+  pthread_attr_t attr;
+  pthread_t tid;
+  int i, n = 0;
+
+  if (pool.started)
+    return 0;
+#ifdef RTLD_NODELETE
+  {
+    /* the threads never exit, so the module must outlive lua_close() */
+    Dl_info info;
+    if (!dladdr((void *)pool_worker, &info) ||
+        !dlopen(info.dli_fname, RTLD_NOW | RTLD_NODELETE))
+      return errno = ENOSYS, -1;
+  }
+#endif
+  if (pipe(pool.pipe) < 0)
+    return -1;
+  for (i = 0; i < 2; i++) {
+    fcntl(pool.pipe[i], F_SETFL, fcntl(pool.pipe[i], F_GETFL) | O_NONBLOCK);
+    fcntl(pool.pipe[i], F_SETFD, FD_CLOEXEC);
+  }
+  pthread_attr_init(&attr);
+  pthread_attr_setdetachstate(&attr, PTHREAD_CREATE_DETACHED);
+  for (i = 0; i < LCDB_ASYNC_THREADS; i++)
+    if (pthread_create(&tid, &attr, pool_worker, NULL) == 0)
+      n++;
+  pthread_attr_destroy(&attr);
+  if (!n) {
+    close(pool.pipe[0]);
+    close(pool.pipe[1]);
+    pool.pipe[0] = pool.pipe[1] = -1;
+    return errno = EAGAIN, -1;
+  }
+  pool.started = 1;
+  return 0;
+}
+
+/* wait until no request of db is queued or running: they use its mapping */
+static void wait_idle(struct lcdb_db *db) {
+  pthread_mutex_lock(&pool.mu);
+  while (db->inflight)
+    pthread_cond_wait(&pool.done, &pool.mu);
+  pthread_mutex_unlock(&pool.mu);
+}
+
+/* monotonic time in nanoseconds, for traces */
+static unsigned long long now_ns(void) {
+  struct timespec ts;
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return (unsigned long long)ts.tv_sec * 1000000000u + ts.tv_nsec;
+}
+
+/* record an operation on key that began at t0 in the trace of db */
+static void trace_op(struct lcdb_db *db, enum cdb_trace_op op,
+                     const char *key, size_t klen, unsigned hits,
+                     unsigned long long t0) {
+  unsigned long long ns = now_ns() - t0;
+  cdb_trace_put(db->trace, op, cdb_hash(key, (unsigned)klen), hits,
+                ns < 0xffffffffu ? (unsigned)ns : 0xffffffffu,
+                key, (unsigned)klen);
+}
+
+/* stop the trace of db; return -1 if it could not all be written */
+static int trace_stop(struct lcdb_db *db,
+                      unsigned long long *written, unsigned long long *dropped) {
+  int ret = cdb_trace_stop(db->trace, written, dropped);
+  int xerrno = errno;
+  db->trace = NULL;
+  if (close(db->trace_fd) < 0 && ret == 0) {
+    ret = -1;
+    xerrno = errno;
+  }
+  db->trace_fd = -1;
+  errno = xerrno;
+  return ret;
+}
+
+static void hpool_unlink(struct lcdb_pool *hp, struct lcdb_db *db) {
+  if (db->newer)
+    db->newer->older = db->older;
+  else
+    hp->mru = db->older;
+  if (db->older)
+    db->older->newer = db->newer;
+  else
+    hp->lru = db->newer;
+  db->newer = db->older = NULL;
+}
+
+static void hpool_push(struct lcdb_pool *hp, struct lcdb_db *db) {
+  db->newer = NULL;
+  db->older = hp->mru;
+  if (hp->mru)
+    hp->mru->newer = db;
+  else
+    hp->lru = db;
+  hp->mru = db;
+}
+
+/* the memory of the pool a handle on a file of fsize bytes takes: its
+ * block cache in pread mode, else the mapped or loaded file */
+static unsigned long long hpool_size(const struct lcdb_db *db,
+                                     unsigned long long fsize) {
+  return db->bcsize ? db->bcsize : fsize;
+}
+
+/* close the file of an open pool handle; the handle stays usable */
+static void hpool_release(struct lcdb_db *db) {
+  struct lcdb_pool *hp = db->hpool;
+  hpool_unlink(hp, db);
+  hp->nopen--;
+  hp->mapped -= hpool_size(db, db->cdb.cdb_fsize);
+  wait_idle(db);
+  close_db(db);
+}
+
+static void hpool_unref(struct lcdb_pool *hp) {
+  if (--hp->refs == 0)
+    free(hp);
+}
+
+/* open filename for a handle of hp, first closing the least recently
+ * used files until one more file of its size fits */
+static int hpool_open(struct lcdb_pool *hp, struct lcdb_db *db,
+                      const char *filename) {
+  struct stat st;
+  unsigned long long size;
+  int fd;
+
+  while (hp->lru && hp->nopen >= hp->max_open) {
+    hpool_release(hp->lru);
+    hp->evictions++;
+  }
+  if ((fd = open(filename, O_RDONLY | O_BINARY)) < 0)
+    return -1;
+  if (fstat(fd, &st) < 0) {
+    int xerrno = errno;
+    close(fd);
+    return errno = xerrno, -1;
+  }
+  size = hpool_size(db, (unsigned long long)st.st_size);
+  if (size > hp->max_mapped) {
+    close(fd);
+    return errno = EFBIG, -1;
+  }
+  while (hp->lru && hp->mapped + size > hp->max_mapped) {
+    hpool_release(hp->lru);
+    hp->evictions++;
+  }
+  if (init_cdb(&db->cdb, fd, db->bcsize, db->load) < 0)
+    return -1;
+  db->dev = st.st_dev;
+  db->ino = st.st_ino;
+  db->size = st.st_size;
+  db->mtime = st.st_mtime;
+  hp->nopen++;
+  hp->mapped += hpool_size(db, db->cdb.cdb_fsize);
+  hp->opens++;
+  hpool_push(hp, db);
+  return 0;
+}
+
+/* reopen the pool handle at index n; as db:reload() would if reload is
+ * set or the file was replaced since, else its cache and iterations
+ * carry on */
+static int hpool_reopen(lua_State *L, struct lcdb_db *db, int n, int reload) {
+  const char *filename;
+  dev_t dev = db->dev;
+  ino_t ino = db->ino;
+  off_t size = db->size;
+  time_t mtime = db->mtime;
+  int ret;
+  lua_getfenv(L, n);
+  lua_getfield(L, -1, "filename");
+  filename = lua_tostring(L, -1);
+  ret = hpool_open(db->hpool, db, filename);
+  lua_pop(L, 2);
+  if (ret < 0)
+    return -1;
+  if (reload || db->dev != dev || db->ino != ino || db->size != size ||
+      db->mtime != mtime) {
+    db->gen++;
+    cache_clear(L, db);
+  }
+  return 0;
+}
+
+static struct cdb *check_cdb(lua_State *L, int n) {
+  struct lcdb_db *db = (struct lcdb_db*)luaL_checkudata(L, n, LCDB_DB);
+  if (db->hpool) {
+    if (!db_isopen(db) && hpool_reopen(L, db, n, 0) < 0)
+      luaL_error(L, LCDB_DB": cannot reopen: %s", strerror(errno));
+    if (db->hpool->mru != db) {
+      hpool_unlink(db->hpool, db);
+      hpool_push(db->hpool, db);
+    }
+  }
+  luaL_argcheck(L, db_isopen(db), n, "attempted to use a closed cdb");
+  return &db->cdb;
+}
+
+/* the db at upvalue 1 of an iterator begun at gen; a pool handle the
+ * pool closed in the meantime is reopened, as check_cdb() does */
+static struct lcdb_db *check_iter(lua_State *L, unsigned gen, const char *what) {
+  struct lcdb_db *db = (struct lcdb_db*)lua_touserdata(L, lua_upvalueindex(1));
+  if (db->hpool) {
+    lua_pushvalue(L, lua_upvalueindex(1));
+    check_cdb(L, lua_gettop(L));
+    lua_pop(L, 1);
+  }
+  if (!db_isopen(db) || gen != db->gen)
+    luaL_error(L, LCDB_DB": database closed or reloaded during %s", what);
+  return db;
+}
+
+/* set up the hot key cache of db from the cache_entries and
+ * cache_bytes options */
+static int open_cache(lua_State *L, struct lcdb_db *db,
+                      lua_Number entries, lua_Number bytes) {
+  if (entries >= 1 || bytes >= 1) {
+    db->max_entries = entries >= 1 ?
+      (entries < 0x1000000 ? (unsigned)entries : 0x1000000) : 1024;
+    db->max_bytes = bytes >= 1 ?
+      (bytes < 0xffffffffu ? (unsigned)bytes : 0xffffffffu) : 0xffffffffu;
+    db->slots = (struct lcdb_slot*)malloc(db->max_entries * sizeof(*db->slots));
+    if (!db->slots) {
+      db->max_entries = 0;
+      return -1;
+    }
+    cache_clear(L, db);
+  }
+  return 0;
+}
+
+/* the options of cdb.open() and pool:get() */
+struct lcdb_opts {
+  lua_Number entries, bytes;	/* hot key cache */
+  unsigned bcsize;		/* lcdb_db fields, see there */
+  unsigned load;
+};
+
+/* read them from the options at index n, before anything is pushed */
+static void check_open(lua_State *L, int n, struct lcdb_opts *o) {
+  static const char *const modes[] = { "mmap", "pread", NULL };
+  int pread_mode = opt_option(L, n, "mode", "mmap", modes);
+  lua_Number cache_mb = opt_number(L, n, "cache_mb", 8);
+  int load = opt_boolean(L, n, "load", 0);
+  int huge = opt_boolean(L, n, "huge_pages", 0);
+
+  o->entries = opt_number(L, n, "cache_entries", 0);
+  o->bytes = opt_number(L, n, "cache_bytes", 0);
+  luaL_argcheck(L, !pread_mode || (cache_mb > 0 && cache_mb < 4096), n,
+                "cache_mb must be between 0 and 4096");
+  luaL_argcheck(L, !(load && pread_mode), n, "load is not for the pread mode");
+  o->bcsize = pread_mode ? (unsigned)(cache_mb * 1048576) : 0;
+  o->load = load ? LCDB_LOAD | (huge ? CDB_LOAD_HUGE : 0) : 0;
+}
+
+/* cdb.open(filename, [options]) */
+static int lcdb_open(lua_State *L) {
+  struct lcdb_db *db;
+  struct lcdb_opts o;
+  const char *filename = luaL_checkstring(L, 1);
+
+  check_open(L, 2, &o);
+  db = (struct lcdb_db*)new_cdb(L);
+  db->bcsize = o.bcsize;
+  db->load = o.load;
+  if (open_cdb(&db->cdb, filename, db->bcsize, db->load) < 0) {
+    if (errno != EPROTO)
+      return push_errno(L, errno);
+    lua_pushnil(L);
+    lua_pushfstring(L, LCDB_DB": file %s is not a valid database", filename);
+    return 2;
+  }
+
+  /* remember the filename for db:reload() */
+  lua_createtable(L, 0, 1);
+  lua_pushvalue(L, 1);
+  lua_setfield(L, -2, "filename");
+  lua_setfenv(L, -2);
+
+  if (open_cache(L, db, o.entries, o.bytes) < 0)
+    return push_errno(L, ENOMEM);
+  return 1;
+}
+
+/* cdb.open_string(s, [options]) */
+static int lcdb_open_string(lua_State *L) {
+  struct lcdb_db *db;
+  size_t len;
+  const char *s = luaL_checklstring(L, 1, &len);
+  lua_Number entries = opt_number(L, 2, "cache_entries", 0);
+  lua_Number bytes = opt_number(L, 2, "cache_bytes", 0);
+
+  db = (struct lcdb_db*)new_cdb(L);
+  if (len > 0xffffffffu || cdb_init_mem(&db->cdb, s, (unsigned)len) < 0) {
+    if (len <= 0xffffffffu && errno != EPROTO)
+      return push_errno(L, errno);
+    lua_pushnil(L);
+    lua_pushliteral(L, LCDB_DB": string is not a valid database");
+    return 2;
+  }
+
+  /* the string must outlive the db, which has no file to reload */
+  lua_createtable(L, 0, 1);
+  lua_pushvalue(L, 1);
+  lua_setfield(L, -2, "string");
+  lua_setfenv(L, -2);
+
+  if (open_cache(L, db, entries, bytes) < 0)
+    return push_errno(L, ENOMEM);
+  return 1;
+}
+
+static int lcdbm_gc(lua_State *L) {
+  struct lcdb_db *db = (struct lcdb_db*)luaL_checkudata(L, 1, LCDB_DB);
+  if (db->trace)
+    trace_stop(db, NULL, NULL);
+  if (db_isopen(db) && db->hpool)
+    hpool_release(db);
+  else if (db_isopen(db)) {
+    wait_idle(db);
+    close_db(db);
+  }
+  if (db->hpool) {
+    db->hpool->handles--;
+    hpool_unref(db->hpool);
+    db->hpool = NULL;
+  }
+  cache_free(L, db);
+  return 0;
+}
+
+/* db:close(); a handle of a cdb.pool only gives back its file */
+static int lcdbm_close(lua_State *L) {
+  struct lcdb_db *db = (struct lcdb_db*)luaL_checkudata(L, 1, LCDB_DB);
+  if (!db->hpool)
+    return lcdbm_gc(L);
+  if (db_isopen(db))
+    hpool_release(db);
+  return 0;
+}
+
+/* db:reload(): reopen the file, e.g. after it was replaced */
+static int lcdbm_reload(lua_State *L) {
+  struct lcdb_db *db = (struct lcdb_db*)check_cdb(L, 1);
+  struct cdb cdb;
+  const char *filename;
+
+  if (db->hpool) {
+    /* within the limits of the pool, which may close others first */
+    hpool_release(db);
+    if (hpool_reopen(L, db, 1, 1) < 0)
+      return push_errno(L, errno);
+    lua_pushboolean(L, 1);
+    return 1;
+  }
+  lua_getfenv(L, 1);
+  lua_getfield(L, -1, "filename");
+  filename = lua_tostring(L, -1);
+  if (!filename || open_cdb(&cdb, filename, db->bcsize, db->load) < 0)
+    return push_errno(L, filename ? errno : EBADF);
+  wait_idle(db);
+  close_db(db);
+  db->cdb = cdb;
+  db->gen++;
+  cache_clear(L, db);
+  lua_pushboolean(L, 1);
+  return 1;
+}
+
+/* db:__tostring() */
+static int lcdbm_tostring(lua_State *L) {
+  struct lcdb_db *db = (struct lcdb_db*)luaL_checkudata(L, 1, LCDB_DB);
+  if (db_isopen(db))
+    lua_pushfstring(L, "<"LCDB_DB"> (%p)", db);
+  else
+    lua_pushfstring(L, "<"LCDB_DB"> (closed)");
+  return 1;
+}
+
+/* db:get(key) */
+static int lcdbm_get(lua_State *L) {
+  size_t klen;
+  int ret;
+  struct cdb *cdbp = check_cdb(L, 1);
+  struct lcdb_db *db = (struct lcdb_db*)cdbp;
+  const char *key = luaL_checklstring(L, 2, &klen);
+  unsigned long long t0 = db->trace ? now_ns() : 0;
+
+  if (db->max_entries && cache_get(L, db, 2))
+    ret = 1;
+  else if ((ret = cdb_find(cdbp, key, klen)) > 0) {
+    push_get(L, cdbp, cdb_datalen(cdbp), cdb_datapos(cdbp));
+    if (db->max_entries)
+      cache_put(L, db, 2, cdb_datalen(cdbp));
+  } else if (ret == 0) {
+    lua_pushnil(L);
+  } else {
+    return luaL_error(L, LCDB_DB": error in find. Database corrupt?");
+  }
+  if (db->trace)
+    trace_op(db, CDB_TRACE_GET, key, klen, ret, t0);
+  return 1;
+}
+
+/* db:find_all(key, [options]) */
+static int lcdbm_find_all(lua_State *L) {
+  size_t klen;
+  int ret;
+  int n = 1;
+  struct cdb *cdbp = check_cdb(L, 1);
+  struct lcdb_db *db = (struct lcdb_db*)cdbp;
+  const char *key = luaL_checklstring(L, 2, &klen);
+  lua_Number limit = opt_number(L, 3, "limit", -1);
+  lua_Number offset = opt_number(L, 3, "offset", 0);
+  unsigned long long t0 = db->trace ? now_ns() : 0;
+  unsigned skip = offset > 0 ? (offset < 0xffffffffu ? (unsigned)offset : 0xffffffffu) : 0;
+  unsigned left = limit >= 0 ? (limit < 0xffffffffu ? (unsigned)limit : 0xffffffffu) : 0xffffffffu;
+
+  struct cdb_find cdbf;
+  if (cdb_findinit(&cdbf, cdbp, key, klen) < 0)
+    return luaL_error(L, LCDB_DB": error in find_all. Database corrupt?");
+
+  /* a page of a known size: allocate it at once */
+  lua_createtable(L, left < 1024 ? (int)left : 0, 0);
+  while(left && (ret = cdb_findnext(&cdbf))) {
+    if (ret < 0) { /* error */
+      return luaL_error(L, LCDB_DB": error in find_all. Database corrupt?");
+    }
+    if (skip) {
+      skip--;
+      continue;
+    }
+
+    push_get(L, cdbp, cdb_datalen(cdbp), cdb_datapos(cdbp));
+    lua_rawseti(L, -2, n);
+    n++;
+    left--;
+  }
+  if (db->trace)
+    trace_op(db, CDB_TRACE_FIND_ALL, key, klen, n - 1, t0);
+  return 1;
+}
+
+/* the state of a db:find_iter() iteration */
+struct lcdb_finditer {
+  struct cdb_find cdbf;		/* its key is the closure's upvalue 3 */
+  unsigned gen;			/* db->gen when it began */
+  int done;
+  const unsigned char *mem;	/* the file cdbf points into, if mapped */
+  unsigned htp, htab, htend;	/* and where, for a pool reopening it */
+};
+
+/* note where the table pointers of it->cdbf are in the file at mem */
+static void finditer_save(struct lcdb_finditer *it, const unsigned char *mem) {
+  const struct cdb_find *f = &it->cdbf;
+  it->mem = mem;
+  if (!mem) /* pread mode keeps file offsets already */
+    return;
+  it->htp = f->cdb_htp ? (unsigned)(f->cdb_htp - mem) : 0;
+  it->htab = f->cdb_htab ? (unsigned)(f->cdb_htab - mem) : 0;
+  it->htend = f->cdb_htab ? (unsigned)(f->cdb_htend - mem) : 0;
+}
+
+/* move them to the same places in the file now at mem */
+static void finditer_move(struct lcdb_finditer *it, const unsigned char *mem) {
+  struct cdb_find *f = &it->cdbf;
+  if (!mem || mem == it->mem)
+    return;
+  if (f->cdb_htp)
+    f->cdb_htp = mem + it->htp;
+  if (f->cdb_htab) {
+    f->cdb_htab = mem + it->htab;
+    f->cdb_htend = mem + it->htend;
+  }
+  it->mem = mem;
+}
+
+static int lcdbm_find_iternext(lua_State *L) {
+  struct lcdb_finditer *it = (struct lcdb_finditer*)lua_touserdata(L, lua_upvalueindex(2));
+  struct lcdb_db *db;
+  int ret;
+
+  if (it->done) {
+    lua_pushnil(L);
+    return 1;
+  }
+  db = check_iter(L, it->gen, "find_iter()");
+  finditer_move(it, db->cdb.cdb_mem);
+  ret = cdb_findnext(&it->cdbf);
+  finditer_save(it, db->cdb.cdb_mem);
+  if (ret < 0)
+    return luaL_error(L, LCDB_DB": error in find_iter. Database corrupt?");
+  if (ret == 0) {
+    it->done = 1;
+    lua_pushnil(L);
+    return 1;
+  }
+  push_get(L, &db->cdb, cdb_datalen(&db->cdb), cdb_datapos(&db->cdb));
+  return 1;
+}
+
+/* for value in db:find_iter(key) do ... end */
+static int lcdbm_find_iter(lua_State *L) {
+  size_t klen;
+  struct cdb *cdbp = check_cdb(L, 1);
+  const char *key = luaL_checklstring(L, 2, &klen);
+  struct lcdb_finditer *it;
+
+  lua_settop(L, 2);
+  it = (struct lcdb_finditer*)lua_newuserdata(L, sizeof(*it));
+  it->gen = ((struct lcdb_db*)cdbp)->gen;
+  it->done = 0;
+  if (cdb_findinit(&it->cdbf, cdbp, key, klen) < 0)
+    return luaL_error(L, LCDB_DB": error in find_iter. Database corrupt?");
+  finditer_save(it, cdbp->cdb_mem);
+  lua_insert(L, 2);
+  lua_pushcclosure(L, lcdbm_find_iternext, 3);
+  return 1;
+}
+  
+/* find the first value of the key at index k; return 0 if there is none */
+static int find_value(lua_State *L, struct cdb *cdbp, int k) {
+  size_t klen;
+  const char *key = luaL_checklstring(L, k, &klen);
+  int ret = cdb_find(cdbp, key, klen);
+  if (ret < 0)
+    return luaL_error(L, LCDB_DB": error in find. Database corrupt?");
+  return ret;
+}
+
+/* db:prefetch(keys) or db:prefetch(key, ...): start reading in the
+ * background what looking up these keys will need */
+static int lcdbm_prefetch(lua_State *L) {
+  struct cdb *cdbp = check_cdb(L, 1);
+  int i, n, t = lua_istable(L, 2);
+  int found = 0;
+  size_t klen;
+  const char *key;
+
+  n = t ? (int)lua_objlen(L, 2) : lua_gettop(L) - 1;
+  for (i = 1; i <= n; i++) {
+    /* a number is converted on the stack, not in the table: keep the
+     * copy pushed until the key is used */
+    if (t) {
+      lua_rawgeti(L, 2, i);
+      key = lua_tolstring(L, -1, &klen);
+    }
+    else
+      key = lua_tolstring(L, i + 1, &klen);
+    if (!key)
+      return luaL_error(L, "key %d is not a string", i);
+    if (cdb_prefetch(cdbp, key, klen) > 0)
+      found++;
+    if (t)
+      lua_pop(L, 1);
+  }
+  lua_pushinteger(L, found);
+  return 1;
+}
+
+/* queue the lookup of key for the helper threads and push its cdb.pending */
+static void push_request(lua_State *L, struct lcdb_db *db,
+                         const char *key, size_t klen) {
+  struct lcdb_req **rp = (struct lcdb_req**)lua_newuserdata(L, sizeof(*rp));
+  struct lcdb_req *req = (struct lcdb_req*)malloc(sizeof(*req) + klen);
+  int err;
+
+  *rp = NULL;
+  luaL_getmetatable(L, LCDB_PENDING);
+  lua_setmetatable(L, -2);
+  if (!req)
+    luaL_error(L, LCDB_DB": %s", strerror(ENOMEM));
+  req->next = NULL;
+  req->db = db;
+  req->done = req->orphan = 0;
+  req->klen = (unsigned)klen;
+  memcpy(req->key, key, klen);
+
+  pthread_mutex_lock(&pool.mu);
+  if (pool_start() < 0) {
+    err = errno;
+    pthread_mutex_unlock(&pool.mu);
+    free(req);
+    luaL_error(L, LCDB_DB": cannot start helper threads: %s", strerror(err));
+  }
+  if (pool.tail)
+    pool.tail->next = req;
+  else
+    pool.head = req;
+  pool.tail = req;
+  db->inflight++;
+  *rp = req;
+  pthread_cond_signal(&pool.work);
+  pthread_mutex_unlock(&pool.mu);
+}
+
+/* db:get_nowait(key): true and what db:get(key) returns if that needs no
+ * page to be read from disk, else false and a cdb.pending while helper
+ * threads read the pages in */
+static int lcdbm_get_nowait(lua_State *L) {
+  size_t klen;
+  int ret;
+  struct cdb *cdbp = check_cdb(L, 1);
+  struct lcdb_db *db = (struct lcdb_db*)cdbp;
+  const char *key = luaL_checklstring(L, 2, &klen);
+
+  lua_pushboolean(L, 1);
+  if (db->max_entries && cache_get(L, db, 2))
+    return 2;
+  /* a pread mode lookup cannot tell, and blocks */
+  ret = db->bcsize ? cdb_find(cdbp, key, klen) : cdb_find_nowait(cdbp, key, klen);
+  if (ret < 0 && errno == EAGAIN) {
+    lua_pop(L, 1);
+    lua_pushboolean(L, 0);
+    push_request(L, db, key, klen);
+    return 2;
+  }
+  if (ret < 0)
+    return luaL_error(L, LCDB_DB": error in find. Database corrupt?");
+  if (ret == 0) {
+    lua_pushnil(L);
+    return 2;
+  }
+  push_get(L, cdbp, cdb_datalen(cdbp), cdb_datapos(cdbp));
+  if (db->max_entries)
+    cache_put(L, db, 2, cdb_datalen(cdbp));
+  return 2;
+}
+
+/* db:get_async(key), in Lua so that it can yield */
+static const char get_async[] =
+  "local get_nowait, yield, running = ...\n"
+  "return function(db, key)\n"
+  "  local done, v = get_nowait(db, key)\n"
+  "  while not done do\n"
+  "    if running and running() then yield(v) else v:wait() end\n"
+  "    done, v = get_nowait(db, key)\n"
+  "  end\n"
+  "  return v\n"
+  "end\n";
+
+static struct lcdb_req *check_pending(lua_State *L) {
+  return *(struct lcdb_req**)luaL_checkudata(L, 1, LCDB_PENDING);
+}
+
+/* pending:ready() */
+static int lcdbp_ready(lua_State *L) {
+  struct lcdb_req *req = check_pending(L);
+  int done = 1;
+  if (req) {
+    pthread_mutex_lock(&pool.mu);
+    done = req->done;
+    pthread_mutex_unlock(&pool.mu);
+  }
+  lua_pushboolean(L, done);
+  return 1;
+}
+
+/* pending:wait() */
+static int lcdbp_wait(lua_State *L) {
+  struct lcdb_req *req = check_pending(L);
+  if (req) {
+    pthread_mutex_lock(&pool.mu);
+    while (!req->done)
+      pthread_cond_wait(&pool.done, &pool.mu);
+    pthread_mutex_unlock(&pool.mu);
+  }
+  return 0;
+}
+
+/* pending:__gc() */
+static int lcdbp_gc(lua_State *L) {
+  struct lcdb_req **rp = (struct lcdb_req**)luaL_checkudata(L, 1, LCDB_PENDING);
+  if (*rp) {
+    pthread_mutex_lock(&pool.mu);
+    if ((*rp)->done)
+      free(*rp);
+    else
+      (*rp)->orphan = 1;
+    pthread_mutex_unlock(&pool.mu);
+    *rp = NULL;
+  }
+  return 0;
+}
+
+/* cdb.async_fd(): a descriptor that becomes readable when a request
+ * completes, for event loops; read and discard what it holds */
+static int lcdb_async_fd(lua_State *L) {
+  pthread_mutex_lock(&pool.mu);
+  if (pool_start() < 0) {
+    pthread_mutex_unlock(&pool.mu);
+    return push_errno(L, errno);
+  }
+  pthread_mutex_unlock(&pool.mu);
+  lua_pushinteger(L, pool.pipe[0]);
+  return 1;
+}
+
+/* db:trace(filename, [options]) starts recording the lookups of db,
+ * db:trace() stops */
+static int lcdbm_trace(lua_State *L) {
+  struct lcdb_db *db = (struct lcdb_db*)check_cdb(L, 1);
+  unsigned long long written, dropped;
+  const char *filename;
+  lua_Number ring_kb;
+  int fd;
+
+  if (lua_isnoneornil(L, 2) || (lua_isboolean(L, 2) && !lua_toboolean(L, 2))) {
+    if (!db->trace)
+      return luaL_error(L, LCDB_DB": not tracing");
+    if (trace_stop(db, &written, &dropped) < 0)
+      return push_errno(L, errno);
+    lua_pushnumber(L, (lua_Number)written);
+    lua_pushnumber(L, (lua_Number)dropped);
+    return 2;
+  }
+  filename = luaL_checkstring(L, 2);
+  ring_kb = opt_number(L, 3, "ring_kb", 1024);
+  luaL_argcheck(L, ring_kb >= 4 && ring_kb <= 1048576, 3,
+                "ring_kb must be between 4 and 1048576");
+  if (db->trace)
+    return luaL_error(L, LCDB_DB": already tracing");
+  fd = open(filename, O_WRONLY|O_CREAT|O_TRUNC|O_BINARY, 0666);
+  if (fd < 0)
+    return push_errno(L, errno);
+  if (!(db->trace = cdb_trace_start(fd, (unsigned)(ring_kb * 1024)))) {
+    int xerrno = errno;
+    close(fd);
+    return push_errno(L, xerrno);
+  }
+  db->trace_fd = fd;
+  lua_pushboolean(L, 1);
+  return 1;
+}
+
+/* db:value_len(key) */
+static int lcdbm_value_len(lua_State *L) {
+  struct cdb *cdbp = check_cdb(L, 1);
+  if (find_value(L, cdbp, 2))
+    lua_pushnumber(L, cdb_datalen(cdbp));
+  else
+    lua_pushnil(L);
+  return 1;
+}
+
+/* db:has(key) */
+static int lcdbm_has(lua_State *L) {
+  struct cdb *cdbp = check_cdb(L, 1);
+  lua_pushboolean(L, find_value(L, cdbp, 2));
+  return 1;
+}
+
+/* db:count(key): the number of values of key */
+static int lcdbm_count(lua_State *L) {
+  size_t klen;
+  int ret, n = 0;
+  struct cdb *cdbp = check_cdb(L, 1);
+  const char *key = luaL_checklstring(L, 2, &klen);
+  struct cdb_find cdbf;
+
+  if (cdb_findinit(&cdbf, cdbp, key, klen) < 0)
+    return luaL_error(L, LCDB_DB": error in count. Database corrupt?");
+  while ((ret = cdb_findnext(&cdbf)) > 0)
+    n++;
+  if (ret < 0)
+    return luaL_error(L, LCDB_DB": error in count. Database corrupt?");
+  lua_pushinteger(L, n);
+  return 1;
+}
+
+/* compare the first len bytes of the value found with s */
+static int value_is(lua_State *L, struct cdb *cdbp, const char *s, size_t len) {
+  char buf[LUAL_BUFFERSIZE];
+  unsigned pos = cdb_datapos(cdbp), n;
+  const void *p;
+  if (cdbp->cdb_bc) {
+    /* a piece at a time, as push_get() does */
+    for (; len; len -= n, pos += n, s += n) {
+      n = len < sizeof(buf) ? (unsigned)len : sizeof(buf);
+      if (cdb_read(cdbp, buf, n, pos) < 0)
+        return luaL_error(L, LCDB_DB": read error: %s", strerror(errno));
+      if (memcmp(buf, s, n) != 0)
+        return 0;
+    }
+    return 1;
+  }
+  p = len ? cdb_get(cdbp, (unsigned)len, pos) : s;
+  if (!p)
+    return luaL_error(L, LCDB_DB": read error: %s", strerror(errno));
+  return memcmp(p, s, len) == 0;
+}
+
+/* db:equals(key, value): whether the first value of key is value */
+static int lcdbm_equals(lua_State *L) {
+  size_t len;
+  struct cdb *cdbp = check_cdb(L, 1);
+  const char *s = luaL_checklstring(L, 3, &len);
+  lua_pushboolean(L, find_value(L, cdbp, 2) && cdb_datalen(cdbp) == len &&
+                     value_is(L, cdbp, s, len));
+  return 1;
+}
+
+/* db:starts_with(key, prefix): whether the first value of key does */
+static int lcdbm_starts_with(lua_State *L) {
+  size_t len;
+  struct cdb *cdbp = check_cdb(L, 1);
+  const char *s = luaL_checklstring(L, 3, &len);
+  lua_pushboolean(L, find_value(L, cdbp, 2) && cdb_datalen(cdbp) >= len &&
+                     value_is(L, cdbp, s, len));
+  return 1;
+}
+
+/* db:get_int(key) and db:get_number(key): the first value of key, an
+ * 8 byte value written by maker:add_int() or maker:add_number() */
+static int get_typed(lua_State *L, int is_double) {
+  struct cdb *cdbp = check_cdb(L, 1);
+  const unsigned char *p;
+  unsigned long long u;
+  double d;
+
+  if (!find_value(L, cdbp, 2)) {
+    lua_pushnil(L);
+    return 1;
+  }
+  if (cdb_datalen(cdbp) != 8)
+    return luaL_error(L, LCDB_DB": value of %s is %d bytes, not 8",
+                      lua_tostring(L, 2), (int)cdb_datalen(cdbp));
+  if (!(p = (const unsigned char*)cdb_get(cdbp, 8, cdb_datapos(cdbp))))
+    return luaL_error(L, LCDB_DB": read error: %s", strerror(errno));
+  u = cdb_unpack64(p);
+  if (is_double) {
+    memcpy(&d, &u, sizeof(d));
+    lua_pushnumber(L, d);
+  }
+  else
+    lua_pushnumber(L, (lua_Number)(long long)u);
+  return 1;
+}
+
+static int lcdbm_get_int(lua_State *L) {
+  return get_typed(L, 0);
+}
+
+static int lcdbm_get_number(lua_State *L) {
+  return get_typed(L, 1);
+}
+
+/* db:read(key, [offset], [len]): len bytes of the value from offset,
+ * counted from 0, without copying the rest of it */
+static int lcdbm_read(lua_State *L) {
+  struct cdb *cdbp = check_cdb(L, 1);
+  lua_Number off = luaL_optnumber(L, 3, 0);
+  lua_Number len = luaL_optnumber(L, 4, -1);
+  unsigned vlen;
+
+  luaL_argcheck(L, off >= 0, 3, "offset must not be negative");
+  if (!find_value(L, cdbp, 2)) {
+    lua_pushnil(L);
+    return 1;
+  }
+  vlen = cdb_datalen(cdbp);
+  if (off > vlen)
+    off = vlen;
+  if (len < 0 || len > vlen - off)
+    len = vlen - off;
+  push_get(L, cdbp, (unsigned)len, cdb_datapos(cdbp) + (unsigned)off);
+  return 1;
+}
+
+static int lcdbm_chunknext(lua_State *L) {
+  struct lcdb_db *db;
+  unsigned pos = lua_tointeger(L, lua_upvalueindex(2));
+  unsigned left = lua_tointeger(L, lua_upvalueindex(3));
+  unsigned size = lua_tointeger(L, lua_upvalueindex(4));
+
+  if (!left) {
+    lua_pushnil(L);
+    return 1;
+  }
+  db = check_iter(L, lua_tointeger(L, lua_upvalueindex(5)), "chunks()");
+  if (size > left)
+    size = left;
+  push_get(L, &db->cdb, size, pos);
+  lua_pushinteger(L, pos + size);
+  lua_replace(L, lua_upvalueindex(2));
+  lua_pushinteger(L, left - size);
+  lua_replace(L, lua_upvalueindex(3));
+  return 1;
+}
+
+/* for chunk in db:chunks(key, [size]) do ... end */
+static int lcdbm_chunks(lua_State *L) {
+  struct cdb *cdbp = check_cdb(L, 1);
+  lua_Number size = luaL_optnumber(L, 3, 65536);
+  int found;
+
+  luaL_argcheck(L, size >= 1, 3, "chunk size must be positive");
+  found = find_value(L, cdbp, 2);
+  lua_settop(L, 1);
+  /* a missing key gives an iterator over nothing */
+  lua_pushinteger(L, found ? cdb_datapos(cdbp) : 0);
+  lua_pushinteger(L, found ? cdb_datalen(cdbp) : 0);
+  lua_pushinteger(L, size < 0x40000000 ? (unsigned)size : 0x40000000);
+  lua_pushinteger(L, ((struct lcdb_db*)cdbp)->gen);
+  lua_pushcclosure(L, lcdbm_chunknext, 5);
+  return 1;
+}
+
+static int lcdbm_iternext(lua_State *L) {
+  /* positions are only good in the file the iteration began in */
+  struct lcdb_db *db = check_iter(L, lua_tointeger(L, lua_upvalueindex(3)), "pairs()");
+  struct cdb *cdbp = &db->cdb;
+  unsigned pos = lua_tointeger(L, lua_upvalueindex(2));
+  unsigned long long t0 = db->trace ? now_ns() : 0;
+  int ret;
+
+  ret = cdb_seqnext(&pos, cdbp);
+  lua_pushinteger(L, pos);
+  lua_replace(L, lua_upvalueindex(2));
+  if (ret > 0) {
+    push_get(L, cdbp, cdb_keylen(cdbp), cdb_keypos(cdbp));
+    push_get(L, cdbp, cdb_datalen(cdbp), cdb_datapos(cdbp));
+    if (db->trace) {
+      size_t klen;
+      const char *key = lua_tolstring(L, -2, &klen);
+      trace_op(db, CDB_TRACE_SEQ, key, klen, 1, t0);
+    }
+    return 2;
+  } else if (ret == 0) { /* finished */
+    lua_pushnil(L);
+    return 1;
+  } else { /* error */
+    return luaL_error(L, LCDB_DB": error in iterator. Database corrupt?");
+  }
+}
+
+/* for k, v in db:pairs() do ... end */
+static int lcdbm_pairs(lua_State *L) {
+  struct cdb *cdbp = check_cdb(L, 1);
+
+  unsigned pos;
+  cdb_seqinit(&pos, cdbp);
+  lua_pushvalue(L, 1);
+  lua_pushinteger(L, pos);
+  lua_pushinteger(L, ((struct lcdb_db*)cdbp)->gen);
+  lua_pushcclosure(L, lcdbm_iternext, 3);
+  return 1;
+}
+
+static void set_number(lua_State *L, const char *name, lua_Number n) {
+  lua_pushnumber(L, n);
+  lua_setfield(L, -2, name);
+}
+
+static void set_array(lua_State *L, const char *name,
+                      const unsigned *a, int n) {
+  int i;
+  lua_createtable(L, n, 0);
+  for (i = 0; i < n; i++) {
+    lua_pushnumber(L, a[i]);
+    lua_rawseti(L, -2, i + 1);
+  }
+  lua_setfield(L, -2, name);
+}
+
+/* push a struct cdb_stat as a table; build statistics (full == 0) do not
+ * know about keys and sizes */
+static void push_stat(lua_State *L, const struct cdb_stat *st, int full) {
+  int t;
+  lua_newtable(L);
+  set_number(L, "records", st->records);
+  set_number(L, "indexed", st->indexed);
+  set_number(L, "slots", st->slots);
+  set_number(L, "load", st->slots ? (lua_Number)st->indexed / st->slots : 0);
+  set_number(L, "max_probe", st->maxprobe);
+  set_number(L, "mean_probe", st->meanprobe);
+  set_number(L, "max_miss", st->maxmiss);
+  set_number(L, "mean_miss", st->meanmiss);
+  set_array(L, "probes", st->probes, CDB_STAT_PROBES);
+  lua_createtable(L, 256, 0);
+  for (t = 0; t < 256; t++) {
+    lua_createtable(L, 0, 3);
+    set_number(L, "slots", st->tslots[t]);
+    set_number(L, "used", st->tused[t]);
+    set_number(L, "load", st->tslots[t] ?
+               (lua_Number)st->tused[t] / st->tslots[t] : 0);
+    lua_rawseti(L, -2, t + 1);
+  }
+  lua_setfield(L, -2, "tables");
+  if (full) {
+    set_number(L, "keys", st->keys);
+    set_number(L, "duplicate_keys", st->dupkeys);
+    set_number(L, "dead_records", st->dead);
+    set_number(L, "dead_bytes", st->deadbytes);
+    set_number(L, "shared_values", st->shared);
+    set_number(L, "key_bytes", (lua_Number)st->keybytes);
+    set_number(L, "value_bytes", (lua_Number)st->valbytes);
+    set_array(L, "key_sizes", st->ksizes, CDB_STAT_SIZES);
+    set_array(L, "value_sizes", st->vsizes, CDB_STAT_SIZES);
+  }
+}
+
+/* db:cache_stats() */
+static int lcdbm_cache_stats(lua_State *L) {
+  struct lcdb_db *db = (struct lcdb_db*)check_cdb(L, 1);
+  unsigned long long bhits, bmisses;
+  lua_createtable(L, 0, 9);
+  if (cdb_bcache_stat(&db->cdb, &bhits, &bmisses) == 0) {
+    set_number(L, "block_hits", (lua_Number)bhits);
+    set_number(L, "block_misses", (lua_Number)bmisses);
+  }
+  set_number(L, "hits", db->hits);
+  set_number(L, "misses", db->misses);
+  set_number(L, "evictions", db->evictions);
+  set_number(L, "entries", db->entries);
+  set_number(L, "bytes", db->bytes);
+  set_number(L, "max_entries", db->max_entries);
+  set_number(L, "max_bytes", db->max_bytes);
+  return 1;
+}
+
+/* db:info(): what the file says about itself, and counts if it has them */
+static int lcdbm_info(lua_State *L) {
+  struct cdb *cdbp = check_cdb(L, 1);
+  struct cdb_info info;
+  int r = cdb_info(cdbp, &info);
+  if (r < 0)
+    return push_errno(L, errno);
+  lua_createtable(L, 0, 9);
+  set_number(L, "size", cdbp->cdb_fsize);
+  lua_pushstring(L, (cdbp->cdb_flags & CDB_F_MPH) ? "mph" : "probe");
+  lua_setfield(L, -2, "index");
+  lua_pushboolean(L, (cdbp->cdb_flags & CDB_F_DEDUP) != 0);
+  lua_setfield(L, -2, "dedup");
+  if (r) {
+    set_number(L, "records", info.records);
+    set_number(L, "keys", info.keys);
+    set_number(L, "key_bytes", (lua_Number)info.keybytes);
+    set_number(L, "value_bytes", (lua_Number)info.valbytes);
+    if (!(cdbp->cdb_flags & CDB_F_MPH)) {
+      lua_pushstring(L, (info.mflags & CDB_MAKE_ROBINHOOD) ?
+                     "robinhood" : "linear");
+      lua_setfield(L, -2, "placement");
+      set_number(L, "load", info.hslots ? 256.0 / info.hslots : 0);
+    }
+  }
+  return 1;
+}
+
+/* db:load_all(): a table of every key and its first value */
+static int lcdbm_load_all(lua_State *L) {
+  struct cdb *cdbp = check_cdb(L, 1);
+  struct cdb_info info;
+  struct cdb_result res;
+  const unsigned char *toc;
+  unsigned pos, n = 0, t;
+  int r, unique;
 
+  if ((r = cdb_info(cdbp, &info)) < 0)
+    return push_errno(L, errno);
+  if (r)
+    n = info.keys;
+  else if (!(cdbp->cdb_flags & CDB_F_MPH) &&
+           (toc = (const unsigned char*)cdb_get(cdbp, 2048, 0)) != NULL)
+    for (t = 0; t < 256; t++) /* older files: tables are half full */
+      n += cdb_unpack(toc + (t << 3) + 4) >> 1;
+  unique = r && info.keys == info.records;
+  lua_createtable(L, 0, n < 0x7fffffff ? (int)n : 0);
 
-#include "cdb.h"
+  cdb_seqinit(&pos, cdbp);
+  while ((r = cdb_seqnext_r(&pos, cdbp, &res)) > 0) {
+    push_get(L, cdbp, res.cdb_klen, res.cdb_kpos);
+    if (!unique) { /* the first record of a key is the one get() finds */
+      lua_pushvalue(L, -1);
+      lua_rawget(L, -3);
+      if (!lua_isnil(L, -1)) {
+        lua_pop(L, 2);
+        continue;
+      }
+      lua_pop(L, 1);
+    }
+    push_get(L, cdbp, res.cdb_vlen, res.cdb_vpos);
+    lua_rawset(L, -3);
+  }
+  if (r < 0)
+    return luaL_error(L, LCDB_DB": error in load_all. Database corrupt?");
+  return 1;
+}
 
-#define LCDB_DB "cdb.db"
-#define LCDB_MAKE "cdb.make"
+/* cdb.shard(key, n): 1-based shard a key goes to */
+static int lcdb_shard(lua_State *L) {
+  size_t klen;
+  const char *key = luaL_checklstring(L, 1, &klen);
+  int n = luaL_checkint(L, 2);
+  luaL_argcheck(L, n > 0, 2, "number of shards must be positive");
+  lua_pushinteger(L, cdb_shard(cdb_hash(key, klen), n) + 1);
+  return 1;
+}
 
-static struct cdb *new_cdb(lua_State *L) {
-  struct cdb *cdbp = (struct cdb*)lua_newuserdata(L, sizeof(struct cdb));
-  luaL_getmetatable(L, LCDB_DB);
-  lua_setmetatable(L, -2);
-  return cdbp;
+/* push the shard filenames listed in a manifest file as a table: one
+ * per line, relative to the manifest's directory, '#' starts a comment */
+static int read_manifest(lua_State *L, const char *manifest) {
+  const char *slash = strrchr(manifest, '/');
+  char line[4096];
+  int n = 0;
+  FILE *f = fopen(manifest, "r");
+  if (!f)
+    return -1;
+  lua_newtable(L);
+  while (fgets(line, sizeof(line), f)) {
+    size_t len = strcspn(line, "#\r\n");
+    while (len && (line[len - 1] == ' ' || line[len - 1] == '\t'))
+      --len;
+    if (!len)
+      continue;
+    lua_pushlstring(L, manifest, line[0] != '/' && slash ?
+                    (size_t)(slash - manifest + 1) : 0);
+    lua_pushlstring(L, line, len);
+    lua_concat(L, 2);
+    lua_rawseti(L, -2, ++n);
+  }
+  if (ferror(f)) {
+    int xerrno = errno;
+    fclose(f);
+    lua_pop(L, 1);
+    return errno = xerrno, -1;
+  }
+  fclose(f);
+  return 0;
 }
 
-static struct cdb *check_cdb(lua_State *L, int n) {
-  struct cdb *cdbp = (struct cdb*)luaL_checkudata(L, n, LCDB_DB);
-  luaL_argcheck(L, cdbp->cdb_fd >= 0, n, "attempted to use a closed cdb");
-  return cdbp;
+/* cdb.pool([options]) */
+static int lcdb_pool(lua_State *L) {
+  lua_Number max_open = opt_number(L, 1, "max_open", 256);
+  lua_Number max_mapped = opt_number(L, 1, "max_mapped_bytes", 0);
+  struct lcdb_pool **pp;
+
+  luaL_argcheck(L, max_open >= 1, 1, "max_open must be at least 1");
+  luaL_argcheck(L, max_mapped >= 0, 1, "max_mapped_bytes must not be negative");
+  pp = (struct lcdb_pool**)lua_newuserdata(L, sizeof(*pp));
+  *pp = NULL;
+  luaL_getmetatable(L, LCDB_POOL);
+  lua_setmetatable(L, -2);
+  if (!(*pp = (struct lcdb_pool*)calloc(1, sizeof(**pp))))
+    return push_errno(L, ENOMEM);
+  (*pp)->refs = 1;
+  (*pp)->max_open = max_open < 0x7fffffff ? (unsigned)max_open : 0x7fffffff;
+  (*pp)->max_mapped = max_mapped >= 1 && max_mapped < 1.8e19 ?
+                      (unsigned long long)max_mapped : ~0ull;
+  /* the handles, by filename, as long as they are in use elsewhere */
+  lua_newtable(L);
+  lua_createtable(L, 0, 1);
+  lua_pushliteral(L, "v");
+  lua_setfield(L, -2, "__mode");
+  lua_setmetatable(L, -2);
+  lua_setfenv(L, -2);
+  return 1;
 }
 
-static int push_errno(lua_State *L, int xerrno) {
-  lua_pushnil(L);
-  lua_pushstring(L, strerror(xerrno));
-  return 2;
+static struct lcdb_pool *check_pool(lua_State *L, int n) {
+  struct lcdb_pool **pp = (struct lcdb_pool**)luaL_checkudata(L, n, LCDB_POOL);
+  luaL_argcheck(L, *pp != NULL, n, "invalid cdb.pool");
+  return *pp;
 }
 
-/* cdb.open(filename) */
-static int lcdb_open(lua_State *L) {
-  struct cdb *cdbp;
-  const char *filename = luaL_checkstring(L, 1);
-  int ret;
+/* pool:get(filename) */
+static int lcdbpool_get(lua_State *L) {
+  struct lcdb_pool *hp = check_pool(L, 1);
+  const char *filename = luaL_checkstring(L, 2);
+  struct lcdb_db *db;
+  struct lcdb_opts o;
 
-  int fd = open(filename, O_RDONLY | O_BINARY);
-  if (fd < 0)
-    return push_errno(L, errno);
+  check_open(L, 3, &o);
+  lua_settop(L, 3);
+  lua_getfenv(L, 1);
+  lua_pushvalue(L, 2);
+  lua_rawget(L, 4);
+  if (!lua_isnil(L, -1)) {
+    check_cdb(L, 5); /* reopened if need be, and now the most recent */
+    return 1;
+  }
+  lua_pop(L, 1);
 
-  cdbp = new_cdb(L);
-  ret = cdb_init(cdbp, fd);
-  if (ret < 0) {
+  db = (struct lcdb_db*)new_cdb(L);
+  db->bcsize = o.bcsize; /* kept for its reopens */
+  db->load = o.load;
+  if (hpool_open(hp, db, filename) < 0) {
+    if (errno != EPROTO)
+      return push_errno(L, errno);
     lua_pushnil(L);
-    lua_pushfstring(L, LCDB_DB": file %s is not a valid database (or mmap failed)", filename);
+    lua_pushfstring(L, LCDB_DB": file %s is not a valid database", filename);
     return 2;
   }
+  db->hpool = hp;
+  hp->refs++;
+  hp->handles++;
+  /* the filename to reopen, and the pool kept alive with its handle */
+  lua_createtable(L, 0, 2);
+  lua_pushvalue(L, 2);
+  lua_setfield(L, -2, "filename");
+  lua_pushvalue(L, 1);
+  lua_setfield(L, -2, "pool");
+  lua_setfenv(L, -2);
+  lua_pushvalue(L, 2);
+  lua_pushvalue(L, -2);
+  lua_rawset(L, 4);
+  if (open_cache(L, db, o.entries, o.bytes) < 0)
+    return push_errno(L, ENOMEM);
   return 1;
 }
 
-/* db:close() */
-static int lcdbm_gc(lua_State *L) {
-  struct cdb *cdbp = (struct cdb*)luaL_checkudata(L, 1, LCDB_DB);
-  if (cdbp->cdb_fd >= 0) {
-    close(cdbp->cdb_fd);
-    cdb_free(cdbp);
-    cdbp->cdb_fd = -1;
+/* pool:stats() */
+static int lcdbpool_stats(lua_State *L) {
+  struct lcdb_pool *hp = check_pool(L, 1);
+  lua_createtable(L, 0, 5);
+  set_number(L, "handles", hp->handles);
+  set_number(L, "open", hp->nopen);
+  set_number(L, "mapped_bytes", (lua_Number)hp->mapped);
+  set_number(L, "opens", hp->opens);
+  set_number(L, "evictions", hp->evictions);
+  return 1;
+}
+
+static int lcdbpool_gc(lua_State *L) {
+  struct lcdb_pool **pp = (struct lcdb_pool**)luaL_checkudata(L, 1, LCDB_POOL);
+  if (*pp)
+    hpool_unref(*pp);
+  *pp = NULL;
+  return 0;
+}
+
+/* cdb.open_sharded(manifest or {filenames}) */
+static int lcdb_open_sharded(lua_State *L) {
+  struct lcdb_sharded *sh;
+  int i, n;
+
+  if (lua_istable(L, 1))
+    lua_pushvalue(L, 1);
+  else if (read_manifest(L, luaL_checkstring(L, 1)) < 0)
+    return push_errno(L, errno);
+  n = lua_objlen(L, -1);
+  if (n < 1) {
+    lua_pushnil(L);
+    lua_pushliteral(L, LCDB_SHARDED": no shards given");
+    return 2;
+  }
+
+  sh = (struct lcdb_sharded*)lua_newuserdata(L, sizeof(*sh) +
+                                             (n - 1) * sizeof(sh->shards[0]));
+  sh->n = 0;
+  luaL_getmetatable(L, LCDB_SHARDED);
+  lua_setmetatable(L, -2);
+  lua_createtable(L, n, 0);
+  for (i = 1; i <= n; i++) {
+    lua_pushcfunction(L, lcdb_open);
+    lua_rawgeti(L, -4, i);
+    lua_call(L, 1, 2);
+    if (lua_isnil(L, -2))
+      return 2;
+    lua_pop(L, 1);
+    sh->shards[i - 1] = (struct cdb*)lua_touserdata(L, -1);
+    lua_rawseti(L, -2, i);
   }
+  lua_setfenv(L, -2);
+  sh->n = n;
+  return 1;
+}
+
+static struct lcdb_sharded *check_sharded(lua_State *L, int n) {
+  struct lcdb_sharded *sh = (struct lcdb_sharded*)luaL_checkudata(L, n, LCDB_SHARDED);
+  luaL_argcheck(L, sh->n > 0, n, "attempted to use a closed cdb");
+  return sh;
+}
+
+/* shard of a key and its hash value */
+static struct cdb *route(struct lcdb_sharded *sh, const char *key,
+                         size_t klen, unsigned *hval) {
+  *hval = cdb_hash(key, klen);
+  return sh->shards[cdb_shard(*hval, sh->n)];
+}
+
+/* sharded:close() */
+static int lcdbsh_close(lua_State *L) {
+  struct lcdb_sharded *sh = (struct lcdb_sharded*)luaL_checkudata(L, 1, LCDB_SHARDED);
+  unsigned i;
+  for (i = 0; i < sh->n; i++)
+    if (sh->shards[i]->cdb_fd >= 0) {
+      close(sh->shards[i]->cdb_fd);
+      cdb_free(sh->shards[i]);
+      sh->shards[i]->cdb_fd = -1;
+    }
+  sh->n = 0;
   return 0;
 }
 
-/* db:__tostring() */
-static int lcdbm_tostring(lua_State *L) {
-  struct cdb *cdbp = (struct cdb*)luaL_checkudata(L, 1, LCDB_DB);
-  if (cdbp->cdb_fd >= 0)
-    lua_pushfstring(L, "<"LCDB_DB"> (%p)", cdbp);
+/* sharded:__tostring() */
+static int lcdbsh_tostring(lua_State *L) {
+  struct lcdb_sharded *sh = (struct lcdb_sharded*)luaL_checkudata(L, 1, LCDB_SHARDED);
+  if (sh->n)
+    lua_pushfstring(L, "<"LCDB_SHARDED"> (%p, %d shards)", sh, (int)sh->n);
   else
-    lua_pushfstring(L, "<"LCDB_DB"> (closed)");
+    lua_pushfstring(L, "<"LCDB_SHARDED"> (closed)");
   return 1;
 }
 
-/* db:get(key) */
-static int lcdbm_get(lua_State *L) {
+/* sharded:get(key) */
+static int lcdbsh_get(lua_State *L) {
   size_t klen;
+  unsigned hval;
   int ret;
-  struct cdb *cdbp = check_cdb(L, 1);
+  struct lcdb_sharded *sh = check_sharded(L, 1);
   const char *key = luaL_checklstring(L, 2, &klen);
+  struct cdb *cdbp = route(sh, key, klen, &hval);
 
-  ret = cdb_find(cdbp, key, klen);
+  ret = cdb_findh(cdbp, key, klen, hval);
   if (ret > 0) {
     lua_pushlstring(L, cdb_getdata(cdbp), cdb_datalen(cdbp));
     return 1;
@@ -94,25 +1729,28 @@ static int lcdbm_get(lua_State *L) {
     lua_pushnil(L);
     return 1;
   } else {
-    return luaL_error(L, LCDB_DB": error in find. Database corrupt?");
+    return luaL_error(L, LCDB_SHARDED": error in find. Database corrupt?");
   }
 }
 
-/* db:find_all(key) */
-static int lcdbm_find_all(lua_State *L) {
+/* sharded:find_all(key) */
+static int lcdbsh_find_all(lua_State *L) {
   size_t klen;
+  unsigned hval;
   int ret;
   int n = 1;
-  struct cdb *cdbp = check_cdb(L, 1);
+  struct lcdb_sharded *sh = check_sharded(L, 1);
   const char *key = luaL_checklstring(L, 2, &klen);
+  struct cdb *cdbp = route(sh, key, klen, &hval);
 
   struct cdb_find cdbf;
-  cdb_findinit(&cdbf, cdbp, key, klen);
+  if (cdb_findinith(&cdbf, cdbp, key, klen, hval) < 0)
+    return luaL_error(L, LCDB_SHARDED": error in find_all. Database corrupt?");
 
   lua_newtable(L);
   while((ret = cdb_findnext(&cdbf))) {
     if (ret < 0) { /* error */
-      return luaL_error(L, LCDB_DB": error in find_all. Database corrupt?");
+      return luaL_error(L, LCDB_SHARDED": error in find_all. Database corrupt?");
     }
 
     lua_pushlstring(L, cdb_getdata(cdbp), cdb_datalen(cdbp));
@@ -121,34 +1759,80 @@ static int lcdbm_find_all(lua_State *L) {
   }
   return 1;
 }
-  
-static int lcdbm_iternext(lua_State *L) {
-  struct cdb *cdbp = (struct cdb*)lua_touserdata(L, lua_upvalueindex(1));
-  unsigned pos = lua_tointeger(L, lua_upvalueindex(2));
 
-  int ret = cdb_seqnext(&pos, cdbp);
-  lua_pushinteger(L, pos);
-  lua_replace(L, lua_upvalueindex(2));
-  if (ret > 0) {
-    lua_pushlstring(L, cdb_getkey(cdbp), cdb_keylen(cdbp));
-    lua_pushlstring(L, cdb_getdata(cdbp), cdb_datalen(cdbp));
-    return 2;
-  } else if (ret == 0) { /* finished */
-    lua_pushnil(L);
-    return 1;
-  } else { /* error */
-    return luaL_error(L, LCDB_DB": error in iterator. Database corrupt?");
+static int lcdbsh_iternext(lua_State *L) {
+  struct lcdb_sharded *sh = (struct lcdb_sharded*)lua_touserdata(L, lua_upvalueindex(1));
+  unsigned i = lua_tointeger(L, lua_upvalueindex(2));
+  unsigned pos = lua_tointeger(L, lua_upvalueindex(3)); /* 0: shard start */
+  struct cdb *cdbp;
+  int ret;
+
+  luaL_argcheck(L, sh->n > 0, 1, "attempted to use a closed cdb");
+  for (;;) {
+    if (i >= sh->n) { /* finished */
+      lua_pushnil(L);
+      return 1;
+    }
+    cdbp = sh->shards[i];
+    if (!pos)
+      cdb_seqinit(&pos, cdbp);
+    ret = cdb_seqnext(&pos, cdbp);
+    if (ret > 0)
+      break;
+    if (ret < 0)
+      return luaL_error(L, LCDB_SHARDED": error in iterator. Database corrupt?");
+    /* on to the next shard */
+    lua_pushinteger(L, ++i);
+    lua_replace(L, lua_upvalueindex(2));
+    pos = 0;
   }
+  lua_pushinteger(L, pos);
+  lua_replace(L, lua_upvalueindex(3));
+  lua_pushlstring(L, cdb_getkey(cdbp), cdb_keylen(cdbp));
+  lua_pushlstring(L, cdb_getdata(cdbp), cdb_datalen(cdbp));
+  return 2;
 }
 
-/* for k, v in db:pairs() do ... end */
-static int lcdbm_pairs(lua_State *L) {
-  struct cdb *cdbp = check_cdb(L, 1);
+/* for k, v in sharded:pairs() do ... end, one shard after another */
+static int lcdbsh_pairs(lua_State *L) {
+  check_sharded(L, 1);
+  lua_settop(L, 1);
+  lua_pushinteger(L, 0);
+  lua_pushinteger(L, 0);
+  lua_pushcclosure(L, lcdbsh_iternext, 3);
+  return 1;
+}
 
-  unsigned pos;
-  cdb_seqinit(&pos, cdbp);
-  lua_pushinteger(L, pos);
-  lua_pushcclosure(L, lcdbm_iternext, 2);
+/* cdb.analyze(filename or db) */
+static int lcdb_analyze(lua_State *L) {
+  struct cdb_stat st;
+  struct cdb cdb, *cdbp = &cdb;
+  int ret, fd = -1;
+
+  if (lua_isuserdata(L, 1))
+    cdbp = check_cdb(L, 1);
+  else {
+    const char *filename = luaL_checkstring(L, 1);
+    fd = open(filename, O_RDONLY | O_BINARY);
+    if (fd < 0)
+      return push_errno(L, errno);
+    if (cdb_init(cdbp, fd) < 0) {
+      int xerrno = errno;
+      close(fd);
+      return push_errno(L, xerrno);
+    }
+  }
+
+  ret = cdb_analyze(cdbp, &st);
+  if (fd >= 0) {
+    int xerrno = errno;
+    cdb_free(cdbp);
+    close(fd);
+    errno = xerrno;
+  }
+  if (ret < 0)
+    return push_errno(L, errno);
+  push_stat(L, &st, 1);
   return 1;
 }
 
@@ -157,30 +1841,121 @@ static struct cdb_make *new_cdb_make(lua_State *L) {
   luaL_getmetatable(L, LCDB_MAKE);
   lua_setmetatable(L, -2);
   lua_newtable(L);
-  lua_setfenv(L, 1);
+  lua_setfenv(L, -2);
   return cdbmp;
 }
 
+/* whether a maker is still building, into a file or into memory */
+#define make_isopen(cdbmp) ((cdbmp)->cdb_fd >= 0 || (cdbmp)->cdb_mbuf)
+
 static struct cdb_make *check_cdb_make(lua_State *L, int n) {
   struct cdb_make *cdbmp = luaL_checkudata(L, n, LCDB_MAKE);
-  luaL_argcheck(L, cdbmp->cdb_fd >= 0, n, "attempted to use a closed cdb_make");
+  luaL_argcheck(L, make_isopen(cdbmp), n, "attempted to use a closed cdb_make");
   return cdbmp;
 }
 
-/* cdb.make(destination, temporary) */
+/* the layout options of cdb.make() and cdb.make_buffer() */
+struct lcdb_layout {
+  int mph, dedup, robinhood;
+  lua_Number load;
+};
+
+/* read them from the options at index n, before anything is pushed */
+static void check_layout(lua_State *L, int n, struct lcdb_layout *lo) {
+  static const char *const indexes[] = { "probe", "mph", NULL };
+  static const char *const placements[] = { "linear", "robinhood", NULL };
+  lo->mph = opt_option(L, n, "index", "probe", indexes);
+  lo->dedup = opt_boolean(L, n, "dedup", 0);
+  lo->robinhood = opt_option(L, n, "placement", "linear", placements);
+  lo->load = opt_number(L, n, "load", 0.5);
+  if (!(lo->load > 0 && lo->load <= 1))
+    luaL_error(L, "load must be above 0 and at most 1");
+}
+
+static void set_layout(struct cdb_make *cdbmp, const struct lcdb_layout *lo) {
+  if (lo->mph)
+    cdbmp->cdb_mflags |= CDB_MAKE_MPH;
+  if (lo->dedup)
+    cdbmp->cdb_mflags |= CDB_MAKE_DEDUP;
+  if (lo->robinhood)
+    cdbmp->cdb_mflags |= CDB_MAKE_ROBINHOOD;
+  /* at least 256 slots per 256 records, and not so many they overflow */
+  cdbmp->cdb_hslots = lo->load < 1.0 / 65536 ? 0x1000000u :
+                      (unsigned)(256 / lo->load);
+}
+
+/* release the descriptors, or the memory, of a maker that is finished
+ * or abandoned */
+static void close_make(struct cdb_make *cdbmp) {
+  if (cdbmp->cdb_spillfd >= 0) {
+    close(cdbmp->cdb_spillfd);
+    cdbmp->cdb_spillfd = -1;
+  }
+  if (cdbmp->cdb_mgrow)
+    free(cdbmp->cdb_mbuf);
+  cdbmp->cdb_mbuf = NULL;
+  cdbmp->cdb_fd = -1;
+}
+
+/* cdb.make(destination, temporary, [options]) */
 static int lcdb_make(lua_State *L) {
   int fd;
   int ret;
   struct cdb_make *cdbmp;
+  struct lcdb_layout lo;
   const char *dest = luaL_checkstring(L, 1);
   const char *tmpname = luaL_checkstring(L, 2);
+  lua_Number maxmem = opt_number(L, 3, "memory_limit", 0);
+  lua_Number wbmb = opt_number(L, 3, "writeback_mb", 0);
+  lua_Number ratemb = opt_number(L, 3, "max_write_mb", 0);
+  int dontneed = opt_boolean(L, 3, "drop_behind", 0);
+  int spillfd = -1;
+
+  check_layout(L, 3, &lo);
+  if (wbmb < 0 || wbmb >= 4096 || ratemb < 0 || ratemb >= 4096)
+    return luaL_error(L, "writeback_mb and max_write_mb must be below 4096");
+  if ((dontneed || ratemb > 0) && !(wbmb > 0))
+    wbmb = 8; /* these work a chunk at a time */
+
+  if (maxmem > 0) {
+    /* the spill file only lives as long as its descriptor */
+    const char *spillname = lua_pushfstring(L, "%s.spill", tmpname);
+    spillfd = open(spillname, O_RDWR|O_CREAT|O_EXCL|O_BINARY, 0600);
+    if (spillfd < 0)
+      return push_errno(L, errno);
+    unlink(spillname);
+    lua_pop(L, 1);
+  }
 
   fd = open(tmpname, O_RDWR|O_CREAT|O_EXCL|O_BINARY, 0666);
-  if (fd < 0)
-    return push_errno(L, errno);
+  if (fd < 0) {
+    int xerrno = errno;
+    if (spillfd >= 0)
+      close(spillfd);
+    return push_errno(L, xerrno);
+  }
 
   cdbmp = new_cdb_make(L);
   ret = cdb_make_start(cdbmp, fd);
+  set_layout(cdbmp, &lo);
+  cdbmp->cdb_spillfd = spillfd;
+  if (spillfd >= 0 && ret == 0)
+    ret = cdb_make_spill(cdbmp, spillfd,
+                         maxmem < 0xffffffffu ? (unsigned)maxmem : 0xffffffffu);
+  if (wbmb > 0 && ret == 0)
+    ret = cdb_make_writeback(cdbmp, (unsigned)(wbmb * 1048576),
+                             dontneed ? CDB_WB_DONTNEED : 0,
+                             (unsigned)(ratemb * 1048576));
+
+  if (ret < 0) {
+    /* nothing was written yet: leave no file behind */
+    int xerrno = errno;
+    cdb_make_free(cdbmp);
+    close(fd);
+    close_make(cdbmp);
+    unlink(tmpname);
+    return push_errno(L, xerrno);
+  }
 
   /* store destination and tmpname in userdata environment */
   lua_getfenv(L, -1);
@@ -189,19 +1964,35 @@ static int lcdb_make(lua_State *L) {
   lua_pushstring(L, tmpname);
   lua_setfield(L, -2, "tmpname");
   lua_pop(L, 1); /* pop the environment */
+  return 1;
+}
+
+/* cdb.make_buffer([options]): built in memory, see maker:finish() */
+static int lcdb_make_buffer(lua_State *L) {
+  struct cdb_make *cdbmp;
+  int ret;
+  struct lcdb_layout lo;
+  lua_Number size = opt_number(L, 1, "size", 0);
 
+  check_layout(L, 1, &lo);
+  luaL_argcheck(L, size >= 0 && size < 4294967296.0, 1, "size out of range");
+  cdbmp = new_cdb_make(L);
+  ret = cdb_make_start_mem(cdbmp, NULL, (unsigned)size);
+  cdbmp->cdb_spillfd = -1;
   if (ret < 0)
     return push_errno(L, errno);
+  set_layout(cdbmp, &lo);
   return 1;
 }
 
 static int lcdbmakem_gc(lua_State *L) {
   struct cdb_make *cdbmp = luaL_checkudata(L, 1, LCDB_MAKE);
 
-  if (cdbmp->cdb_fd >= 0) {
-    close(cdbmp->cdb_fd);
+  if (make_isopen(cdbmp)) {
+    if (cdbmp->cdb_fd >= 0)
+      close(cdbmp->cdb_fd);
     cdb_make_free(cdbmp);
-    cdbmp->cdb_fd = -1;
+    close_make(cdbmp);
   }
   return 0;
 }
@@ -210,22 +2001,30 @@ static int lcdbmakem_gc(lua_State *L) {
 static int lcdbmakem_tostring(lua_State *L) {
   struct cdb_make *cdbmp = luaL_checkudata(L, 1, LCDB_MAKE);
 
-  if (cdbmp->cdb_fd >= 0)
+  if (make_isopen(cdbmp))
     lua_pushfstring(L, "<"LCDB_MAKE"> (%p)", cdbmp);
   else
     lua_pushfstring(L, "<"LCDB_MAKE"> (closed)");
   return 1;
 }
 
+/* the put mode named by the option at index n */
+static enum cdb_put_mode check_put_mode(lua_State *L, int n) {
+  static const char *const opts[] = { "add", "replace", "replace0", "insert", NULL };
+  static const enum cdb_put_mode modes[] = {
+    CDB_PUT_ADD, CDB_PUT_REPLACE, CDB_PUT_REPLACE0, CDB_PUT_INSERT
+  };
+  /* by default, add unconditionally */
+  return modes[luaL_checkoption(L, n, "add", opts)];
+}
+
 /* maker:add(key, value, [mode]) */
 static int lcdbmakem_add(lua_State *L) {
-  static const char *const opts[] = { "add", "replace", "replace0", "insert", NULL };
   size_t klen, vlen;
   struct cdb_make *cdbmp = check_cdb_make(L, 1);
   const char *key = luaL_checklstring(L, 2, &klen);
   const char *value = luaL_checklstring(L, 3, &vlen);
-  /* by default, add unconditionally */
-  int mode = luaL_checkoption(L, 4, "add", opts);
+  enum cdb_put_mode mode = check_put_mode(L, 4);
 
   int ret = cdb_make_put(cdbmp, key, klen, value, vlen, mode);
   if (ret < 0)
@@ -233,43 +2032,442 @@ static int lcdbmakem_add(lua_State *L) {
   return 0;
 }
 
-/* maker:finish() */
+/* maker:add_int(key, n, [mode]) and maker:add_number(key, x, [mode]):
+ * add n as an 8 byte little-endian integer or x as an 8 byte double */
+static int add_typed(lua_State *L, int is_double) {
+  size_t klen;
+  struct cdb_make *cdbmp = check_cdb_make(L, 1);
+  const char *key = luaL_checklstring(L, 2, &klen);
+  lua_Number n = luaL_checknumber(L, 3);
+  enum cdb_put_mode mode = check_put_mode(L, 4);
+  unsigned char buf[8];
+  unsigned long long u;
+  double d = n;
+
+  if (is_double)
+    memcpy(&u, &d, sizeof(u));
+  else {
+    luaL_argcheck(L, n >= -9223372036854775808.0 && n < 9223372036854775808.0 &&
+                     (lua_Number)(long long)n == n, 3, "not an integer");
+    u = (unsigned long long)(long long)n;
+  }
+  cdb_pack64(u, buf);
+  if (cdb_make_put(cdbmp, key, klen, buf, 8, mode) < 0)
+    return luaL_error(L, strerror(errno));
+  return 0;
+}
+
+static int lcdbmakem_add_int(lua_State *L) {
+  return add_typed(L, 0);
+}
+
+static int lcdbmakem_add_number(lua_State *L) {
+  return add_typed(L, 1);
+}
+
+/* maker:merge(shard): shard is an unfinished maker, which is consumed
+ * and its temporary file, if any, removed, a db, or the filename of a db */
+static int lcdbmakem_merge(lua_State *L) {
+  struct cdb_make *cdbmp = check_cdb_make(L, 1);
+  struct cdb cdb, *cdbp = &cdb;
+  int ret, fd = -1;
+
+  if (is_udata(L, 2, LCDB_MAKE)) {
+    struct cdb_make *shard = check_cdb_make(L, 2);
+    ret = cdb_make_append(cdbmp, shard);
+    if (ret < 0)
+      return luaL_error(L, strerror(errno));
+    lua_getfenv(L, 2);
+    lua_getfield(L, -1, "tmpname");
+    if (lua_isstring(L, -1))
+      unlink(lua_tostring(L, -1));
+    lua_pop(L, 2);
+    if (cdb_fileno(shard) >= 0)
+      close(cdb_fileno(shard));
+    cdb_make_free(shard);
+    close_make(shard);
+    return 0;
+  }
+  if (lua_isuserdata(L, 2))
+    cdbp = check_cdb(L, 2);
+  else {
+    const char *filename = luaL_checkstring(L, 2);
+    fd = open(filename, O_RDONLY | O_BINARY);
+    if (fd < 0 || cdb_init(cdbp, fd) < 0) {
+      int xerrno = errno;
+      if (fd >= 0)
+        close(fd);
+      return luaL_error(L, "%s: %s", filename, strerror(xerrno));
+    }
+  }
+
+  ret = cdb_make_merge(cdbmp, cdbp);
+  if (fd >= 0) {
+    int xerrno = errno;
+    cdb_free(cdbp);
+    close(fd);
+    errno = xerrno;
+  }
+  if (ret < 0)
+    return luaL_error(L, strerror(errno));
+  return 0;
+}
+
+/* maker:finish(): true, or the database for cdb.make_buffer(), then
+ * the stats */
 static int lcdbmakem_finish(lua_State *L) {
   struct cdb_make *cdbmp = check_cdb_make(L, 1);
   /* retrieve destination, current filename */
-  lua_getfenv(L, -1);
+  lua_getfenv(L, 1);
   lua_getfield(L, -1, "dest");
   const char *dest = lua_tostring(L, -1);
   lua_getfield(L, -2, "tmpname");
   const char *tmpname = lua_tostring(L, -1);
+  struct cdb_stat st;
   lua_pop(L, 3);
 
-  if (cdb_make_finish(cdbmp) < 0 || fsync(cdb_fileno(cdbmp)) < 0 || 
-      close(cdb_fileno(cdbmp)) < 0 || rename(tmpname, dest) < 0) {
-    cdb_make_free(cdbmp); /* in case cdb_make_finish failed before freeing */
-    cdbmp->cdb_fd = -1;
-    return luaL_error(L, strerror(errno));
+  cdbmp->cdb_statp = &st;
+  if (cdbmp->cdb_mbuf) {
+    if (cdb_make_finish(cdbmp) < 0) {
+      int xerrno = errno;
+      close_make(cdbmp);
+      return luaL_error(L, strerror(xerrno));
+    }
+    lua_pushlstring(L, (const char*)cdbmp->cdb_mbuf, cdbmp->cdb_mlen);
+    close_make(cdbmp);
+    push_stat(L, &st, 0);
+    return 2;
+  }
+  if (cdb_make_finish(cdbmp) < 0 || fsync(cdb_fileno(cdbmp)) < 0) {
+    int xerrno = errno;
+    close(cdb_fileno(cdbmp));
+    close_make(cdbmp);
+    return luaL_error(L, strerror(xerrno));
+  }
+  if (close(cdb_fileno(cdbmp)) < 0 || rename(tmpname, dest) < 0) {
+    int xerrno = errno;
+    close_make(cdbmp);
+    return luaL_error(L, strerror(xerrno));
   }
 
-  cdbmp->cdb_fd = -1;
+  close_make(cdbmp);
   lua_pushboolean(L, 1);
-  return 1;
+  push_stat(L, &st, 0);
+  if (cdbmp->cdb_spillmax)
+    set_number(L, "memory_peak", (lua_Number)cdbmp->cdb_spillpeak);
+  return 2;
+}
+
+/* how often a key of a trace was used, and when first */
+struct lcdb_tkey {
+  unsigned count;
+  unsigned first;
+};
+
+static int cmp_tkey(const void *a, const void *b) {
+  const struct lcdb_tkey *ka = (const struct lcdb_tkey*)a;
+  const struct lcdb_tkey *kb = (const struct lcdb_tkey*)b;
+  if (ka->count != kb->count)
+    return ka->count > kb->count ? -1 : 1;
+  return ka->first < kb->first ? -1 : ka->first > kb->first;
+}
+
+/* push an array of the distinct keys of the trace at index t, an array
+ * of keys or the name of a file, most used first.  The file is either
+ * one written by db:trace(), whose lookups of a key are used, or text
+ * with one key per line */
+static void push_trace_keys(lua_State *L, int t) {
+  struct lcdb_tkey *tk;
+  const char *p, *end, *nl;
+  size_t len;
+  unsigned i, n = 0, klen;
+  int counts, uniq, binary = 0;
+
+  if (lua_type(L, t) == LUA_TSTRING) {
+    const char *filename = lua_tostring(L, t);
+    luaL_Buffer b;
+    FILE *f = fopen(filename, "rb");
+    if (!f)
+      luaL_error(L, "%s: %s", filename, strerror(errno));
+    luaL_buffinit(L, &b);
+    while ((len = fread(luaL_prepbuffer(&b), 1, LUAL_BUFFERSIZE, f)) > 0)
+      luaL_addsize(&b, len);
+    fclose(f);
+    luaL_pushresult(&b);
+  }
+  else {
+    luaL_checktype(L, t, LUA_TTABLE);
+    lua_pushnil(L);
+  }
+  lua_newtable(L);
+  counts = lua_gettop(L);
+  lua_newtable(L);
+  uniq = lua_gettop(L);
+
+  /* count the uses of each key, on the stack top */
+  for (i = 1, p = end = NULL; ; i++) {
+    if (lua_isnil(L, counts - 1)) {
+      lua_rawgeti(L, t, i);
+      if (lua_isnil(L, -1)) {
+        lua_pop(L, 1);
+        break;
+      }
+      if (lua_type(L, -1) != LUA_TSTRING)
+        luaL_error(L, "trace key %d is not a string", i);
+    }
+    else {
+      if (!p) {
+        p = lua_tolstring(L, counts - 1, &len);
+        end = p + len;
+        if (len >= 8 && memcmp(p, CDB_TRACE_MAGIC, 4) == 0) {
+          if (cdb_unpack((const unsigned char*)p + 4) != CDB_TRACE_VERSION)
+            luaL_error(L, "unsupported trace version");
+          binary = 1;
+          p += 8;
+        }
+      }
+      if (binary) {
+        unsigned char op;
+        /* a record cut short ends the trace, as in cdb-replay */
+        if (end - p < CDB_TRACE_HDR ||
+            (klen = cdb_unpack((const unsigned char*)p + 10)) >
+              (size_t)(end - p - CDB_TRACE_HDR))
+          break;
+        op = (unsigned char)*p;
+        p += CDB_TRACE_HDR + klen;
+        /* steps of a scan name no key */
+        if (!klen || (op != CDB_TRACE_GET && op != CDB_TRACE_FIND_ALL))
+          continue;
+        lua_pushlstring(L, p - klen, klen);
+      }
+      else {
+        if (p >= end)
+          break;
+        if (!(nl = (const char*)memchr(p, '\n', end - p)))
+          nl = end;
+        if (nl == p) {
+          p++;
+          continue;
+        }
+        lua_pushlstring(L, p, nl - p);
+        p = nl + 1;
+      }
+    }
+    lua_pushvalue(L, -1);
+    lua_rawget(L, counts);
+    if (lua_isnil(L, -1)) {
+      lua_pushvalue(L, -2);
+      lua_rawseti(L, uniq, ++n);
+    }
+    lua_pushnumber(L, lua_tonumber(L, -1) + 1);
+    lua_remove(L, -2);
+    lua_rawset(L, counts);
+  }
+
+  /* order them */
+  tk = (struct lcdb_tkey*)lua_newuserdata(L, (n + 1) * sizeof(*tk));
+  for (i = 0; i < n; i++) {
+    lua_rawgeti(L, uniq, i + 1);
+    lua_rawget(L, counts);
+    tk[i].count = (unsigned)lua_tonumber(L, -1);
+    tk[i].first = i + 1;
+    lua_pop(L, 1);
+  }
+  qsort(tk, n, sizeof(*tk), cmp_tkey);
+  lua_createtable(L, n, 0);
+  for (i = 0; i < n; i++) {
+    lua_rawgeti(L, uniq, tk[i].first);
+    lua_rawseti(L, -2, i + 1);
+  }
+  lua_replace(L, counts - 1);
+  lua_settop(L, counts - 1);
+}
+
+/* the positions of the records of the keys in the array on the stack
+ * top, in a userdata pushed above it; -1 and errno on error */
+static int find_hot(lua_State *L, struct cdb *cdbp, unsigned **hotp) {
+  unsigned *hot = NULL, nhot = 0, max = 0;
+  int i, ret, keys = lua_gettop(L);
+  struct cdb_find cdbf;
+  size_t klen;
+  const char *key;
+
+  lua_pushnil(L);
+  for (i = 1; ; i++) {
+    lua_rawgeti(L, keys, i);
+    if (!(key = lua_tolstring(L, -1, &klen)))
+      break;
+    lua_pop(L, 1);
+    if (cdb_findinit(&cdbf, cdbp, key, klen) < 0)
+      return -1;
+    while ((ret = cdb_findnext(&cdbf)) > 0) {
+      if (nhot == max) {
+        unsigned *grown;
+        max = max ? max << 1 : 1024;
+        grown = (unsigned*)lua_newuserdata(L, max * sizeof(*hot));
+        if (nhot)
+          memcpy(grown, hot, nhot * sizeof(*hot));
+        lua_replace(L, keys + 1);
+        hot = grown;
+      }
+      hot[nhot++] = cdb_keypos(cdbp) - 8;
+    }
+    if (ret < 0)
+      return -1;
+  }
+  lua_pop(L, 1);
+  *hotp = hot;
+  return (int)nhot;
+}
+
+/* cdb.optimize(src, destination, temporary, [options]) */
+static int lcdb_optimize(lua_State *L) {
+  static const char *const orders[] = { "hash", "trace", NULL };
+  int trace = opt_option(L, 4, "order", "hash", orders);
+  struct cdb cdb, *cdbp = &cdb;
+  struct cdb_make *cdbmp;
+  struct cdb_info info;
+  unsigned *hot = NULL;
+  int nhot = 0, ret, xerrno, fd = -1;
+
+  luaL_checkstring(L, 2);
+  luaL_checkstring(L, 3);
+  if (trace) {
+    luaL_argcheck(L, lua_istable(L, 4), 4, "order \"trace\" needs a trace");
+    lua_getfield(L, 4, "trace");
+    luaL_argcheck(L, !lua_isnil(L, -1), 4, "order \"trace\" needs a trace");
+    push_trace_keys(L, lua_gettop(L));
+  }
+
+  if (lua_isuserdata(L, 1))
+    cdbp = check_cdb(L, 1);
+  else {
+    const char *filename = luaL_checkstring(L, 1);
+    fd = open(filename, O_RDONLY | O_BINARY);
+    if (fd < 0)
+      return push_errno(L, errno);
+    if (cdb_init(cdbp, fd) < 0) {
+      xerrno = errno;
+      close(fd);
+      return push_errno(L, xerrno);
+    }
+  }
+  /* the copy is laid out like src: what it was built with, if it says */
+  if ((ret = cdb_info(cdbp, &info)) == 0) {
+    info.mflags = cdbp->cdb_flags & CDB_F_MPH ? CDB_MAKE_MPH : 0;
+    info.hslots = 0;
+  }
+  if (ret < 0 || (cdbp->cdb_flags & CDB_F_DEDUP) ||
+      (trace && (nhot = find_hot(L, cdbp, &hot)) < 0)) {
+    int dedup = ret >= 0 && (cdbp->cdb_flags & CDB_F_DEDUP);
+    xerrno = errno;
+    if (fd >= 0) {
+      cdb_free(cdbp);
+      close(fd);
+    }
+    if (dedup) { /* records would need their references rebased */
+      lua_pushnil(L);
+      lua_pushliteral(L, "cannot optimize a database with shared values");
+      return 2;
+    }
+    return push_errno(L, xerrno);
+  }
+
+  lua_pushcfunction(L, lcdb_make);
+  lua_pushvalue(L, 2);
+  lua_pushvalue(L, 3);
+  lua_call(L, 2, 2);
+  cdbmp = (struct cdb_make*)lua_touserdata(L, -2);
+  if (cdbmp) {
+    cdbmp->cdb_mflags = info.mflags & (CDB_MAKE_MPH | CDB_MAKE_ROBINHOOD);
+    cdbmp->cdb_hslots = info.hslots;
+  }
+  ret = cdbmp ? cdb_make_optimize(cdbmp, cdbp, hot, (unsigned)nhot) : -1;
+  xerrno = errno;
+  if (fd >= 0) {
+    cdb_free(cdbp);
+    close(fd);
+  }
+  if (!cdbmp)
+    return 2; /* nil and the error of cdb.make */
+  if (ret < 0) {
+    close(cdb_fileno(cdbmp));
+    cdb_make_free(cdbmp);
+    close_make(cdbmp);
+    unlink(lua_tostring(L, 3));
+    return push_errno(L, xerrno);
+  }
+
+  lua_pushcfunction(L, lcdbmakem_finish);
+  lua_pushvalue(L, -3);
+  lua_call(L, 1, 2);
+  return 2;
 }
 
 static const struct luaL_Reg lcdb_f [] = {
   {"open", lcdb_open},
+  {"open_string", lcdb_open_string},
   {"make", lcdb_make},
+  {"make_buffer", lcdb_make_buffer},
+  {"analyze", lcdb_analyze},
+  {"open_sharded", lcdb_open_sharded},
+  {"shard", lcdb_shard},
+  {"async_fd", lcdb_async_fd},
+  {"optimize", lcdb_optimize},
+  {"pool", lcdb_pool},
   {NULL, NULL}
 };
 
 static const struct luaL_Reg lcdb_m [] = {
   {"__gc", lcdbm_gc},
-  {"close", lcdbm_gc},
+  {"close", lcdbm_close},
   {"__tostring", lcdbm_tostring},
   {"find_all", lcdbm_find_all},
+  {"find_iter", lcdbm_find_iter},
   {"get", lcdbm_get},
   {"pairs", lcdbm_pairs},
   {"iter", lcdbm_pairs},
+  {"load_all", lcdbm_load_all},
+  {"info", lcdbm_info},
+  {"reload", lcdbm_reload},
+  {"cache_stats", lcdbm_cache_stats},
+  {"read", lcdbm_read},
+  {"value_len", lcdbm_value_len},
+  {"len", lcdbm_value_len},
+  {"has", lcdbm_has},
+  {"count", lcdbm_count},
+  {"equals", lcdbm_equals},
+  {"starts_with", lcdbm_starts_with},
+  {"get_int", lcdbm_get_int},
+  {"get_number", lcdbm_get_number},
+  {"chunks", lcdbm_chunks},
+  {"prefetch", lcdbm_prefetch},
+  {"get_nowait", lcdbm_get_nowait},
+  {"trace", lcdbm_trace},
+  {NULL, NULL}
+};
+
+static const struct luaL_Reg lcdbpending_m [] = {
+  {"__gc", lcdbp_gc},
+  {"ready", lcdbp_ready},
+  {"wait", lcdbp_wait},
+  {NULL, NULL}
+};
+
+static const struct luaL_Reg lcdbpool_m [] = {
+  {"__gc", lcdbpool_gc},
+  {"get", lcdbpool_get},
+  {"stats", lcdbpool_stats},
+  {NULL, NULL}
+};
+
+static const struct luaL_Reg lcdbsharded_m [] = {
+  {"close", lcdbsh_close},
+  {"__tostring", lcdbsh_tostring},
+  {"find_all", lcdbsh_find_all},
+  {"get", lcdbsh_get},
+  {"pairs", lcdbsh_pairs},
+  {"iter", lcdbsh_pairs},
   {NULL, NULL}
 };
 
@@ -277,6 +2475,9 @@ static const struct luaL_Reg lcdbmake_m [] = {
   {"__gc", lcdbmakem_gc},
   {"__tostring", lcdbmakem_tostring},
   {"add", lcdbmakem_add},
+  {"add_int", lcdbmakem_add_int},
+  {"add_number", lcdbmakem_add_number},
+  {"merge", lcdbmakem_merge},
   {"finish", lcdbmakem_finish},
   {NULL, NULL}
 };
@@ -286,6 +2487,37 @@ int luaopen_cdb(lua_State *L) {
   lua_pushvalue(L, -1);
   lua_setfield(L, -2, "__index");
   luaL_register(L, NULL, lcdb_m);
+  if (luaL_loadbuffer(L, get_async, sizeof(get_async) - 1, "=get_async"))
+    return lua_error(L);
+  lua_pushcfunction(L, lcdbm_get_nowait);
+  lua_getglobal(L, "coroutine");
+  if (lua_istable(L, -1)) {
+    lua_getfield(L, -1, "yield");
+    lua_getfield(L, -2, "running");
+    lua_remove(L, -3);
+  }
+  else {
+    lua_pushnil(L);
+  }
+  lua_call(L, 3, 1);
+  lua_setfield(L, -2, "get_async");
+
+  luaL_newmetatable(L, LCDB_PENDING);
+  lua_pushvalue(L, -1);
+  lua_setfield(L, -2, "__index");
+  luaL_register(L, NULL, lcdbpending_m);
+  lua_pop(L, 1);
+
+  luaL_newmetatable(L, LCDB_POOL);
+  lua_pushvalue(L, -1);
+  lua_setfield(L, -2, "__index");
+  luaL_register(L, NULL, lcdbpool_m);
+  lua_pop(L, 1);
+
+  luaL_newmetatable(L, LCDB_SHARDED);
+  lua_pushvalue(L, -1);
+  lua_setfield(L, -2, "__index");
+  luaL_register(L, NULL, lcdbsharded_m);
 
   luaL_newmetatable(L, LCDB_MAKE);
   lua_pushvalue(L, -1);
@@ -11,6 +11,21 @@ db:add("three", "3", "replace")
 db:add("three", "III")
 assert(db:finish())
 
+-- a copy of the db at src whose every hash table claims more slots than
+-- the file has room for
+local function corrupt_toc(src, dest)
+  local f = assert(io.open(src, "rb"))
+  local data = f:read("*a")
+  f:close()
+  local toc = {}
+  for i = 0, 255 do
+    toc[#toc + 1] = data:sub(i * 8 + 1, i * 8 + 4).."\255\255\255\0"
+  end
+  f = assert(io.open(dest, "wb"))
+  f:write(table.concat(toc), data:sub(2049))
+  f:close()
+end
+
 module("querying a cdb", lunit.testcase, package.seeall)
 do
   function setup()
@@ -46,3 +61,1647 @@ do
     assert_error(nil, function() db:get("one") end)
   end
 end
+
+local mph_name = "test_mph.cdb"
+local mph = assert(cdb.make(mph_name, mph_name..".tmp", { index = "mph" }))
+for i = 1, 2000 do
+  mph:add("key"..i, "value"..i)
+end
+mph:add("gone", "x")
+mph:add("gone", "y", "replace")
+assert(mph:finish())
+
+module("perfect hash index", lunit.testcase, package.seeall)
+do
+  function setup()
+    db = assert(cdb.open(mph_name))
+  end
+
+  function test_get()
+    for i = 1, 2000 do
+      assert_equal("value"..i, db:get("key"..i))
+    end
+    assert_equal("y", db:get("gone"))
+    assert_nil(db:get("key0"))
+    assert_nil(db:get(""))
+  end
+
+  function test_findall()
+    local t = db:find_all("key7")
+    assert_equal(1, #t)
+    assert_equal("value7", t[1])
+    assert_equal(0, #db:find_all("nope"))
+  end
+
+  function test_duplicate_keys()
+    local name = "test_mph_dup.cdb"
+    local maker = assert(cdb.make(name, name..".tmp", { index = "mph" }))
+    maker:add("a", "1")
+    maker:add("a", "2")
+    assert_error(nil, function() maker:finish() end)
+    -- the failed finish freed the maker once, and only once
+    assert_error(nil, function() maker:finish() end)
+    maker = nil
+    collectgarbage()
+    os.remove(name..".tmp")
+  end
+
+  function test_interleaved_makers()
+    local m1 = assert(cdb.make("test_mph_1.cdb", "test_mph_1.cdb.tmp",
+                               { index = "mph" }))
+    local m2 = assert(cdb.make("test_mph_2.cdb", "test_mph_2.cdb.tmp",
+                               { index = "mph" }))
+    m1:add("k", "1")
+    m2:add("k", "2")
+    assert(m2:finish())
+    assert(m1:finish())
+    for i = 1, 2 do
+      local db = assert(cdb.open("test_mph_"..i..".cdb"))
+      assert_equal(tostring(i), db:get("k"))
+      db:close()
+      os.remove("test_mph_"..i..".cdb")
+    end
+  end
+end
+
+module("statistics", lunit.testcase, package.seeall)
+do
+  function test_analyze()
+    local name = "test_analyze.cdb"
+    local maker = assert(cdb.make(name, name..".tmp"))
+    maker:add("one", "1")
+    maker:add("two", "2")
+    maker:add("two", "22")
+    maker:add("one", "I", "replace0")
+    maker:add("two", "x", "insert")
+    assert(maker:finish())
+    local st = assert(cdb.analyze(name))
+    os.remove(name)
+    assert_equal(4, st.records)
+    assert_equal(3, st.indexed)
+    assert_equal(2, st.keys)
+    assert_equal(1, st.duplicate_keys)
+    assert_equal(1, st.dead_records)
+    assert_equal(8 + 3 + 1, st.dead_bytes)
+    assert_equal(9, st.key_bytes)
+    assert_equal(4, st.value_bytes)
+    assert_equal(6, st.slots)
+    assert_equal(256, #st.tables)
+    assert_equal(2, st.value_sizes[2])
+    assert_equal(1, st.value_sizes[3])
+  end
+
+  function test_analyze_mph()
+    local st = assert(cdb.analyze(mph_name))
+    assert_equal(2001, st.indexed)
+    assert_equal(2001, st.keys)
+    assert_equal(0, st.max_probe)
+    assert_equal(1, st.load)
+  end
+
+  function test_finish_stats()
+    local name = "test_stats.cdb"
+    local maker = assert(cdb.make(name, name..".tmp"))
+    for i = 1, 100 do
+      maker:add("k"..i, "v")
+    end
+    local ok, st = maker:finish()
+    assert_true(ok)
+    assert_equal(100, st.records)
+    assert_equal(200, st.slots)
+    local n = 0
+    for _, c in ipairs(st.probes) do n = n + c end
+    assert_equal(100, n)
+    local a = assert(cdb.analyze(name))
+    assert_equal(st.max_probe, a.max_probe)
+    assert_equal(st.mean_probe, a.mean_probe)
+    os.remove(name)
+  end
+end
+
+module("bounded memory build", lunit.testcase, package.seeall)
+do
+  function test_spilled_build()
+    local name = "test_spill.cdb"
+    local maker = assert(cdb.make(name, name..".tmp", { memory_limit = 1 }))
+    for i = 1, 150000 do
+      maker:add("k"..(i % 50000), "v"..i)
+    end
+    assert_error(nil, function() maker:add("k1", "x", "insert") end)
+    local ok, st = maker:finish()
+    assert_true(ok)
+    assert_equal(150000, st.records)
+    local db = assert(cdb.open(name))
+    for _, i in ipairs{ 0, 1, 7, 49999 } do
+      local t = db:find_all("k"..i)
+      assert_equal(3, #t)
+      assert_equal("v"..(i == 0 and 50000 or i), t[1])
+      assert_equal("v"..(i == 0 and 150000 or i + 100000), t[3])
+    end
+    assert_nil(db:get("k50000"))
+    local a = assert(cdb.analyze(db))
+    assert_equal(150000, a.indexed)
+    assert_equal(50000, a.duplicate_keys)
+    assert_equal(st.max_probe, a.max_probe)
+    db:close()
+    os.remove(name)
+  end
+
+  function test_refused_options()
+    -- a perfect hash index cannot be spilled: no maker and no file
+    local name = "test_spill.cdb"
+    local ok, err = cdb.make(name, name..".tmp", { memory_limit = 1, index = "mph" })
+    assert_nil(ok)
+    assert_string(err)
+    assert_nil(io.open(name..".tmp"))
+    assert_nil(io.open(name..".tmp.spill"))
+  end
+
+  -- the low 8 bits of cdb_hash only depend on the low 8 bits so far
+  local function xor8(a, b)
+    local r, bit = 0, 1
+    for _ = 1, 8 do
+      if a % 2 ~= b % 2 then r = r + bit end
+      a, b, bit = math.floor(a / 2), math.floor(b / 2), bit * 2
+    end
+    return r
+  end
+
+  -- key i with a last byte that puts it in hash table 0
+  local function table0_key(i)
+    local k, h = "k"..i, 5381 % 256
+    for c = 1, #k do h = xor8(h * 33 % 256, k:byte(c)) end
+    return k..string.char(h * 33 % 256)
+  end
+
+  function test_skewed_table()
+    local name = "test_spill.cdb"
+    local maker = assert(cdb.make(name, name..".tmp",
+                                  { memory_limit = 1, load = 1 }))
+    for pass = 1, 2 do
+      for i = 1, 70000 do maker:add(table0_key(i), pass..":"..i) end
+    end
+    local ok, st = maker:finish()
+    assert_true(ok)
+    assert_equal(140000, st.records)
+    assert_equal(140000, st.tables[1].slots)
+    local db = assert(cdb.open(name))
+    for _, i in ipairs{ 1, 2, 777, 35000, 69999, 70000 } do
+      local t = db:find_all(table0_key(i))
+      assert_equal(2, #t)
+      assert_equal("1:"..i, t[1])
+      assert_equal("2:"..i, t[2])
+    end
+    assert_nil(db:get(table0_key(70001)))
+    local n = 0
+    for k, v in db:pairs() do n = n + 1 end
+    assert_equal(140000, n)
+    assert_equal(70000, db:info().keys)
+    local a = assert(cdb.analyze(db))
+    assert_equal(140000, a.indexed)
+    assert_equal(st.max_probe, a.max_probe)
+    assert_equal(st.mean_probe, a.mean_probe)
+    assert_equal(st.max_miss, a.max_miss)
+    db:close()
+    os.remove(name)
+  end
+  function test_memory_peak()
+    local name, limit = "test_spill.cdb", 2 * 1048576
+    local maker = assert(cdb.make(name, name..".tmp", { memory_limit = limit }))
+    for i = 1, 250000 do
+      maker:add("k"..i, "v")
+      if i <= 200000 then maker:add("dup", i) end
+    end
+    local ok, st = maker:finish()
+    assert_true(ok)
+    -- one key's records sharing a home are more than fit at once
+    assert_true(st.memory_peak <= limit)
+    assert_true(st.memory_peak > limit / 2)
+    local db = assert(cdb.open(name))
+    local t = db:find_all("dup")
+    assert_equal(200000, #t)
+    assert_equal("1", t[1])
+    assert_equal("100001", t[100001])
+    assert_equal("200000", t[200000])
+    assert_equal("v", db:get("k250000"))
+    assert_equal(250001, db:info().keys)
+    local a = assert(cdb.analyze(db))
+    assert_equal(450000, a.indexed)
+    assert_equal(250001, a.keys)
+    assert_equal(st.max_probe, a.max_probe)
+    db:close()
+    os.remove(name)
+  end
+end
+
+module("incremental writeback", lunit.testcase, package.seeall)
+do
+  function test_writeback_build()
+    local name = "test_wb.cdb"
+    local maker = assert(cdb.make(name, name..".tmp",
+      { writeback_mb = 1 / 64, drop_behind = true, max_write_mb = 64 }))
+    local big = ("x"):rep(1000)
+    for i = 1, 2000 do
+      maker:add("k"..i, i..big)
+    end
+    assert_true(maker:finish())
+    local db = assert(cdb.open(name))
+    for _, i in ipairs{ 1, 999, 2000 } do
+      assert_equal(i..big, db:get("k"..i))
+    end
+    db:close()
+    os.remove(name)
+  end
+
+  function test_writeback_options()
+    assert_error(nil, function()
+      cdb.make("test_wb.cdb", "test_wb.tmp", { drop_behind = 1 })
+    end)
+    assert_error(nil, function()
+      cdb.make("test_wb.cdb", "test_wb.tmp", { writeback_mb = 4096 })
+    end)
+  end
+end
+
+module("merging shards", lunit.testcase, package.seeall)
+do
+  function test_merge()
+    local name = "test_merged.cdb"
+    local s1 = assert(cdb.make("test_s1.cdb", "test_s1.cdb.tmp"))
+    local s2 = assert(cdb.make("test_s2.cdb", "test_s2.cdb.tmp", { index = "mph" }))
+    local s3 = assert(cdb.make("test_s3.cdb", "test_s3.cdb.tmp"))
+    for i = 1, 1000 do
+      s1:add("k"..i, "a"..i)
+      s2:add("m"..i, "b"..i)
+      s3:add("k"..i, "c"..i)
+    end
+    s1:add("k1", "a-new", "replace0")
+    assert(s1:finish())
+    assert(s2:finish())
+
+    local maker = assert(cdb.make(name, name..".tmp"))
+    maker:add("k1", "first")
+    maker:merge("test_s1.cdb")
+    local s2db = assert(cdb.open("test_s2.cdb"))
+    maker:merge(s2db)
+    s2db:close()
+    maker:merge(s3)
+    assert_error(nil, function() s3:add("x", "y") end)
+    assert_nil(io.open("test_s3.cdb.tmp"))
+    local ok, st = maker:finish()
+    assert_true(ok)
+    assert_equal(3001, st.records)
+
+    local db = assert(cdb.open(name))
+    assert_equal("first", db:get("k1"))
+    local t = db:find_all("k1")
+    assert_equal(3, #t)
+    assert_equal("a-new", t[2])
+    assert_equal("c1", t[3])
+    local t = db:find_all("k500")
+    assert_equal("a500", t[1])
+    assert_equal("c500", t[2])
+    assert_equal("b1000", db:get("m1000"))
+    local a = assert(cdb.analyze(db))
+    assert_equal(1, a.dead_records)
+    assert_equal(2000, a.keys)
+    db:close()
+    os.remove(name)
+    os.remove("test_s1.cdb")
+    os.remove("test_s2.cdb")
+  end
+end
+
+module("sharded reader", lunit.testcase, package.seeall)
+do
+  local nshards = 3
+  local names = {}
+
+  function setup()
+    local makers = {}
+    for i = 1, nshards do
+      names[i] = "test_shard"..i..".cdb"
+      makers[i] = assert(cdb.make(names[i], names[i]..".tmp",
+                                  { index = i == cdb.shard("dup", nshards) and "probe" or "mph" }))
+    end
+    for i = 1, 3000 do
+      local k = "k"..i
+      makers[cdb.shard(k, nshards)]:add(k, "v"..i)
+    end
+    makers[cdb.shard("dup", nshards)]:add("dup", "one")
+    makers[cdb.shard("dup", nshards)]:add("dup", "two")
+    for i = 1, nshards do
+      assert(makers[i]:finish())
+    end
+  end
+
+  function teardown()
+    for i = 1, nshards do
+      os.remove(names[i])
+    end
+    os.remove("test_shards.manifest")
+  end
+
+  function test_shard()
+    local seen = {}
+    for i = 1, 3000 do
+      local s = cdb.shard("k"..i, nshards)
+      assert_true(s >= 1 and s <= nshards)
+      seen[s] = (seen[s] or 0) + 1
+    end
+    for i = 1, nshards do
+      assert_true(seen[i] > 800)
+    end
+    assert_equal(1, cdb.shard("anything", 1))
+  end
+
+  function test_open_sharded()
+    local f = assert(io.open("test_shards.manifest", "w"))
+    f:write("# shards\n")
+    for i = 1, nshards do
+      f:write(names[i], "\n")
+    end
+    f:close()
+    for _, m in ipairs{ "test_shards.manifest", "./test_shards.manifest", names } do
+      local db = assert(cdb.open_sharded(m))
+      assert_equal("v1", db:get("k1"))
+      assert_equal("v3000", db:get("k3000"))
+      assert_nil(db:get("k3001"))
+      local t = db:find_all("dup")
+      assert_equal(2, #t)
+      assert_equal("one", t[1])
+      assert_equal("two", t[2])
+      assert_equal(0, #db:find_all("nope"))
+      local n = 0
+      for k, v in db:pairs() do
+        n = n + 1
+        assert_equal(k == "dup" and (v == "one" or v == "two") or
+                     "v"..k:sub(2) == v, true)
+      end
+      assert_equal(3002, n)
+      db:close()
+      assert_error(nil, function() db:get("k1") end)
+    end
+    assert_nil(cdb.open_sharded({}))
+    assert_nil(cdb.open_sharded({ names[1], "test_missing.cdb" }))
+  end
+
+  function test_pairs_extra_args()
+    local db = assert(cdb.open_sharded(names))
+    local n = 0
+    for k in db:pairs(5, "x") do n = n + 1 end
+    assert_equal(3002, n)
+    db:close()
+  end
+
+  function test_find_all_corrupt()
+    local parts = {}
+    for i = 1, nshards do parts[i] = names[i] end
+    parts[cdb.shard("dup", nshards)] = "test_corrupt.cdb"
+    corrupt_toc(names[cdb.shard("dup", nshards)], "test_corrupt.cdb")
+    local db = assert(cdb.open_sharded(parts))
+    assert_error(nil, function() db:find_all("dup") end)
+    db:close()
+    os.remove("test_corrupt.cdb")
+  end
+end
+
+module("hot key cache", lunit.testcase, package.seeall)
+do
+  local name = "test_cache.cdb"
+
+  local function build(suffix)
+    local maker = assert(cdb.make(name, name..".tmp"))
+    for i = 1, 100 do
+      maker:add("k"..i, string.rep("x", i)..suffix)
+    end
+    assert(maker:finish())
+  end
+
+  function setup()
+    build("")
+  end
+
+  function teardown()
+    os.remove(name)
+  end
+
+  function test_no_cache()
+    local db = assert(cdb.open(name))
+    assert_equal("x", db:get("k1"))
+    local st = db:cache_stats()
+    assert_equal(0, st.hits)
+    assert_equal(0, st.max_entries)
+    db:close()
+  end
+
+  function test_hits_and_eviction()
+    local db = assert(cdb.open(name, { cache_entries = 4 }))
+    for _ = 1, 3 do
+      assert_equal("x", db:get("k1"))
+    end
+    assert_nil(db:get("nope"))
+    local st = db:cache_stats()
+    assert_equal(2, st.hits)
+    assert_equal(2, st.misses)
+    assert_equal(1, st.entries)
+    for i = 2, 10 do
+      assert_equal(string.rep("x", i), db:get("k"..i))
+    end
+    st = db:cache_stats()
+    assert_equal(4, st.entries)
+    assert_equal(6, st.evictions)
+    -- k1 was hit, so it survived the first pass of the hand
+    assert_equal("x", db:get("k1"))
+    assert_equal(3, db:cache_stats().hits)
+    db:close()
+  end
+
+  function test_byte_limit()
+    local db = assert(cdb.open(name, { cache_entries = 100, cache_bytes = 50 }))
+    assert_equal(string.rep("x", 60), db:get("k60"))
+    assert_equal(0, db:cache_stats().entries)
+    for i = 1, 20 do
+      db:get("k"..i)
+      assert_true(db:cache_stats().bytes <= 50)
+    end
+    db:close()
+  end
+
+  function test_reload()
+    local db = assert(cdb.open(name, { cache_entries = 10 }))
+    assert_equal("xx", db:get("k2"))
+    assert_equal("xx", db:get("k2"))
+    build("!")
+    assert_true(db:reload())
+    assert_equal(0, db:cache_stats().entries)
+    assert_equal("xx!", db:get("k2"))
+    db:close()
+  end
+end
+
+module("ranged reads", lunit.testcase, package.seeall)
+do
+  local name = "test_ranged.cdb"
+  local big = {}
+  for i = 0, 9999 do big[#big + 1] = string.char(65 + i % 26) end
+  big = table.concat(big)
+
+  function setup()
+    local maker = assert(cdb.make(name, name..".tmp"))
+    maker:add("big", big)
+    maker:add("empty", "")
+    assert(maker:finish())
+  end
+
+  function teardown()
+    os.remove(name)
+  end
+
+  function test_value_len()
+    local db = assert(cdb.open(name))
+    assert_equal(10000, db:value_len("big"))
+    assert_equal(0, db:value_len("empty"))
+    assert_nil(db:value_len("nope"))
+    db:close()
+  end
+
+  function test_read()
+    local db = assert(cdb.open(name))
+    assert_equal("ABC", db:read("big", 0, 3))
+    assert_equal(big:sub(27, 30), db:read("big", 26, 4))
+    assert_equal(big:sub(9991), db:read("big", 9990))
+    assert_equal("", db:read("big", 20000, 5))
+    assert_equal(big, db:read("big"))
+    assert_equal("", db:read("empty", 0, 10))
+    assert_nil(db:read("nope", 0, 1))
+    assert_error(nil, function() db:read("big", -1, 1) end)
+    db:close()
+  end
+
+  function test_chunks()
+    local db = assert(cdb.open(name))
+    local parts = {}
+    for chunk in db:chunks("big", 4096) do
+      parts[#parts + 1] = chunk
+    end
+    assert_equal(3, #parts)
+    assert_equal(1808, #parts[3])
+    assert_equal(big, table.concat(parts))
+    for _ in db:chunks("nope") do
+      assert_true(false)
+    end
+    for _ in db:chunks("empty") do
+      assert_true(false)
+    end
+    local it = db:chunks("big", 10)
+    it()
+    assert_true(db:reload())
+    assert_error(nil, it)
+    db:close()
+  end
+end
+
+module("pread mode", lunit.testcase, package.seeall)
+do
+  local name = "test_pread.cdb"
+  local mph_pread = "test_pread_mph.cdb"
+
+  function setup()
+    local maker = assert(cdb.make(name, name..".tmp"))
+    local maker2 = assert(cdb.make(mph_pread, mph_pread..".tmp", { index = "mph" }))
+    for i = 1, 5000 do
+      local v = string.rep(string.char(97 + i % 26), i % 300)
+      maker:add("key"..i, v)
+      maker2:add("key"..i, v)
+    end
+    maker:add("key1", "second")
+    maker:add("big", string.rep("0123456789", 5000))
+    assert(maker:finish())
+    assert(maker2:finish())
+  end
+
+  function teardown()
+    os.remove(name)
+    os.remove(mph_pread)
+  end
+
+  function test_same_as_mmap()
+    for _, file in ipairs{ name, mph_pread } do
+      local m = assert(cdb.open(file))
+      -- a tiny cache, so that blocks are evicted all the time
+      local p = assert(cdb.open(file, { mode = "pread", cache_mb = 0.02 }))
+      for i = 1, 5000, 7 do
+        assert_equal(m:get("key"..i), p:get("key"..i))
+      end
+      assert_nil(p:get("nope"))
+      local n = 0
+      for k, v in p:pairs() do
+        n = n + 1
+        assert_equal(m:get(k), k == "key1" and p:find_all(k)[1] or v)
+      end
+      assert_equal(file == name and 5002 or 5000, n)
+      local st = p:cache_stats()
+      assert_true(st.block_misses > 0)
+      assert_true(st.block_hits > 0)
+      assert_nil(m:cache_stats().block_hits)
+      m:close()
+      p:close()
+    end
+  end
+
+  function test_read_paths()
+    local p = assert(cdb.open(name, { mode = "pread", cache_mb = 1 }))
+    local t = p:find_all("key1")
+    assert_equal(2, #t)
+    assert_equal("second", t[2])
+    assert_equal(50000, p:value_len("big"))
+    assert_equal("3456", p:read("big", 4003, 4))
+    assert_equal(string.rep("0123456789", 5000), p:get("big"))
+    local parts = {}
+    for c in p:chunks("big", 3000) do parts[#parts + 1] = c end
+    assert_equal(string.rep("0123456789", 5000), table.concat(parts))
+    assert_true(p:equals("big", string.rep("0123456789", 5000)))
+    assert_false(p:equals("big", string.rep("0123456789", 4999).."0123456780"))
+    assert_true(p:starts_with("big", string.rep("0123456789", 3000)))
+    assert_true(p:reload())
+    assert_equal("second", p:find_all("key1")[2])
+    assert_nil(cdb.analyze(p))
+    p:close()
+  end
+end
+
+module("prefetch", lunit.testcase, package.seeall)
+do
+  function test_prefetch()
+    for _, opts in ipairs{ {}, { mode = "pread" } } do
+      local db = assert(cdb.open(db_name, opts))
+      -- the database was just written, so its pages are resident
+      db:get("one")
+      assert_equal(2, db:prefetch({ "one", "two", "missing" }))
+      assert_equal(1, db:prefetch("one"))
+      assert_equal(0, db:prefetch())
+      assert_error(nil, function() db:prefetch({ "one", {} }) end)
+      assert_equal(1, db:prefetch({ 12345, "one", 6.5 }))
+      assert_equal("1", db:get("one"))
+      db:close()
+    end
+    local db = assert(cdb.open(mph_name))
+    db:get("key1")
+    assert_equal(1, db:prefetch({ "key1" }))
+    db:close()
+  end
+end
+
+module("non-blocking lookups", lunit.testcase, package.seeall)
+do
+  function test_get_nowait()
+    for _, opts in ipairs{ {}, { mode = "pread" }, { cache_entries = 4 } } do
+      local db = assert(cdb.open(db_name, opts))
+      -- the database was just written, so its pages are resident
+      local done, v = db:get_nowait("one")
+      assert_true(done)
+      assert_equal("1", v)
+      done, v = db:get_nowait("missing")
+      assert_true(done)
+      assert_nil(v)
+      assert_equal("1", db:get_async("one"))
+      local co = coroutine.wrap(function(k) return db:get_async(k) end)
+      assert_equal("2", co("two"))
+      db:close()
+    end
+    local db = assert(cdb.open(mph_name))
+    assert_equal("value1", db:get_async("key1"))
+    db:close()
+    assert_number(cdb.async_fd())
+  end
+end
+
+module("layout optimizer", lunit.testcase, package.seeall)
+do
+  local src = "test_opt_src.cdb"
+  local dest = "test_opt.cdb"
+  local trace = "test_opt.trace"
+
+  function setup()
+    local maker = assert(cdb.make(src, src..".tmp"))
+    for i = 1, 3000 do
+      maker:add("k"..i, "v"..i)
+    end
+    maker:add("k7", "again")
+    maker:add("gone", "x")
+    maker:add("gone", "y", "replace0")
+    assert(maker:finish())
+  end
+
+  function teardown()
+    os.remove(src)
+    os.remove(dest)
+    os.remove(trace)
+  end
+
+  local function check_same()
+    local a, b = assert(cdb.open(src)), assert(cdb.open(dest))
+    for i = 1, 3000, 13 do
+      assert_equal(a:get("k"..i), b:get("k"..i))
+    end
+    assert_equal("again", b:find_all("k7")[2])
+    assert_equal("y", b:get("gone"))
+    a:close()
+    b:close()
+    local st = assert(cdb.analyze(dest))
+    assert_equal(3002, st.records)
+    assert_equal(0, st.dead_records)
+  end
+
+  local function first_keys(n)
+    local db, t = assert(cdb.open(dest)), {}
+    for k in db:pairs() do
+      t[#t + 1] = k
+      if #t == n then break end
+    end
+    db:close()
+    return t
+  end
+
+  function test_hash_order()
+    local ok, st = cdb.optimize(src, dest, dest..".tmp")
+    assert_true(ok)
+    assert_equal(3002, st.records)
+    check_same()
+  end
+
+  function test_trace_order()
+    assert_true(cdb.optimize(src, dest, dest..".tmp",
+      { order = "trace", trace = { "k9", "k7", "k7", "nope", "k9", "k7" } }))
+    check_same()
+    local t = first_keys(3)
+    assert_equal("k7", t[1])
+    assert_equal("k7", t[2])
+    assert_equal("k9", t[3])
+
+    local f = assert(io.open(trace, "wb"))
+    f:write("k100\n\nk5\nk5\n")
+    f:close()
+    local db = assert(cdb.open(src))
+    assert_true(cdb.optimize(db, dest, dest..".tmp", { order = "trace", trace = trace }))
+    db:close()
+    t = first_keys(2)
+    assert_equal("k5", t[1])
+    assert_equal("k100", t[2])
+    assert_error(nil, function() cdb.optimize(src, dest, dest..".tmp", { order = "trace" }) end)
+    assert_nil(cdb.optimize("missing.cdb", dest, dest..".tmp"))
+  end
+
+  function test_from_mph()
+    assert_true(cdb.optimize(mph_name, dest, dest..".tmp"))
+    local db = assert(cdb.open(dest))
+    assert_equal("value1234", db:get("key1234"))
+    assert_equal("mph", db:info().index)
+    db:close()
+  end
+
+  function test_keeps_layout()
+    local maker = assert(cdb.make(src, src..".tmp",
+                                  { placement = "robinhood", load = 0.8 }))
+    for i = 1, 3000 do maker:add("k"..i, "v"..i) end
+    assert(maker:finish())
+    assert_true(cdb.optimize(src, dest, dest..".tmp"))
+    local db = assert(cdb.open(dest))
+    local info = db:info()
+    assert_equal("probe", info.index)
+    assert_equal("robinhood", info.placement)
+    assert_true(math.abs(info.load - 0.8) < 0.01)
+    assert_equal("v2999", db:get("k2999"))
+    db:close()
+
+    maker = assert(cdb.make(src, src..".tmp", { dedup = true }))
+    maker:add("a", string.rep("x", 100))
+    assert(maker:finish())
+    local ok, err = cdb.optimize(src, dest, dest..".tmp")
+    assert_nil(ok)
+    assert_match("shared values", err)
+  end
+end
+
+module("lookup traces", lunit.testcase, package.seeall)
+do
+  local trace = "test_trace.bin"
+
+  function teardown()
+    os.remove(trace)
+  end
+
+  function test_trace()
+    local db = assert(cdb.open(db_name))
+    assert_error(nil, function() db:trace() end)
+    assert_true(db:trace(trace, { ring_kb = 4 }))
+    assert_error(nil, function() db:trace(trace) end)
+    db:get("one")
+    db:get("missing")
+    db:find_all("three")
+    for k in db:pairs() do end
+    local written, dropped = db:trace()
+    assert_equal(0, dropped)
+    -- get, get, find_all and one step per record: one, two, three x2
+    assert_equal(7, written)
+    db:close()
+
+    local f = assert(io.open(trace, "rb"))
+    local data = f:read("*a")
+    f:close()
+    assert_equal("cdbt", data:sub(1, 4))
+    -- 14 bytes per record, and the keys
+    assert_equal(8 + 7 * 14 + 3 + 7 + 5 + 3 + 3 + 5 * 2, #data)
+    assert_equal(string.char(1, 1), data:sub(9, 10))
+    assert_equal("one", data:sub(23, 25))
+    assert_equal(string.char(1, 0), data:sub(26, 27))
+    assert_equal(string.char(2, 2), data:sub(26 + 21, 27 + 21))
+  end
+
+  function test_optimize_by_trace()
+    local src, dest = "test_trace_src.cdb", "test_trace_opt.cdb"
+    local maker = assert(cdb.make(src, src..".tmp"))
+    for i = 1, 2000 do maker:add("k"..i, "v"..i) end
+    assert(maker:finish())
+    local db = assert(cdb.open(src))
+    assert_true(db:trace(trace))
+    for _ = 1, 3 do db:get("k1500") end
+    db:find_all("k20")
+    db:get("missing")
+    for k in db:pairs() do end -- scan steps are not lookups
+    db:trace()
+    db:close()
+
+    assert_true(cdb.optimize(src, dest, dest..".tmp",
+                             { order = "trace", trace = trace }))
+    db = assert(cdb.open(dest))
+    local t = {}
+    for k in db:pairs() do
+      t[#t + 1] = k
+      if #t == 2 then break end
+    end
+    assert_equal("k1500", t[1])
+    assert_equal("k20", t[2])
+    assert_equal("v777", db:get("k777"))
+    db:close()
+    os.remove(src)
+    os.remove(dest)
+  end
+end
+
+module("allocation-free queries", lunit.testcase, package.seeall)
+do
+  function test_queries()
+    for _, opts in ipairs{ {}, { mode = "pread" } } do
+      local db = assert(cdb.open(db_name, opts))
+      assert_true(db:has("one"))
+      assert_false(db:has("missing"))
+      assert_equal(2, db:count("three"))
+      assert_equal(1, db:count("one"))
+      assert_equal(0, db:count("missing"))
+      assert_equal(1, db:len("one"))
+      assert_nil(db:len("missing"))
+      assert_true(db:equals("three", "3"))
+      assert_false(db:equals("three", "III"))
+      assert_false(db:equals("three", ""))
+      assert_false(db:equals("missing", ""))
+      assert_true(db:starts_with("two", ""))
+      assert_true(db:starts_with("two", "2"))
+      assert_false(db:starts_with("two", "22"))
+      assert_false(db:starts_with("missing", ""))
+      assert_error(nil, function() db:equals("one") end)
+      db:close()
+    end
+    local db = assert(cdb.open(mph_name))
+    assert_true(db:has("key1"))
+    assert_equal(1, db:count("key2000"))
+    assert_true(db:starts_with("key42", "value4"))
+    db:close()
+  end
+
+  function test_count_corrupt()
+    corrupt_toc(db_name, "test_corrupt.cdb")
+    for _, opts in ipairs{ {}, { mode = "pread" } } do
+      local db = assert(cdb.open("test_corrupt.cdb", opts))
+      assert_error(nil, function() db:count("three") end)
+      db:close()
+    end
+    os.remove("test_corrupt.cdb")
+  end
+end
+
+module("typed values", lunit.testcase, package.seeall)
+do
+  local name = "test_typed.cdb"
+
+  function teardown()
+    os.remove(name)
+  end
+
+  function test_typed()
+    local maker = assert(cdb.make(name, name..".tmp"))
+    maker:add_int("zero", 0)
+    maker:add_int("neg", -42)
+    maker:add_int("big", 2^53)
+    maker:add_int("n", 1)
+    maker:add_int("n", 2, "replace")
+    maker:add_number("pi", 3.25)
+    maker:add_number("tiny", -1e-300)
+    maker:add("text", "12345")
+    assert_error(nil, function() maker:add_int("x", 1.5) end)
+    assert_error(nil, function() maker:add_int("x", 2^63) end)
+    assert_error(nil, function() maker:add_number("x", "nope") end)
+    assert(maker:finish())
+
+    for _, opts in ipairs{ {}, { mode = "pread" } } do
+      local db = assert(cdb.open(name, opts))
+      assert_equal(0, db:get_int("zero"))
+      assert_equal(-42, db:get_int("neg"))
+      assert_equal(2^53, db:get_int("big"))
+      assert_equal(2, db:get_int("n"))
+      assert_equal(3.25, db:get_number("pi"))
+      assert_equal(-1e-300, db:get_number("tiny"))
+      assert_equal(string.char(0xd6, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff), db:get("neg"))
+      assert_nil(db:get_int("missing"))
+      assert_nil(db:get_number("missing"))
+      assert_error(nil, function() db:get_int("text") end)
+      db:close()
+    end
+  end
+end
+
+module("multi-value iteration", lunit.testcase, package.seeall)
+do
+  local name = "test_multi.cdb"
+
+  function setup()
+    local maker = assert(cdb.make(name, name..".tmp"))
+    for i = 1, 500 do
+      maker:add("many", "v"..i)
+    end
+    maker:add("one", "1")
+    assert(maker:finish())
+  end
+
+  function teardown()
+    os.remove(name)
+  end
+
+  function test_find_iter()
+    for _, opts in ipairs{ {}, { mode = "pread" } } do
+      local db = assert(cdb.open(name, opts))
+      local n = 0
+      for v in db:find_iter("many") do
+        n = n + 1
+        assert_equal("v"..n, v)
+        -- other lookups in between do not disturb the iteration
+        assert_equal("1", db:get("one"))
+      end
+      assert_equal(500, n)
+      for v in db:find_iter("missing") do fail("no values expected") end
+      local it = db:find_iter("many")
+      assert_equal("v1", it())
+      assert_true(db:reload())
+      assert_error(nil, it)
+      db:close()
+    end
+  end
+
+  function test_find_all_page()
+    local db = assert(cdb.open(name))
+    local t = db:find_all("many", { limit = 3 })
+    assert_equal(3, #t)
+    assert_equal("v1", t[1])
+    t = db:find_all("many", { offset = 10, limit = 2 })
+    assert_equal(2, #t)
+    assert_equal("v11", t[1])
+    assert_equal("v12", t[2])
+    assert_equal(2, #db:find_all("many", { offset = 498 }))
+    assert_equal(0, #db:find_all("many", { offset = 500 }))
+    assert_equal(0, #db:find_all("many", { limit = 0 }))
+    assert_equal(500, #db:find_all("many"))
+    db:close()
+  end
+
+  function test_find_all_corrupt()
+    corrupt_toc(name, "test_corrupt.cdb")
+    for _, opts in ipairs{ {}, { mode = "pread" } } do
+      local db = assert(cdb.open("test_corrupt.cdb", opts))
+      assert_error(nil, function() db:find_all("many") end)
+      assert_error(nil, function() db:find_all("many", { offset = 10, limit = 2 }) end)
+      db:close()
+    end
+    os.remove("test_corrupt.cdb")
+  end
+end
+
+module("handle pool", lunit.testcase, package.seeall)
+do
+  local names = {}
+  for i = 1, 5 do names[i] = "test_pool"..i..".cdb" end
+
+  function setup()
+    for i, name in ipairs(names) do
+      local maker = assert(cdb.make(name, name..".tmp"))
+      maker:add("id", tostring(i))
+      maker:add("pad", ("x"):rep(i * 1000))
+      assert(maker:finish())
+    end
+  end
+
+  function teardown()
+    for _, name in ipairs(names) do os.remove(name) end
+  end
+
+  function test_max_open()
+    local pool = cdb.pool{ max_open = 2 }
+    local dbs = {}
+    for i, name in ipairs(names) do
+      dbs[i] = assert(pool:get(name))
+      assert_equal(tostring(i), dbs[i]:get("id"))
+      assert_true(pool:stats().open <= 2)
+    end
+    assert_equal(dbs[5], pool:get(names[5]))
+    -- the first handle was closed for the others, and reopens on use
+    assert_equal("1", dbs[1]:get("id"))
+    local st = pool:stats()
+    assert_equal(5, st.handles)
+    assert_equal(2, st.open)
+    assert_equal(6, st.opens)
+    assert_equal(4, st.evictions)
+    -- close only gives the file back
+    dbs[1]:close()
+    assert_equal(1, pool:stats().open)
+    assert_equal(1000, #dbs[1]:get("pad"))
+    assert_true(dbs[1]:reload())
+    assert_equal(2, pool:stats().open)
+  end
+
+  function test_max_mapped()
+    local size = {}
+    for i, name in ipairs(names) do
+      local f = io.open(name, "rb")
+      size[i] = f:seek("end")
+      f:close()
+    end
+    local pool = cdb.pool{ max_mapped_bytes = size[4] + size[5] }
+    for i = 1, 5 do
+      assert_equal(tostring(i), assert(pool:get(names[i])):get("id"))
+      assert_true(pool:stats().mapped_bytes <= size[4] + size[5])
+    end
+    assert_equal(size[4] + size[5], pool:stats().mapped_bytes)
+    local small = cdb.pool{ max_mapped_bytes = size[1] }
+    local ok, err = small:get(names[2])
+    assert_nil(ok)
+    assert_string(err)
+    assert_nil(small:get("missing.cdb"))
+  end
+
+  function test_open_errors()
+    -- a directory maps as nothing: the error is mmap's, not the format's
+    for _, open in ipairs{ cdb.open, function(name) return cdb.pool():get(name) end } do
+      local ok, err = open(".")
+      assert_nil(ok)
+      assert_nil(err:match("not a valid database"))
+      ok, err = open(names[1]..".missing")
+      assert_nil(ok)
+      assert_match("No such file", err)
+    end
+    local f = assert(io.open(names[1], "wb"))
+    f:write(("\0"):rep(1000))
+    f:close()
+    local ok, err = cdb.open(names[1])
+    assert_match("not a valid database", err)
+  end
+
+  function test_collected_handles()
+    local pool = cdb.pool{ max_open = 2 }
+    for i = 1, 5 do
+      assert_equal(tostring(i), assert(pool:get(names[i])):get("id"))
+    end
+    local kept = assert(pool:get(names[5]))
+    collectgarbage()
+    collectgarbage()
+    local st = pool:stats()
+    assert_equal(1, st.handles)
+    assert_equal(1, st.open)
+    assert_equal(kept, pool:get(names[5]))
+    assert_equal("1", assert(pool:get(names[1])):get("id"))
+    assert_equal(2, pool:stats().handles)
+  end
+
+  function test_get_options()
+    local pool = cdb.pool{ max_open = 1, max_mapped_bytes = 70000 }
+    local db = assert(pool:get(names[1], { mode = "pread", cache_mb = 0.0625,
+                                          cache_entries = 4 }))
+    assert_equal("1", db:get("id"))
+    assert_number(db:cache_stats().block_misses)
+    assert_equal(4, db:cache_stats().max_entries)
+    -- counted by its block cache, not its file
+    assert_equal(65536, pool:stats().mapped_bytes)
+    -- a later get keeps the handle as it was opened, and so do reopens
+    assert_equal(db, pool:get(names[1]))
+    assert(pool:get(names[2]))
+    assert_equal(1000, #db:get("pad"))
+    assert_number(db:cache_stats().block_misses)
+    assert_nil(pool:get(names[3], { mode = "pread", cache_mb = 1 }))
+    assert_error(nil, function() pool:get(names[4], { mode = "bad" }) end)
+    local loaded = assert(pool:get(names[5], { load = true }))
+    assert_equal("5", loaded:get("id"))
+    assert_nil(loaded:cache_stats().block_misses)
+  end
+
+  -- a new file in place of names[i], with the record of i doubled
+  local function replace(i)
+    local maker = assert(cdb.make(names[i], names[i]..".tmp"))
+    maker:add("id", tostring(i))
+    maker:add("id", tostring(i))
+    maker:add("pad", ("y"):rep(i * 1000))
+    assert(maker:finish())
+  end
+
+  function test_iterator_across_eviction()
+    -- as small as names[1], for its mapping to take the place of that one
+    local maker = assert(cdb.make("test_pool_other.cdb", "test_pool_other.tmp"))
+    maker:add("other", "x")
+    assert(maker:finish())
+    for _, opts in ipairs{ {}, { mode = "pread" }, { load = true } } do
+      local pool = cdb.pool{ max_open = 1 }
+      local db = assert(pool:get(names[1], opts))
+      local it = db:find_iter("id")
+      local chunk = db:chunks("pad", 300)
+      assert(pool:get(names[2]))
+      -- an eviction alone does not end them
+      assert_equal("1", it())
+      assert(pool:get(names[2]))
+      assert_nil(it())
+      assert_equal(300, #chunk())
+      assert(pool:get(names[2]))
+      assert_equal(300, #chunk())
+      -- nor does a reopen at another address
+      it = db:find_iter("id")
+      db:close()
+      local other = assert(cdb.open("test_pool_other.cdb", opts))
+      assert_equal("1", it())
+      assert_nil(it())
+      other:close()
+      -- a file replaced while evicted does
+      it = db:find_iter("id")
+      assert(pool:get(names[2]))
+      replace(1)
+      assert_error(nil, it)
+      assert_error(nil, chunk)
+      assert_equal(2, #db:find_all("id"))
+      setup()
+    end
+    os.remove("test_pool_other.cdb")
+  end
+
+  function test_pairs_across_eviction()
+    local pool = cdb.pool{ max_open = 1 }
+    local n = 0
+    for k in assert(pool:get(names[1])):pairs() do
+      assert(pool:get(names[2]))
+      n = n + 1
+    end
+    assert_equal(2, n)
+    local ok, err = pcall(function()
+      for k in assert(pool:get(names[1])):pairs() do
+        assert(pool:get(names[2]))
+        replace(1)
+      end
+    end)
+    assert_false(ok)
+    assert_match("during pairs", err)
+    -- and across a reload of a plain db
+    local db = assert(cdb.open(names[3]))
+    ok, err = pcall(function()
+      for k in db:pairs() do db:reload() end
+    end)
+    assert_false(ok)
+    assert_match("during pairs", err)
+    local n = 0
+    for k in db:pairs() do n = n + 1 end
+    assert_equal(2, n)
+    db:close()
+  end
+end
+
+module("shared values", lunit.testcase, package.seeall)
+do
+  local name = "test_dedup.cdb"
+  local plain = "test_dedup_plain.cdb"
+  local vals = { ("a"):rep(1000), ("b"):rep(3000), "short" }
+
+  local function build(file, opts)
+    local maker = assert(cdb.make(file, file..".tmp", opts))
+    for i = 1, 3000 do
+      maker:add("k"..i, vals[i % 3 + 1])
+    end
+    maker:add("k1", "own value for k1")
+    maker:add_int("n", 42)
+    return maker
+  end
+
+  function setup()
+    assert(build(name, { dedup = true }):finish())
+    assert(build(plain):finish())
+  end
+
+  function teardown()
+    os.remove(name)
+    os.remove(plain)
+  end
+
+  function test_lookups()
+    local size = {}
+    for _, file in ipairs{ name, plain } do
+      local f = io.open(file, "rb")
+      size[file] = f:seek("end")
+      f:close()
+    end
+    assert_true(size[name] * 10 < size[plain])
+    for _, opts in ipairs{ {}, { mode = "pread" }, { index = "mph" } } do
+      local file = name
+      if opts.index then
+        file = "test_dedup_mph.cdb"
+        local maker = assert(cdb.make(file, file..".tmp",
+                                      { dedup = true, index = "mph" }))
+        for i = 1, 3000 do maker:add("k"..i, vals[i % 3 + 1]) end
+        assert(maker:finish())
+      end
+      local db = assert(cdb.open(file, opts))
+      for _, i in ipairs{ 2, 3, 4, 2999, 3000 } do
+        assert_equal(vals[i % 3 + 1], db:get("k"..i))
+        assert_equal(#vals[i % 3 + 1], db:len("k"..i))
+      end
+      assert_equal(("b"):rep(10), db:read("k1", 2990))
+      if not opts.index then
+        local all = db:find_all("k1")
+        assert_equal(2, #all)
+        assert_equal(vals[2], all[1])
+        assert_equal("own value for k1", all[2])
+        assert_equal(42, db:get_int("n"))
+      end
+      local n = 0
+      for k, v in db:pairs() do
+        n = n + 1
+        if k == "k5" then assert_equal(vals[3], v) end
+      end
+      assert_equal(opts.index and 3000 or 3002, n)
+      db:close()
+      if opts.index then os.remove(file) end
+    end
+  end
+
+  function test_analyze()
+    local a = assert(cdb.analyze(name))
+    assert_equal(3002, a.records)
+    assert_equal(2 * 999, a.shared_values) -- "short" is not worth sharing
+    assert_equal(assert(cdb.analyze(plain)).value_bytes, a.value_bytes)
+    assert_equal(0, assert(cdb.analyze(plain)).shared_values)
+  end
+
+  function test_restrictions()
+    local maker = assert(cdb.make("test_dedup2.cdb", "test_dedup2.cdb.tmp",
+                                  { dedup = true }))
+    maker:add("x", vals[1])
+    assert_error(nil, function() maker:add("x", vals[1], "replace") end)
+    assert_error(nil, function() maker:merge(name) end)
+    maker:merge(plain)
+    maker:add("y", vals[1], "insert")
+    assert(maker:finish())
+    local db = assert(cdb.open("test_dedup2.cdb"))
+    assert_equal(vals[1], db:get("y"))
+    assert_equal(vals[2], db:get("k1"))
+    db:close()
+    os.remove("test_dedup2.cdb")
+    assert_nil(cdb.optimize(name, "test_dedup3.cdb", "test_dedup3.cdb.tmp"))
+    os.remove("test_dedup3.cdb.tmp")
+  end
+end
+
+module("table placement", lunit.testcase, package.seeall)
+do
+  local files = {}
+
+  local function build(file, opts)
+    local maker = assert(cdb.make(file, file..".tmp", opts))
+    for i = 1, 20000 do
+      maker:add("key"..i, "v"..i)
+      if i % 100 == 0 then maker:add("key"..i, "again"..i) end
+    end
+    local ok, st = maker:finish()
+    assert_true(ok)
+    files[#files + 1] = file
+    return st
+  end
+
+  function teardown()
+    for _, file in ipairs(files) do os.remove(file) end
+    files = {}
+  end
+
+  local function check(file)
+    local db = assert(cdb.open(file))
+    for i = 1, 20000, 7 do
+      assert_equal("v"..i, db:get("key"..i))
+    end
+    local all = db:find_all("key300")
+    assert_equal(2, #all)
+    assert_equal("v300", all[1])
+    assert_equal("again300", all[2])
+    assert_nil(db:get("absent"))
+    db:close()
+  end
+
+  function test_robinhood()
+    for _, load in ipairs{ 0.5, 0.9 } do
+      local lin = build("test_linear.cdb", { load = load })
+      local rh = build("test_rh.cdb", { load = load, placement = "robinhood" })
+      check("test_linear.cdb")
+      check("test_rh.cdb")
+      assert_equal(lin.slots, rh.slots)
+      -- the same total distance, shared out more evenly
+      assert_true(math.abs(lin.mean_probe - rh.mean_probe) < 1e-9)
+      assert_true(rh.max_probe <= lin.max_probe)
+      local a = assert(cdb.analyze("test_rh.cdb"))
+      assert_equal(rh.max_probe, a.max_probe)
+      assert_equal(rh.max_miss, a.max_miss)
+      assert_true(math.abs(rh.mean_miss - a.mean_miss) < 1e-9)
+    end
+  end
+
+  function test_load()
+    local half = build("test_load5.cdb", {})
+    local full = build("test_load10.cdb", { load = 1 })
+    local dense = build("test_load9.cdb", { load = 0.9, placement = "robinhood" })
+    check("test_load10.cdb")
+    assert_equal(2 * half.indexed, half.slots)
+    assert_equal(full.indexed, full.slots)
+    assert_true(math.abs(dense.load - 0.9) < 0.01)
+    assert_true(dense.mean_miss > half.mean_miss)
+    assert_error(nil, function() cdb.make("x.cdb", "x.cdb.tmp", { load = 0 }) end)
+    assert_error(nil, function() cdb.make("x.cdb", "x.cdb.tmp", { load = 1.5 }) end)
+    assert_error(nil, function()
+      cdb.make("x.cdb", "x.cdb.tmp", { placement = "cuckoo" })
+    end)
+  end
+
+  function test_spilled()
+    local st = build("test_rh_spill.cdb",
+                     { memory_limit = 4096, load = 0.8, placement = "robinhood" })
+    check("test_rh_spill.cdb")
+    assert_true(math.abs(st.load - 0.8) < 0.01)
+    assert_equal(st.max_miss, assert(cdb.analyze("test_rh_spill.cdb")).max_miss)
+  end
+end
+
+module("stored metadata", lunit.testcase, package.seeall)
+do
+  local files = {}
+
+  local function build(file, opts, fill)
+    local maker = assert(cdb.make(file, file..".tmp", opts))
+    fill(maker)
+    assert(maker:finish())
+    files[#files + 1] = file
+    return assert(cdb.open(file))
+  end
+
+  local function fill(maker)
+    for i = 1, 5000 do
+      maker:add("key"..i, "value"..i)
+      if i % 10 == 0 then maker:add("key"..i, "more"..i) end
+    end
+  end
+
+  local function bytes(n, fmt)
+    local total = 0
+    for i = 1, n do total = total + #fmt:format(i) end
+    return total
+  end
+
+  function teardown()
+    for _, file in ipairs(files) do os.remove(file) end
+    files = {}
+  end
+
+  function test_info()
+    local db = build("test_meta.cdb", {}, fill)
+    local info = assert(db:info())
+    assert_equal(5500, info.records)
+    assert_equal(5000, info.keys)
+    assert_equal(bytes(5000, "key%d") + bytes(500, "key%d0"), info.key_bytes)
+    assert_equal(bytes(5000, "value%d") + bytes(500, "more%d0"),
+                 info.value_bytes)
+    assert_equal("probe", info.index)
+    assert_false(info.dedup)
+    assert_equal("linear", info.placement)
+    assert_equal(0.5, info.load)
+    db:close()
+
+    for _, opts in ipairs{ { memory_limit = 4096 },
+                           { placement = "robinhood", load = 0.8 } } do
+      db = build("test_meta2.cdb", opts, fill)
+      info = db:info()
+      assert_equal(5500, info.records)
+      assert_equal(5000, info.keys)
+      if opts.load then
+        assert_equal("robinhood", info.placement)
+        assert_equal(0.8, info.load)
+      end
+      db:close()
+    end
+  end
+
+  function test_keys_with_many_records()
+    for _, opts in ipairs{ {}, { placement = "robinhood", load = 0.9 } } do
+      local db = build("test_meta.cdb", opts, function(maker)
+        for i = 1, 1000 do
+          maker:add("k"..i, "v")
+          if i % 5 == 0 then maker:add("dup", "v"..i) end
+        end
+      end)
+      assert_equal(1001, db:info().keys)
+      assert_equal(1001, assert(cdb.analyze(db)).keys)
+      db:close()
+    end
+  end
+
+  function test_info_follows_the_build()
+    local db = build("test_meta.cdb", { index = "mph" }, function(maker)
+      for i = 1, 100 do maker:add("k"..i, "v") end
+    end)
+    local info = db:info()
+    assert_equal("mph", info.index)
+    assert_equal(100, info.keys)
+    assert_nil(info.placement)
+    db:close()
+
+    db = build("test_meta2.cdb", {}, function(maker)
+      maker:add("a", "12345")
+      maker:add("a", "123", "replace")
+      maker:add("b", "1")
+      maker:add("b", "12", "replace0")
+      maker:merge("test_meta.cdb")
+    end)
+    info = db:info()
+    assert_equal(102, info.records)
+    assert_equal(102, info.keys)
+    assert_equal(2 + bytes(100, "k%d"), info.key_bytes)
+    assert_equal(5 + 100, info.value_bytes)
+    db:close()
+
+    local long = ("x"):rep(100)
+    db = build("test_meta3.cdb", { dedup = true }, function(maker)
+      for i = 1, 10 do maker:add("d"..i, long) end
+    end)
+    info = db:info()
+    assert_true(info.dedup)
+    assert_equal(1000, info.value_bytes)
+    assert_true(info.size - 2048 < info.value_bytes)
+    db:close()
+  end
+
+  function test_load_all()
+    for _, opts in ipairs{ {}, { mode = "pread" } } do
+      build("test_meta.cdb", {}, fill)
+      local db = assert(cdb.open("test_meta.cdb", opts))
+      local t = db:load_all()
+      local n = 0
+      for k, v in pairs(t) do
+        n = n + 1
+        assert_equal(db:get(k), v)
+      end
+      assert_equal(5000, n)
+      assert_equal("value10", t.key10)
+      db:close()
+    end
+    local db = build("test_meta2.cdb", {}, function(maker)
+      for i = 1, 300 do maker:add("u"..i, i) end
+    end)
+    local t = db:load_all()
+    assert_equal("300", t.u300)
+    db:close()
+  end
+end
+
+module("in-memory databases", lunit.testcase, package.seeall)
+do
+  local name = "test_mem.cdb"
+  local blob
+
+  function setup()
+    local maker = assert(cdb.make(name, name..".tmp"))
+    for i = 1, 2000 do maker:add("key"..i, "value"..i) end
+    maker:add("key1", "second")
+    assert(maker:finish())
+    local f = assert(io.open(name, "rb"))
+    blob = f:read("*a")
+    f:close()
+  end
+
+  function teardown()
+    os.remove(name)
+  end
+
+  local function check(db)
+    assert_equal("value1", db:get("key1"))
+    assert_equal("value2000", db:get("key2000"))
+    assert_nil(db:get("key0"))
+    local all = db:find_all("key1")
+    assert_equal(2, #all)
+    assert_equal("second", all[2])
+    assert_equal(7, db:len("key99"))
+    assert_equal("lue", db:read("key9", 2, 3))
+    local ok, v = db:get_nowait("key7")
+    assert_true(ok)
+    assert_equal("value7", v)
+    local n = 0
+    for k, v in db:pairs() do n = n + 1 end
+    assert_equal(2001, n)
+    assert_equal(2000, db:info().keys)
+  end
+
+  function test_open_string()
+    local db = assert(cdb.open_string(blob, { cache_entries = 10 }))
+    blob = nil
+    collectgarbage()
+    collectgarbage()
+    check(db)
+    assert_equal("value5", db:get("key5"))
+    assert_equal("value5", db:get("key5"))
+    assert_equal(1, db:cache_stats().hits)
+    assert_nil(db:reload())
+    check(db)
+    db:close()
+    assert_error(nil, function() db:get("key1") end)
+  end
+
+  function test_not_a_database()
+    assert_nil(cdb.open_string("too short"))
+    assert_error(nil, function() cdb.open_string({}) end)
+  end
+
+  function test_load()
+    for _, huge in ipairs{ false, true } do
+      local db = assert(cdb.open(name, { load = true, huge_pages = huge }))
+      os.remove(name) -- all of it is in memory
+      check(db)
+      local f = assert(io.open(name, "wb"))
+      f:write(blob)
+      f:close()
+      assert_true(db:reload())
+      check(db)
+      db:close()
+    end
+    assert_error(nil, function() cdb.open(name, { load = true, mode = "pread" }) end)
+  end
+
+  function test_optimize_from_memory()
+    local db = assert(cdb.open_string(blob))
+    assert(cdb.optimize(db, "test_mem2.cdb", "test_mem2.cdb.tmp"))
+    local copy = assert(cdb.open("test_mem2.cdb"))
+    assert_equal("value1", copy:get("key1"))
+    copy:close()
+    os.remove("test_mem2.cdb")
+    local a = assert(cdb.analyze(db))
+    assert_equal(2001, a.records)
+    db:close()
+  end
+end
+
+module("in-memory builder", lunit.testcase, package.seeall)
+do
+  local name = "test_mkbuf.cdb"
+
+  local function fill(maker)
+    for i = 1, 3000 do maker:add("key"..i, "value"..i) end
+    maker:add("key1", "second")
+  end
+
+  function teardown()
+    os.remove(name)
+  end
+
+  function test_same_as_file()
+    local maker = assert(cdb.make_buffer())
+    fill(maker)
+    local s, st = maker:finish()
+    assert_equal("string", type(s))
+    assert_equal(3001, st.records)
+    assert_error(nil, function() maker:add("k", "v") end)
+    maker = assert(cdb.make(name, name..".tmp"))
+    fill(maker)
+    assert(maker:finish())
+    local f = assert(io.open(name, "rb"))
+    assert_equal(f:read("*a"), s)
+    f:close()
+    local db = assert(cdb.open_string(s))
+    assert_equal("value3000", db:get("key3000"))
+    assert_equal(2, #db:find_all("key1"))
+    assert_equal(3000, db:info().keys)
+    db:close()
+  end
+
+  function test_put_modes()
+    local maker = assert(cdb.make_buffer({ size = 100 }))
+    maker:add("a", string.rep("x", 10000))
+    maker:add("b", "2")
+    maker:add("a", "1", "replace")
+    maker:add("b", "3", "replace0")
+    maker:add("b", "4", "insert")
+    local s = maker:finish()
+    local db = assert(cdb.open_string(s))
+    assert_equal("1", db:get("a"))
+    assert_equal("3", db:get("b"))
+    assert_equal(2, db:info().records)
+    db:close()
+    -- the record removed leaves no trailing bytes behind
+    assert_true(#s < 10000)
+  end
+
+  function test_layouts()
+    for _, opts in ipairs{ { index = "mph" }, { dedup = true },
+                           { placement = "robinhood", load = 0.9 } } do
+      local maker = assert(cdb.make_buffer(opts))
+      for i = 1, 500 do maker:add("k"..i, "v"..(i % 7)) end
+      local db = assert(cdb.open_string((maker:finish())))
+      for i = 1, 500, 37 do assert_equal("v"..(i % 7), db:get("k"..i)) end
+      assert_nil(db:get("k0"))
+      db:close()
+    end
+  end
+
+  function test_merge()
+    local shard = assert(cdb.make_buffer())
+    shard:add("s1", "one")
+    local maker = assert(cdb.make_buffer())
+    maker:add("m", "main")
+    maker:merge(shard)
+    assert_error(nil, function() shard:add("x", "y") end)
+    local other = assert(cdb.make_buffer())
+    other:add("s2", "two")
+    local file = assert(cdb.make(name, name..".tmp"))
+    file:merge(other)
+    file:merge(assert(cdb.open_string((maker:finish()))))
+    assert(file:finish())
+    local db = assert(cdb.open(name))
+    assert_equal("one", db:get("s1"))
+    assert_equal("two", db:get("s2"))
+    assert_equal("main", db:get("m"))
+    db:close()
+  end
+
+  function test_options()
+    assert_error(nil, function() cdb.make_buffer({ load = 2 }) end)
+    assert_error(nil, function() cdb.make_buffer({ size = -1 }) end)
+    local maker = assert(cdb.make_buffer())
+    maker:add("k", "v")
+    maker = nil
+    collectgarbage()
+    collectgarbage()
+  end
+end